@@ -0,0 +1,104 @@
+#ifndef CHESSLINE_H
+#define CHESSLINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libchessline: repertoire parsing and drilling without process-wide state.
+ *
+ * Build the library from main.c without the command line interface:
+ *
+ *     $ gcc -O2 -fPIC -DCHESSLINE_LIBRARY -c main.c -o chessline.o
+ *     $ ar rcs libchessline.a chessline.o
+ *     $ gcc -shared chessline.o -lm -pthread -o libchessline.so
+ *
+ * A repertoire is read only once loaded, any number of sessions may drill it concurrently, one thread per
+ * session. Nothing is written to the standard streams and the process is never exited, all failures are
+ * reported as a status. Memory goes through the allocator given to chessline_load.
+ * Only the chessline_* functions declared here are exported, so the library links into any program.
+ * Builds with CHESSLINE_STATS count into process-wide statistics, updated atomically.
+ */
+
+typedef enum {
+    chesslineOk = 0,
+    chesslineOutOfMemory,
+    chesslineIoError,
+    chesslineSyntaxError, // the repertoire could not be parsed, see the error message
+    chesslineInvalidMove, // not a move in algebraic notation, or illegal in the current position
+    chesslineWrongMove, // legal, but not in the repertoire
+    chesslineEndOfLine // no move left in the line
+} chesslineStatus;
+
+/** Memory functions, with the context passed back on each call. NULL in chessline_load uses malloc. */
+typedef struct {
+    void* (*allocate)(void* context, size_t size);
+    void* (*reallocate)(void* context, void* pointer, size_t size);
+    void (*release)(void* context, void* pointer);
+    void* context;
+} chesslineAllocator;
+
+/** Source of the repertoire text: read returns the number of bytes read, 0 at the end and -1 on error. */
+typedef struct {
+    long (*read)(void* context, char* buffer, size_t size);
+    void* context;
+} chesslineReader;
+
+typedef struct chesslineRepertoireTag chesslineRepertoire;
+typedef struct chesslineSessionTag chesslineSession;
+typedef struct chesslineSchedulerTag chesslineScheduler;
+
+/** Set up the position hashing and the tokenizer. Thread-safe, later calls do nothing. */
+void chessline_init(void);
+
+/** Text held in memory, read from offset on. */
+typedef struct {
+    const char* text;
+    size_t length;
+    size_t offset;
+} chesslineMemoryInput;
+
+/** Create a reader over input, which must outlive the call to chessline_load. */
+chesslineReader chessline_memory_reader(chesslineMemoryInput* input);
+
+/**
+ * Parse a repertoire. On failure repertoire is set to NULL and, unless errorMessage is NULL, a description
+ * of the error with its line and column is written to it.
+ */
+chesslineStatus chessline_load(chesslineReader reader, const chesslineAllocator* allocator, chesslineRepertoire** repertoire, char* errorMessage, size_t errorSize);
+void chessline_free(chesslineRepertoire* repertoire);
+
+/** Start drilling a repertoire from its first position. Replies are drawn from a generator seeded with seed. */
+chesslineStatus chessline_session_new(chesslineRepertoire* repertoire, uint64_t seed, chesslineSession** session);
+void chessline_session_free(chesslineSession* session);
+void chessline_session_reset(chesslineSession* session);
+
+/** Play the trainee's move, in algebraic notation. The session only advances on chesslineOk. */
+chesslineStatus chessline_session_play(chesslineSession* session, const char* san);
+
+/**
+ * Draw one of the moves of the repertoire at the current position, according to their weights, and play it.
+ * Unless san is NULL, its algebraic notation is written to it, size must then be at least 16.
+ */
+chesslineStatus chessline_session_reply(chesslineSession* session, char* san, size_t size);
+
+/** Whether the repertoire has no move left at the current position. */
+bool chessline_session_finished(chesslineSession* session);
+
+/** Hash of the current position, the same as used by progress stores and position indexes. */
+uint64_t chessline_session_position(chesslineSession* session);
+
+/**
+ * Create a scheduler of the whole lines of a repertoire. It draws a line by its probability, the product of the
+ * weights of its moves, times a factor that doubles on each wrong move played on the line and halves each time
+ * the line is completed without one. Drawing and reweighting a line take O(log n) in the number of lines.
+ * A scheduler tracks a single trainee, sessions sharing it must not be used concurrently.
+ */
+chesslineStatus chessline_scheduler_new(chesslineRepertoire* repertoire, chesslineScheduler** scheduler);
+void chessline_scheduler_free(chesslineScheduler* scheduler);
+
+/** Draw the replies of session along the lines of scheduler, or by the weights of each move when NULL. */
+void chessline_session_schedule(chesslineSession* session, chesslineScheduler* scheduler);
+
+#endif
@@ -1,16 +1,33 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
 #include <locale.h>
 #include <wchar.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include "chessline.h"
+#ifdef CHESSLINE_SYZYGY
+#include "tbprobe.h"
+#endif
 
 #define BUFFER_SIZE 257
 // backtrack needed because what may look like a departure position may be destination position
 #define ERROR_MESSAGE_SIZE 256
+#define ERROR_QUOTE_LENGTH 192 // longest token or message quoted in an error message, to leave room for the text around it
+#define SOURCE_LINE_ORDER_BITS 20 // gap between consecutive lines, to order lines inserted on reload
 #define DARK_TILE_COLOR 130
 #define LIGHT_TILE_COLOR 223
 #define WHITE_PIECE_COLOR 250
@@ -29,36 +46,107 @@
 typedef enum {symbolToken = 1, fullMoveToken = 2, openTagToken = 3, closeTagToken = 4, quotedStringToken = 5, probabilityToken = 6} tokenType;
 typedef enum {white, black} playerSide;
 typedef enum {pawn=1, knight=2, bishop=3, rook=4, queen=5, king=6} pieceEnum;
-char pieceSymbol[] = {'P', 'N', 'B', 'R', 'Q', 'K'};
+static char pieceSymbol[] = {'P', 'N', 'B', 'R', 'Q', 'K'};
 // map offset from letter 'B' => piece enum, -1 for invalid pieces
-int8_t pieceLookup[] = {3, -1, -1, -1, -1, -1, -1, -1, -1, 6, -1, -1, 2, -1, 1, 5, 4};
+static int8_t pieceLookup[] = {3, -1, -1, -1, -1, -1, -1, -1, -1, 6, -1, -1, 2, -1, 1, 5, 4};
+
+/** Piece of an uppercase letter, -1 for anything else. */
+static int piece_of_letter(char c) {
+    return c >= 'B' && c <= 'R' ? pieceLookup[c - 'B'] : -1;
+}
 
 typedef enum {empty = 0, blackPawn = -1, blackKnight = -2, blackBishop = -3, blackRook = -4, blackQueen = -5, blackKing = -6, whitePawn = 1, whiteKnight = 2, whiteBishop = 3, whiteRook = 4, whiteQueen = 5, whiteKing = 6} sidedPiece;
 typedef enum {aFile = 1, bFile = 2, cFile = 3, dFile = 4, eFile = 5, fFile = 6, gFile = 7, hFile = 8} chessFile;
 
-void print_board(sidedPiece board[8][8], bool aswhite) {
-    for (int rank = aswhite ? 7 : 0; aswhite ? rank >= 0 : rank < 8; aswhite ? rank-- : rank++) {
-        for (int file = aswhite ? 0 : 7; aswhite ? file <= 7 : file >= 0; aswhite ? file++ : file--) {
-            sidedPiece sp = board[rank][file];
-            pieceEnum p = sp > 0 ? sp : -sp;
-            wchar_t unicodePoint = UNICODE_BLACK_CHESS_PAWN - p + 1;
-            if (p == 0) {
-                unicodePoint = UNICODE_SPACE;
-            }
+#define STATS_MAX_DEPTH 256
+#define STATS_MAX_BRANCHING 32
 
-            int tileColor = (rank+file) % 2 == 0 ? DARK_TILE_COLOR : LIGHT_TILE_COLOR;
-            int pieceColor = sp > 0 ? WHITE_PIECE_COLOR : BLACK_PIECE_COLOR;
+typedef struct {
+    uint64_t calls;
+    uint64_t totalNs;
+    uint64_t maxNs;
+} statsTimer;
 
-            // set foreground color, set background color and print unicode point
-            // only half of the chess piece appears unless there is a space after it
-            wprintf(L"\e[38;5;%dm\e[48;5;%dm %lc ", pieceColor, tileColor, unicodePoint);
-        }
-        // reset colors and newline
-        wprintf(L"\e[0m\n");
+/**
+ * Hot path counters, only collected when compiled with -DCHESSLINE_STATS. They are updated atomically, as
+ * walker threads count their allocations and timers concurrently.
+ * Histograms count nodes per depth and per number of children, the last bucket also holds anything larger.
+ */
+typedef struct {
+    statsTimer nextToken;
+    statsTimer parseAlgebraicNotation;
+    statsTimer parse;
+    statsTimer boardApplyMove;
+    statsTimer chooseMove;
+    statsTimer printBoard;
+    uint64_t allocations;
+    uint64_t allocatedBytes;
+    uint64_t nodes;
+    uint64_t maxDepth;
+    uint64_t depthHistogram[STATS_MAX_DEPTH];
+    uint64_t branchingHistogram[STATS_MAX_BRANCHING];
+} statistics;
+
+#if defined(CHESSLINE_STATS) || !defined(CHESSLINE_LIBRARY)
+/** Monotonic clock of the statistics timers, also used by the command line for its own timings. */
+static uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+#ifdef CHESSLINE_STATS
+static statistics stats;
+
+static void stats_add(uint64_t* counter, uint64_t value) {
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void stats_max(uint64_t* counter, uint64_t value) {
+    uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > current && !__atomic_compare_exchange_n(counter, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
     }
-    wprintf(L"\n");
 }
 
+typedef struct {
+    statsTimer* timer;
+    uint64_t startNs;
+} statsTimerScope;
+
+/** Cleanup handler of STATS_TIMER, runs on every return path of the timed function. */
+static void stats_timer_stop(statsTimerScope* scope) {
+    uint64_t elapsed = stats_now_ns() - scope->startNs;
+    stats_add(&scope->timer->calls, 1);
+    stats_add(&scope->timer->totalNs, elapsed);
+    stats_max(&scope->timer->maxNs, elapsed);
+}
+
+// time the rest of the enclosing scope
+#define STATS_TIMER(name) statsTimerScope name##Scope __attribute__((cleanup(stats_timer_stop))) = { &stats.name, stats_now_ns() }
+#define STATS_ALLOC(bytes) (stats_add(&stats.allocations, 1), stats_add(&stats.allocatedBytes, (bytes)))
+#else
+#define STATS_TIMER(name) ((void)0)
+#define STATS_ALLOC(bytes) ((void)0)
+#endif
+
+static void* default_allocate(void* context, size_t size) {
+    (void)context;
+    return malloc(size);
+}
+
+static void* default_reallocate(void* context, void* pointer, size_t size) {
+    (void)context;
+    return realloc(pointer, size);
+}
+
+static void default_release(void* context, void* pointer) {
+    (void)context;
+    free(pointer);
+}
+
+static const chesslineAllocator defaultAllocator = {default_allocate, default_reallocate, default_release, NULL};
+
 typedef struct {
     chessFile file;
     int rank;
@@ -85,17 +173,14 @@ typedef struct moveTreeTag {
     bool isRoot;
     int fullMoveNo;
     int halfMoveNo; // from start of game for backtracking, not draw clock
+    uint32_t firstLeaf; // of the subtree in depth-first order, see number_leaves
     struct moveTreeTag* firstChoice;
     struct moveTreeTag* nextChoice;
     struct moveTreeTag* previousMove;
+    struct sourceLineTag* line; // input line that created the node, when the parser tracks lines
 } moveTree;
 
-move* new_move() {
-    move* m = (move*)malloc(sizeof(move));
-    if (m == NULL) {
-        fprintf(stderr, "failed to allocate memory for new move\n");
-        exit(1);
-    }
+static void init_move(move* m) {
     m->departurePosition.file = 0;
     m->departurePosition.rank = 0;
     m->destination.file = 0;
@@ -103,24 +188,32 @@ move* new_move() {
     m->promoteTo = pawn;
     m->isCapture = m->isCheck = m->isCheckmate = m->isShortCastling = m->isLongCastling = 0;
     m->side = black; // fake root node is black in order to switch to white for first move
-    return m;
 }
 
-moveTree* new_move_tree() {
-    moveTree* t = (moveTree*)malloc(sizeof(moveTree));
+/** Allocate a node along with its move, returning NULL when out of memory. */
+static moveTree* alloc_move_tree(const chesslineAllocator* allocator) {
+    moveTree* t = (moveTree*)allocator->allocate(allocator->context, sizeof(moveTree));
+    STATS_ALLOC(sizeof(moveTree));
     if (t == NULL) {
-        fprintf(stderr, "failed to allocate memory for new move tree\n");
-        exit(1);
+        return NULL;
+    }
+    t->move = (move*)allocator->allocate(allocator->context, sizeof(move));
+    STATS_ALLOC(sizeof(move));
+    if (t->move == NULL) {
+        allocator->release(allocator->context, t);
+        return NULL;
     }
+    init_move(t->move);
     t->firstChoice = NULL;
     t->nextChoice = NULL;
     t->previousMove = NULL;
+    t->line = NULL;
     t->isRoot = t->decisionLevel = t->probability = t->fullMoveNo = t->halfMoveNo = 0;
-    t->move = new_move();
+    t->firstLeaf = 0;
     return t;
 }
 
-void append_move(moveTree* previous, moveTree* next) {
+static void append_move(moveTree* previous, moveTree* next) {
     next->previousMove = previous;
     if (!previous->firstChoice) {
         previous->firstChoice = next;
@@ -134,7 +227,7 @@ void append_move(moveTree* previous, moveTree* next) {
 }
 
 /** Create a new board having the initial chess position. */
-void init_board(sidedPiece board[8][8]) {
+static void init_board(sidedPiece board[8][8]) {
     sidedPiece board_array[8][8] = {
         { whiteRook, whiteKnight, whiteBishop, whiteQueen, whiteKing, whiteBishop, whiteKnight, whiteRook },
         { whitePawn, whitePawn, whitePawn, whitePawn, whitePawn, whitePawn, whitePawn, whitePawn },
@@ -152,72 +245,151 @@ void init_board(sidedPiece board[8][8]) {
     }
 }
 
+// zobrist keys per (piece, square), index 0-5 white pawn..king, 6-11 black pawn..king
+static uint64_t zobristPieceKeys[12][64];
+static uint64_t zobristBlackToMove;
+
+/** Step of the splitmix64 generator, used where values must be reproducible across runs. */
+static uint64_t splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/** Fill the zobrist keys from a fixed seed, so that position hashes stored on disk stay valid between runs. */
+static void init_zobrist_keys() {
+    uint64_t seed = 0x63686573736c696eULL;
+    for (int p = 0; p < 12; ++p) {
+        for (int sq = 0; sq < 64; ++sq) {
+            zobristPieceKeys[p][sq] = splitmix64(&seed);
+        }
+    }
+    zobristBlackToMove = splitmix64(&seed);
+}
+
+/**
+ * Hash of the piece placement and the side to move.
+ * Castling rights and en passant are not tracked by the board so they are not part of the hash.
+ */
+static uint64_t board_hash(sidedPiece board[8][8], playerSide sideToMove) {
+    uint64_t hash = sideToMove == black ? zobristBlackToMove : 0;
+    for (int rank = 0; rank < 8; ++rank) {
+        for (int file = 0; file < 8; ++file) {
+            sidedPiece sp = board[rank][file];
+            if (sp != empty) {
+                int index = sp > 0 ? sp - 1 : -sp + 5;
+                hash ^= zobristPieceKeys[index][rank*8 + file];
+            }
+        }
+    }
+    return hash;
+}
+
 typedef struct {
     sidedPiece board[8][8];
     playerSide sidePlaying;
-    position* enPassantTarget;
+    position enPassantTarget; // file 0 when there is no en passant target
     int castlingAvailability;
     int halfMoveClock;
     int fullMoveNo;
 } gameState;
 
-gameState* new_game() {
-    gameState* game = (gameState*)malloc(sizeof(gameState));
-    if (game == NULL) {
-        fprintf(stderr, "Failed to allocate memory for game state.\n");
-        exit(1);
-    }
-
+/** Set up the initial chess position. */
+static void init_game(gameState* game) {
     init_board(game->board);
 
     game->sidePlaying = white;
-    game->enPassantTarget = NULL;
-    game->castlingAvailability = 0;
+    game->enPassantTarget.file = 0;
+    game->enPassantTarget.rank = 0;
+    game->castlingAvailability = WHITE_CAN_CASTLE_KINGSIDE | WHITE_CAN_CASTLE_QUEENSIDE | BLACK_CAN_CASTLE_KINGSIDE | BLACK_CAN_CASTLE_QUEENSIDE;
     game->halfMoveClock = 0;
     game->fullMoveNo = 1;
-
-    return game;
 }
 
+/**
+ * What parsing one line of the input did, kept when the parser tracks lines so that an edited file can be
+ * re-parsed line by line. The outcome of a line only depends on its text, the parser state and the tip
+ * before it.
+ */
+typedef struct sourceLineTag {
+    uint64_t order; // increasing with the position of the line in the file
+    int stateBefore;
+    moveTree* tipBefore;
+    moveTree** roots; // nodes created by the line whose parent was not, in creation order
+    int rootCount;
+} sourceLine;
+
+#define PARSER_INPUT_SIZE 4096
+
 typedef struct {
-    FILE* file;
+    chesslineReader reader;
+    chesslineAllocator allocator; // of everything the parser creates, the tree included
     int line;
     int column;
-    char buffer[BUFFER_SIZE];
+    char buffer[PARSER_INPUT_SIZE];
     int bufferSize;
     int bufferCursor; // offset from start of buffer that we have already read
     char errorMessage[ERROR_MESSAGE_SIZE];
     int decisionLevel;
     moveTree* moveTreeTip;
     moveTree* moveTreeRoot;
-    int totalCharacterCount;
     gameState* initGameState;
+    int state;
+    int pendingProbability; // probability of the next move of the line
+    sourceLine** lines; // NULL unless tracking lines
+    int lineCount;
+    int lineCapacity;
+    bool deferLinks; // leave nodes created under other lines unlinked, for reload_repertoire
 } parser;
 
-parser* new_parser(FILE* file) {
-    parser* p = (parser*)malloc(sizeof(parser));
+/**
+ * Create a parser reading its input from reader, allocating with allocator or malloc when NULL.
+ * Returns NULL when out of memory.
+ */
+static parser* new_parser(chesslineReader reader, const chesslineAllocator* allocator) {
+    allocator = allocator != NULL ? allocator : &defaultAllocator;
+    parser* p = (parser*)allocator->allocate(allocator->context, sizeof(parser));
+    STATS_ALLOC(sizeof(parser));
     if (p == NULL) {
-        fprintf(stderr, "Failed to allocate memory for parser");
-        exit(1);
+        return NULL;
+    }
+    p->initGameState = (gameState*)allocator->allocate(allocator->context, sizeof(gameState));
+    STATS_ALLOC(sizeof(gameState));
+    p->moveTreeRoot = p->moveTreeTip = alloc_move_tree(allocator);
+    if (p->initGameState == NULL || p->moveTreeRoot == NULL) {
+        if (p->moveTreeRoot != NULL) {
+            allocator->release(allocator->context, p->moveTreeRoot->move);
+            allocator->release(allocator->context, p->moveTreeRoot);
+        }
+        allocator->release(allocator->context, p->initGameState);
+        allocator->release(allocator->context, p);
+        return NULL;
     }
 
-    p->file = file;
+    p->reader = reader;
+    p->allocator = *allocator;
     p->line = 1;
     p->column = 1;
-    p->moveTreeRoot = p->moveTreeTip = new_move_tree();
+    p->bufferSize = p->bufferCursor = 0;
     p->moveTreeTip->move->side = black;
     p->moveTreeTip->isRoot = true;
     p->moveTreeTip->fullMoveNo = 0;
     p->moveTreeTip->halfMoveNo = 0;
     p->decisionLevel = 0;
-    p->totalCharacterCount = 0;
-    p->initGameState = new_game();
+    init_game(p->initGameState);
+    p->state = 0;
+    p->pendingProbability = 100;
+    p->lines = NULL;
+    p->lineCount = p->lineCapacity = 0;
+    p->deferLinks = false;
 
     return p;
 }
 
 typedef struct {
     bool hasError;
+    chesslineStatus status;
     union {
         char errorMessage[ERROR_MESSAGE_SIZE];
         parser* parser;
@@ -225,36 +397,39 @@ typedef struct {
     };
 } parseResult;
 
-parseResult make_parse_error(parser* p, char* msg) {
+static parseResult make_parse_failure(parser* p, chesslineStatus status, char* msg) {
     parseResult res;
     res.hasError = true;
-    strncpy(res.errorMessage, msg, ERROR_MESSAGE_SIZE);
-    sprintf(res.errorMessage, "parser error: %s at line %d, column %d", msg, p->line, p->column);
+    res.status = status;
+    snprintf(res.errorMessage, ERROR_MESSAGE_SIZE, "parser error: %.*s at line %d, column %d", ERROR_QUOTE_LENGTH, msg, p->line, p->column);
     return res;
 }
 
-parseResult make_parse_parser_result(parser* p) {
-    parseResult res;
-    res.hasError = false;
-    res.parser = p;
-    return res;
+static parseResult make_parse_error(parser* p, char* msg) {
+    return make_parse_failure(p, chesslineSyntaxError, msg);
 }
 
-parseResult make_parse_move_result(move* m) {
+static parseResult make_parse_parser_result(parser* p) {
     parseResult res;
     res.hasError = false;
-    res.move = m;
+    res.status = chesslineOk;
+    res.parser = p;
     return res;
 }
 
-gameState* parse_fen(char* record) {
-    gameState* game = new_game();
+/** Set up game from a FEN record, which is modified. Returns false when the board is invalid or the side to move is missing. */
+static bool parse_fen(char* record, gameState* game) {
+    char* saveptr;
+    init_game(game);
     char c;
     int file, rank, offset = 0;
     int numEmptySquares;
 
     // board state
-    char* token = strtok(record, " ");
+    char* token = strtok_r(record, " ", &saveptr);
+    if (token == NULL) {
+        return false;
+    }
     for (rank = 7; rank >= 0; --rank) {
         file = 0;
         while (token[offset] != 0) {
@@ -264,33 +439,36 @@ gameState* parse_fen(char* record) {
             }
             if (c >= '1' && c <= '8') {
                 numEmptySquares = c - '0';
+                if (file + numEmptySquares > 8) {
+                    return false;
+                }
                 for (int i = 0; i < numEmptySquares; ++i) {
                     game->board[rank][file++] = empty;
                 }
             } else {
-                if (c < 'a') { // uppercase = white pieces
-                    game->board[rank][file++] = pieceLookup[c - 'B'];
-                } else {
-                    game->board[rank][file++] = -pieceLookup[c - 'b'];
+                int piece = piece_of_letter(c >= 'a' ? c - 'a' + 'A' : c);
+                if (piece < 0 || file >= 8) {
+                    return false;
                 }
+                game->board[rank][file++] = c < 'a' ? piece : -piece; // uppercase = white pieces
             }
         }
     }
 
     // playing side
-    token = strtok(NULL, " ");
-    if (strcmp(token, "w") == 0) {
+    token = strtok_r(NULL, " ", &saveptr);
+    if (token != NULL && strcmp(token, "w") == 0) {
         game->sidePlaying = white;
-    } else if (strcmp(token, "b") == 0) {
+    } else if (token != NULL && strcmp(token, "b") == 0) {
         game->sidePlaying = black;
     } else {
-        fprintf(stderr, "failed to read playing side %s\n", token);
-        return NULL;
+        return false;
     }
 
     // castling availability
-    token = strtok(record, " ");
-    for (int i = 0; i < strlen(token); ++i) {
+    token = strtok_r(NULL, " ", &saveptr);
+    game->castlingAvailability = 0;
+    for (size_t i = 0; token != NULL && i < strlen(token); ++i) {
         char c = token[i];
         switch (c) {
             case 'K':
@@ -311,16 +489,24 @@ gameState* parse_fen(char* record) {
         }
     }
 
-    // parse algebraic notation position**(not move) or "-"
-    token = strtok(record, " "); // TODO
+    // en passant target square or "-"
+    token = strtok_r(NULL, " ", &saveptr);
+    if (token != NULL && token[0] >= 'a' && token[0] <= 'h' && token[1] >= '1' && token[1] <= '8') {
+        game->enPassantTarget.file = token[0] - 'a' + 1;
+        game->enPassantTarget.rank = token[1] - '0';
+    }
 
-    token = strtok(record, " ");
-    game->halfMoveClock = atoi(token);
+    token = strtok_r(NULL, " ", &saveptr);
+    if (token != NULL) {
+        game->halfMoveClock = atoi(token);
+    }
 
-    token = strtok(record, " ");
-    game->fullMoveNo = atoi(token);
+    token = strtok_r(NULL, " ", &saveptr);
+    if (token != NULL) {
+        game->fullMoveNo = atoi(token);
+    }
 
-    return game;
+    return true;
 }
 
 
@@ -342,7 +528,8 @@ typedef struct {
  *
  * The lexer recognizes 6 distinct token types, defined in tokenType enum.
  */
-lexResult next_token(char* buffer, char** saveptr) {
+static lexResult next_token(char* buffer, char** saveptr) {
+    STATS_TIMER(nextToken);
     lexResult res;
     res.number = res.hasError = 0;
 
@@ -386,7 +573,7 @@ lexResult next_token(char* buffer, char** saveptr) {
         res.tokenType = quotedStringToken;
         i += 1;
         while (true) {
-            if (i >= strlen(lexBuffer)) {
+            if (lexBuffer[i] == 0) {
                 res.hasError = true;
                 sprintf(res.errorMessage, "Unterminated quoted string.");
                 return res;
@@ -409,7 +596,7 @@ lexResult next_token(char* buffer, char** saveptr) {
 
     // read token until whitespace keeping track if the symbol may be move number or probability
     bool isNumeric = true;
-    while (i < strlen(lexBuffer) && lexBuffer[i] != ' ' && lexBuffer[i] != '\t' && lexBuffer[i] != '\n') {
+    while (lexBuffer[i] != 0 && lexBuffer[i] != ' ' && lexBuffer[i] != '\t' && lexBuffer[i] != '\n') {
         res.token[i] = lexBuffer[i];
         if ((lexBuffer[i] < '0' || lexBuffer[i] > '9') && lexBuffer[i] != '.' && lexBuffer[i] != '%') {
             isNumeric = false;
@@ -418,20 +605,20 @@ lexResult next_token(char* buffer, char** saveptr) {
     }
     res.token[i] = 0;
 
-    if (strlen(res.token) == 0) {
+    if (i == 0) {
         res.eol = true;
         return res;
     }
 
     // recognize full move or probability notation
-    lexBuffer += strlen(res.token);
+    lexBuffer += i;
     *saveptr = lexBuffer;
-    if (isNumeric && strlen(res.token) > 1 && res.token[strlen(res.token)-1] == '.') {
+    if (isNumeric && i > 1 && res.token[i-1] == '.') {
         res.tokenType = fullMoveToken;
         res.number = atoi(res.token);
-        res.side = res.token[strlen(res.token)-2] == '.' ? black : white;
+        res.side = res.token[i-2] == '.' ? black : white;
         return res;
-    } else if (isNumeric && strlen(res.token) > 1 && res.token[strlen(res.token)-1] == '%') {
+    } else if (isNumeric && i > 1 && res.token[i-1] == '%') {
         res.tokenType = probabilityToken;
         res.number = atoi(res.token);
         return res;
@@ -442,159 +629,677 @@ lexResult next_token(char* buffer, char** saveptr) {
     return res;
 }
 
-move* parse_algebraic_notation2(move* m, char* buffer) {
-    if (strcmp(buffer, "O-O-O") == 0) {
-        m->isLongCastling = true;
-        m->piece = king;
-        return m;
-    } else if (strcmp(buffer, "O-O") == 0) {
-        m->isShortCastling = true;
-        m->piece = king;
-        return m;
-    }
-    int destinationIndex = -1;
-    for (int i = strlen(buffer)-1; i >= 0; i--) {
-        if (buffer[i] >= 'a' && buffer[i] <= 'h') {
-            destinationIndex = i;
-            break;
-        }
+/** Bit masks of one 64-byte block, bit i standing for byte i. */
+typedef struct {
+    uint64_t whitespace;
+    uint64_t brackets; // [ ] ( )
+    uint64_t quotes;
+    uint64_t openBraces;
+    uint64_t closeBraces;
+    uint64_t semicolons;
+    uint64_t newlines;
+    uint64_t numeric; // digits, '.' and '%'
+} charClassMasks;
+
+/** Token boundaries of one 64-byte block. */
+typedef struct {
+    uint64_t starts; // first byte of each token
+    uint64_t ends; // last byte of each token
+    uint64_t numeric;
+} tokenMasks;
+
+/** Scanner state carried from one block to the next. */
+typedef struct {
+    bool inString;
+    bool inComment;
+    bool inLineComment; // ...and it was opened by ';', so it ends with the line
+    bool previousTokenChar; // last byte of the previous block belongs to a token
+    bool previousEndsToken; // ...and it was a bracket or closing quote, which always end a token
+} tokenScanState;
+
+typedef void (*classifyBlockFunction)(const char* block, charClassMasks* masks);
+
+enum {classWhitespace = 1, classBracket = 2, classQuote = 4, classOpenBrace = 8, classCloseBrace = 16, classNumeric = 32,
+      classSemicolon = 64, classNewline = 128};
+static uint8_t charClasses[256];
+
+static void classify_block_scalar(const char* block, charClassMasks* masks) {
+    memset(masks, 0, sizeof(charClassMasks));
+    for (int i = 0; i < 64; ++i) {
+        uint8_t c = charClasses[(uint8_t)block[i]];
+        uint64_t bit = 1ULL << i;
+        masks->whitespace |= c & classWhitespace ? bit : 0;
+        masks->brackets |= c & classBracket ? bit : 0;
+        masks->quotes |= c & classQuote ? bit : 0;
+        masks->openBraces |= c & classOpenBrace ? bit : 0;
+        masks->closeBraces |= c & classCloseBrace ? bit : 0;
+        masks->semicolons |= c & classSemicolon ? bit : 0;
+        masks->newlines |= c & classNewline ? bit : 0;
+        masks->numeric |= c & classNumeric ? bit : 0;
     }
-    if (destinationIndex == -1) {
-        // fprintf(stderr, "missing destination\n");
-        return NULL;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+static void classify_block_sse2(const char* block, charClassMasks* masks) {
+    uint64_t whitespace = 0, brackets = 0, quotes = 0, openBraces = 0, closeBraces = 0, semicolons = 0, newlines = 0, numeric = 0;
+    for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+        #define SSE2_MASK(x) ((uint64_t)(uint16_t)_mm_movemask_epi8(x) << i)
+        #define SSE2_EQ(c) _mm_cmpeq_epi8(v, _mm_set1_epi8(c))
+        whitespace |= SSE2_MASK(_mm_or_si128(_mm_or_si128(SSE2_EQ(' '), SSE2_EQ('\t')), _mm_or_si128(SSE2_EQ('\n'), SSE2_EQ('\r'))));
+        brackets |= SSE2_MASK(_mm_or_si128(_mm_or_si128(SSE2_EQ('['), SSE2_EQ(']')), _mm_or_si128(SSE2_EQ('('), SSE2_EQ(')'))));
+        quotes |= SSE2_MASK(SSE2_EQ('"'));
+        openBraces |= SSE2_MASK(SSE2_EQ('{'));
+        closeBraces |= SSE2_MASK(SSE2_EQ('}'));
+        semicolons |= SSE2_MASK(SSE2_EQ(';'));
+        newlines |= SSE2_MASK(SSE2_EQ('\n'));
+        // signed compares are fine, bytes above 0x7f are negative and fall outside '0'..'9'
+        __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        numeric |= SSE2_MASK(_mm_or_si128(digits, _mm_or_si128(SSE2_EQ('.'), SSE2_EQ('%'))));
+        #undef SSE2_EQ
+        #undef SSE2_MASK
     }
-    int i = 0;
-    if (buffer[i] >= 'B' && buffer[i] <= 'R') {
-        m->piece = pieceLookup[buffer[i++] - 'B'];
-        if (m->piece == -1) {
-            // fprintf(stderr, "invalid piece\n");
-            return NULL;
+    masks->whitespace = whitespace;
+    masks->brackets = brackets;
+    masks->quotes = quotes;
+    masks->openBraces = openBraces;
+    masks->closeBraces = closeBraces;
+    masks->semicolons = semicolons;
+    masks->newlines = newlines;
+    masks->numeric = numeric;
+}
+
+__attribute__((target("avx2")))
+static void classify_block_avx2(const char* block, charClassMasks* masks) {
+    uint64_t whitespace = 0, brackets = 0, quotes = 0, openBraces = 0, closeBraces = 0, semicolons = 0, newlines = 0, numeric = 0;
+    for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + i));
+        #define AVX2_MASK(x) ((uint64_t)(uint32_t)_mm256_movemask_epi8(x) << i)
+        #define AVX2_EQ(c) _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))
+        whitespace |= AVX2_MASK(_mm256_or_si256(_mm256_or_si256(AVX2_EQ(' '), AVX2_EQ('\t')), _mm256_or_si256(AVX2_EQ('\n'), AVX2_EQ('\r'))));
+        brackets |= AVX2_MASK(_mm256_or_si256(_mm256_or_si256(AVX2_EQ('['), AVX2_EQ(']')), _mm256_or_si256(AVX2_EQ('('), AVX2_EQ(')'))));
+        quotes |= AVX2_MASK(AVX2_EQ('"'));
+        openBraces |= AVX2_MASK(AVX2_EQ('{'));
+        closeBraces |= AVX2_MASK(AVX2_EQ('}'));
+        semicolons |= AVX2_MASK(AVX2_EQ(';'));
+        newlines |= AVX2_MASK(AVX2_EQ('\n'));
+        __m256i digits = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        numeric |= AVX2_MASK(_mm256_or_si256(digits, _mm256_or_si256(AVX2_EQ('.'), AVX2_EQ('%'))));
+        #undef AVX2_EQ
+        #undef AVX2_MASK
+    }
+    masks->whitespace = whitespace;
+    masks->brackets = brackets;
+    masks->quotes = quotes;
+    masks->openBraces = openBraces;
+    masks->closeBraces = closeBraces;
+    masks->semicolons = semicolons;
+    masks->newlines = newlines;
+    masks->numeric = numeric;
+}
+#endif
+
+static classifyBlockFunction classify_block = classify_block_scalar;
+
+/** Pick the widest classifier the CPU supports, CHESSLINE_SCANNER=scalar|sse2|avx2 overrides it. */
+static void init_token_scanner() {
+    memset(charClasses, 0, sizeof(charClasses));
+    charClasses[' '] = charClasses['\t'] = charClasses['\r'] = classWhitespace;
+    charClasses['\n'] = classWhitespace | classNewline;
+    charClasses['['] = charClasses[']'] = charClasses['('] = charClasses[')'] = classBracket;
+    charClasses['"'] = classQuote;
+    charClasses['{'] = classOpenBrace;
+    charClasses['}'] = classCloseBrace;
+    charClasses[';'] = classSemicolon;
+    charClasses['.'] = charClasses['%'] = classNumeric;
+    for (char c = '0'; c <= '9'; ++c) {
+        charClasses[(uint8_t)c] = classNumeric;
+    }
+
+    char* forced = getenv("CHESSLINE_SCANNER");
+    classify_block = classify_block_scalar;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    classify_block = classify_block_sse2;
+    if (__builtin_cpu_supports("avx2")) {
+        classify_block = classify_block_avx2;
+    }
+    if (forced != NULL && strcmp(forced, "sse2") == 0) {
+        classify_block = classify_block_sse2;
+    }
+#endif
+    if (forced != NULL && strcmp(forced, "scalar") == 0) {
+        classify_block = classify_block_scalar;
+    }
+}
+
+#ifndef CHESSLINE_LIBRARY
+/** Bit i set when an odd number of bits at or below i are set in x. */
+static uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+/**
+ * Compute token boundaries of text, one tokenMasks per 64-byte block.
+ *
+ * Tokens are runs of bytes separated by whitespace; brackets and parentheses are tokens by
+ * themselves, quoted strings are single tokens including their quotes and whitespace, and
+ * {comments} and ; comments to the end of the line are skipped entirely. A token never continues past the end of text, so callers
+ * streaming a large file should split it at whitespace.
+ */
+static void scan_tokens(const char* text, size_t length, tokenMasks* masks, tokenScanState* state) {
+    size_t blocks = (length + 63) / 64;
+    charClassMasks classes;
+    char tail[64];
+    for (size_t b = 0; b < blocks; ++b) {
+        const char* block = text + b*64;
+        if (b*64 + 64 > length) {
+            // pad the last block with whitespace
+            memset(tail, ' ', 64);
+            memcpy(tail, block, length - b*64);
+            block = tail;
         }
-    } else {
-        m->piece = pawn;
+        classify_block(block, &classes);
+
+        // bits from an opening quote up to, but not including, its closing quote
+        uint64_t strings, openQuotes, closeQuotes, comments = 0;
+        if (!state->inComment && (classes.openBraces | classes.semicolons) == 0) {
+            strings = prefix_xor(classes.quotes) ^ (state->inString ? ~0ULL : 0);
+            openQuotes = classes.quotes & strings;
+            closeQuotes = classes.quotes & ~strings;
+            state->inString = strings >> 63;
+        } else {
+            // quotes inside comments and braces inside strings are plain characters, so walk the (rare)
+            // blocks with comments quote, brace, semicolon and newline one by one
+            strings = openQuotes = closeQuotes = 0;
+            uint64_t special = classes.quotes | classes.openBraces | classes.closeBraces | classes.semicolons | classes.newlines;
+            int from = 0;
+            while (special) {
+                int i = __builtin_ctzll(special);
+                uint64_t bit = 1ULL << i;
+                special &= special - 1;
+                if (state->inString && (classes.quotes & bit)) {
+                    state->inString = false;
+                    closeQuotes |= bit;
+                    strings |= bit - (1ULL << from);
+                } else if (state->inComment && (classes.closeBraces & bit) && !state->inLineComment) {
+                    state->inComment = false;
+                    comments |= (bit << 1) - (1ULL << from);
+                } else if (state->inComment && (classes.newlines & bit) && state->inLineComment) {
+                    state->inComment = state->inLineComment = false;
+                    comments |= (bit << 1) - (1ULL << from);
+                } else if (!state->inString && !state->inComment && (classes.quotes & bit)) {
+                    state->inString = true;
+                    openQuotes |= bit;
+                    from = i;
+                } else if (!state->inString && !state->inComment && (classes.openBraces & bit)) {
+                    state->inComment = true;
+                    from = i;
+                } else if (!state->inString && !state->inComment && (classes.semicolons & bit)) {
+                    state->inComment = state->inLineComment = true;
+                    from = i;
+                }
+            }
+            strings |= state->inString ? ~0ULL << from : 0;
+            comments |= state->inComment ? ~0ULL << from : 0;
+        }
+        strings |= closeQuotes;
+
+        uint64_t valid = length - b*64 < 64 ? (1ULL << (length - b*64)) - 1 : ~0ULL;
+        uint64_t isToken = (~classes.whitespace | strings) & ~comments & valid;
+        uint64_t singles = classes.brackets & ~strings & ~comments;
+        uint64_t forcesEnd = singles | (closeQuotes & ~comments);
+        uint64_t starts = isToken & ~((isToken << 1) | state->previousTokenChar);
+        starts |= singles | (openQuotes & ~comments) | ((forcesEnd << 1 | state->previousEndsToken) & isToken);
+
+        if (b > 0 && (isToken & 1) && !(starts & 1)) {
+            // the token at the end of the previous block continues here
+            masks[b-1].ends &= ~(1ULL << 63);
+        }
+        masks[b].starts = starts;
+        masks[b].ends = isToken & ((~isToken >> 1) | (starts >> 1) | (1ULL << 63));
+        masks[b].numeric = classes.numeric;
+        state->previousTokenChar = isToken >> 63;
+        state->previousEndsToken = forcesEnd >> 63;
     }
-    if (buffer[i] >= 'a' && buffer[i] <= 'h' && i < destinationIndex) {
-        m->departurePosition.file = buffer[i++] - 'a' + 1;
+}
+
+/** Same as scan_tokens a byte at a time, to check the classifiers against. */
+static void scan_tokens_bytewise(const char* text, size_t length, tokenMasks* masks, tokenScanState* state) {
+    memset(masks, 0, (length + 63) / 64 * sizeof(tokenMasks));
+    bool previousToken = state->previousTokenChar, previousEnds = state->previousEndsToken;
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t c = charClasses[(uint8_t)text[i]];
+        bool token = false, forcedStart = false, forcesEnd = false;
+        if (state->inString) {
+            token = true;
+            forcesEnd = (c & classQuote) != 0;
+            state->inString = !forcesEnd;
+        } else if (state->inComment) {
+            state->inComment = (c & (state->inLineComment ? classNewline : classCloseBrace)) == 0;
+            state->inLineComment &= state->inComment;
+        } else if (c & classQuote) {
+            token = forcedStart = state->inString = true;
+        } else if (c & classOpenBrace) {
+            state->inComment = true;
+        } else if (c & classSemicolon) {
+            state->inComment = state->inLineComment = true;
+        } else if (c & classBracket) {
+            token = forcedStart = forcesEnd = true;
+        } else {
+            token = (c & classWhitespace) == 0;
+        }
+        uint64_t bit = 1ULL << (i % 64);
+        tokenMasks* block = &masks[i / 64];
+        block->numeric |= c & classNumeric ? bit : 0;
+        if (token) {
+            bool start = !previousToken || previousEnds || forcedStart;
+            block->starts |= start ? bit : 0;
+            if (i > 0 && previousToken && start) {
+                masks[(i - 1) / 64].ends |= 1ULL << ((i - 1) % 64);
+            }
+        } else if (i > 0 && previousToken) {
+            masks[(i - 1) / 64].ends |= 1ULL << ((i - 1) % 64);
+        }
+        previousToken = token;
+        previousEnds = forcesEnd;
     }
-    if (buffer[i] >= '0' && buffer[i] <= '9' && i < destinationIndex) {
-        m->departurePosition.rank = buffer[i++] - '1' + 1;
+    if (length > 0 && previousToken) {
+        masks[(length - 1) / 64].ends |= 1ULL << ((length - 1) % 64);
     }
-    if (buffer[i] == 'x') {
-        m->isCapture = true;
-        i++;
+    state->previousTokenChar = length % 64 == 0 && previousToken;
+    state->previousEndsToken = length % 64 == 0 && previousEnds;
+}
+
+/**
+ * Whether scan_tokens, with the classifier in use, finds the same tokens as scan_tokens_bytewise over text cut into
+ * chunks of random lengths, the scanner state carried from one chunk to the next.
+ */
+static bool scan_tokens_agree(const char* text, size_t length, uint64_t* random) {
+    tokenMasks* masks = (tokenMasks*)malloc(2 * ((length + 63) / 64 + 1) * sizeof(tokenMasks));
+    STATS_ALLOC(2 * ((length + 63) / 64 + 1) * sizeof(tokenMasks));
+    if (masks == NULL) {
+        fprintf(stderr, "Failed to allocate memory for token masks.\n");
+        exit(1);
+    }
+    tokenMasks* expected = masks + (length + 63) / 64 + 1;
+    tokenScanState state = {false, false, false, false, false}, expectedState = state;
+    bool agree = true;
+    for (size_t offset = 0; agree && offset < length; ) {
+        size_t chunk = 1 + splitmix64(random) % 1024;
+        chunk = chunk < length - offset ? chunk : length - offset;
+        scan_tokens(text + offset, chunk, masks, &state);
+        scan_tokens_bytewise(text + offset, chunk, expected, &expectedState);
+        agree = memcmp(masks, expected, (chunk + 63) / 64 * sizeof(tokenMasks)) == 0 && memcmp(&state, &expectedState, sizeof(state)) == 0;
+        offset += chunk;
     }
-    if (buffer[i] >= 'a' && buffer[i] <= 'h' && i == destinationIndex) {
-        m->destination.file = buffer[i++] - 'a' + 1;
+    free(masks);
+    return agree;
+}
+
+/** Iterates over the tokens found by scan_tokens. */
+typedef struct {
+    const char* text;
+    size_t length;
+    tokenMasks* masks;
+    size_t block;
+    uint64_t starts; // starts of the current block not yet returned
+} tokenIterator;
+
+static void init_token_iterator(tokenIterator* it, const char* text, size_t length, tokenMasks* masks) {
+    it->text = text;
+    it->length = length;
+    it->masks = masks;
+    it->block = 0;
+    it->starts = length > 0 ? masks[0].starts : 0;
+}
+
+/**
+ * Find the next token, setting its offset and length. numeric is set when it only has digits, '.' and '%'.
+ * Returns false after the last token.
+ */
+static bool next_scanned_token(tokenIterator* it, size_t* offset, size_t* length, bool* numeric) {
+    size_t blocks = (it->length + 63) / 64;
+    while (it->starts == 0) {
+        if (++it->block >= blocks) {
+            return false;
+        }
+        it->starts = it->masks[it->block].starts;
     }
-    if (buffer[i] >= '0' && buffer[i] <= '9' && i == destinationIndex+1) {
-        m->destination.rank = buffer[i++] - '1' + 1;
+    int bit = __builtin_ctzll(it->starts);
+    it->starts &= it->starts - 1;
+    *offset = it->block*64 + bit;
+
+    // the token ends at the first end bit at or after its start
+    size_t b = it->block;
+    uint64_t ends = it->masks[b].ends & (~0ULL << bit);
+    while (ends == 0) {
+        ends = it->masks[++b].ends;
     }
-    if (buffer[i] == '=' && (buffer[i+1] >= 'B' && buffer[i+1] <= 'R')) {
-        m->promoteTo = pieceLookup[buffer[i+1] - 'B'];
-        if (m->promoteTo <= 0) {
-            // fprintf(stderr, "invalid promotion\n");
-            return NULL;
+    size_t end = b*64 + __builtin_ctzll(ends);
+    *length = end - *offset + 1;
+    *numeric = (~it->masks[b].numeric & (~0ULL << bit) & (ends ^ (ends - 1))) == 0;
+    if (b != it->block) {
+        // rare, tokens crossing a block boundary are checked byte by byte
+        *numeric = true;
+        for (size_t i = *offset; i <= end; ++i) {
+            *numeric &= (charClasses[(uint8_t)it->text[i]] & classNumeric) != 0;
         }
-        i += 2;
     }
-    if (buffer[i] == '#') {
-        m->isCheckmate = true;
-        i++;
-    } else if (buffer[i] == '+') {
-        m->isCheck = true;
-        i++;
+    return true;
+}
+#endif
+
+/**
+ * Packed descriptor of a move in standard algebraic notation, as produced by parse_san: piece in bits 0-2,
+ * destination file and rank in 3-6 and 7-10, departure file and rank in 11-14 and 15-18 (0 when not given),
+ * promotion piece in 19-21 (0 for none), then the capture, check, checkmate and castling flags.
+ */
+typedef uint32_t sanMove;
+
+#define SAN_DESTINATION_FILE_SHIFT 3
+#define SAN_DESTINATION_RANK_SHIFT 7
+#define SAN_DEPARTURE_FILE_SHIFT 11
+#define SAN_DEPARTURE_RANK_SHIFT 15
+#define SAN_PROMOTION_SHIFT 19
+#define SAN_CAPTURE (1u << 22)
+#define SAN_CHECK (1u << 23)
+#define SAN_CHECKMATE (1u << 24)
+#define SAN_SHORT_CASTLING (1u << 25)
+#define SAN_LONG_CASTLING (1u << 26)
+
+typedef enum {sanOther, sanEnd, sanPiece, sanKing, sanFile, sanRank, sanCapture, sanPromotion, sanCheck, sanMate, sanCastle, sanDash, SAN_CLASSES} sanCharClass;
+typedef enum {sanNoAction, sanSetPiece, sanShiftFile, sanShiftRank, sanSetCapture, sanSetPromotion, sanSetCheck, sanSetCheckmate, sanSetShortCastling, sanSetLongCastling} sanAction;
+
+/** States of the SAN automaton, named after what was read. */
+typedef enum {
+    sanRejected, sanStart, sanPieceRead, sanPieceFile, sanPieceSquare, sanPieceRank, sanPieceNeedsFile, sanPieceNeedsRank,
+    sanPieceDestination, sanPawnFile, sanPawnNeedsFile, sanPawnNeedsRank, sanPawnDestination, sanPromotionNeedsPiece,
+    sanPromoted, sanChecked, sanCastle1, sanCastle2, sanShortCastled, sanCastle4, sanLongCastled, sanAccepted, SAN_STATES
+} sanState;
+
+/** Grammar of the automaton, expanded into sanTransitions by init_san_parser. */
+static const struct {
+    sanState from;
+    sanCharClass input;
+    sanState to;
+    sanAction action;
+} sanRules[] = {
+    {sanStart, sanPiece, sanPieceRead, sanSetPiece},
+    {sanStart, sanKing, sanPieceRead, sanSetPiece},
+    {sanStart, sanFile, sanPawnFile, sanShiftFile},
+    {sanStart, sanCastle, sanCastle1, sanNoAction},
+    // Nf3, Nbd2, N1d2, Nb1d2 and their captures: the last square read is the destination
+    {sanPieceRead, sanFile, sanPieceFile, sanShiftFile},
+    {sanPieceRead, sanRank, sanPieceRank, sanShiftRank},
+    {sanPieceRead, sanCapture, sanPieceNeedsFile, sanSetCapture},
+    {sanPieceFile, sanRank, sanPieceSquare, sanShiftRank},
+    {sanPieceFile, sanFile, sanPieceNeedsRank, sanShiftFile},
+    {sanPieceFile, sanCapture, sanPieceNeedsFile, sanSetCapture},
+    {sanPieceSquare, sanFile, sanPieceNeedsRank, sanShiftFile},
+    {sanPieceSquare, sanCapture, sanPieceNeedsFile, sanSetCapture},
+    {sanPieceSquare, sanEnd, sanAccepted, sanNoAction},
+    {sanPieceSquare, sanCheck, sanChecked, sanSetCheck},
+    {sanPieceSquare, sanMate, sanChecked, sanSetCheckmate},
+    {sanPieceRank, sanFile, sanPieceNeedsRank, sanShiftFile},
+    {sanPieceRank, sanCapture, sanPieceNeedsFile, sanSetCapture},
+    {sanPieceNeedsFile, sanFile, sanPieceNeedsRank, sanShiftFile},
+    {sanPieceNeedsRank, sanRank, sanPieceDestination, sanShiftRank},
+    {sanPieceDestination, sanEnd, sanAccepted, sanNoAction},
+    {sanPieceDestination, sanCheck, sanChecked, sanSetCheck},
+    {sanPieceDestination, sanMate, sanChecked, sanSetCheckmate},
+    // e4, exd5, e8=Q
+    {sanPawnFile, sanRank, sanPawnDestination, sanShiftRank},
+    {sanPawnFile, sanCapture, sanPawnNeedsFile, sanSetCapture},
+    {sanPawnNeedsFile, sanFile, sanPawnNeedsRank, sanShiftFile},
+    {sanPawnNeedsRank, sanRank, sanPawnDestination, sanShiftRank},
+    {sanPawnDestination, sanEnd, sanAccepted, sanNoAction},
+    {sanPawnDestination, sanCheck, sanChecked, sanSetCheck},
+    {sanPawnDestination, sanMate, sanChecked, sanSetCheckmate},
+    {sanPawnDestination, sanPromotion, sanPromotionNeedsPiece, sanNoAction},
+    {sanPromotionNeedsPiece, sanPiece, sanPromoted, sanSetPromotion},
+    {sanPromoted, sanEnd, sanAccepted, sanNoAction},
+    {sanPromoted, sanCheck, sanChecked, sanSetCheck},
+    {sanPromoted, sanMate, sanChecked, sanSetCheckmate},
+    {sanChecked, sanEnd, sanAccepted, sanNoAction},
+    // O-O and O-O-O
+    {sanCastle1, sanDash, sanCastle2, sanNoAction},
+    {sanCastle2, sanCastle, sanShortCastled, sanSetShortCastling},
+    {sanShortCastled, sanEnd, sanAccepted, sanNoAction},
+    {sanShortCastled, sanCheck, sanChecked, sanSetCheck},
+    {sanShortCastled, sanMate, sanChecked, sanSetCheckmate},
+    {sanShortCastled, sanDash, sanCastle4, sanNoAction},
+    {sanCastle4, sanCastle, sanLongCastled, sanSetLongCastling},
+    {sanLongCastled, sanEnd, sanAccepted, sanNoAction},
+    {sanLongCastled, sanCheck, sanChecked, sanSetCheck},
+    {sanLongCastled, sanMate, sanChecked, sanSetCheckmate},
+};
+
+static uint8_t sanClasses[256];
+static uint8_t sanValues[256]; // file or rank number, or piece
+static uint16_t sanTransitions[SAN_STATES][SAN_CLASSES]; // next state in the low byte, action in the high byte, 0 rejects
+
+static void init_san_parser() {
+    memset(sanClasses, sanOther, sizeof(sanClasses));
+    sanClasses[0] = sanEnd;
+    for (int i = 0; i < 8; ++i) {
+        sanClasses['a' + i] = sanFile;
+        sanClasses['1' + i] = sanRank;
+        sanValues['a' + i] = sanValues['1' + i] = i + 1;
+    }
+    char* letters = "NBRQK";
+    pieceEnum pieces[] = {knight, bishop, rook, queen, king};
+    for (int i = 0; i < 5; ++i) {
+        sanClasses[(uint8_t)letters[i]] = pieces[i] == king ? sanKing : sanPiece;
+        sanValues[(uint8_t)letters[i]] = pieces[i];
+    }
+    sanClasses['x'] = sanCapture;
+    sanClasses['='] = sanPromotion;
+    sanClasses['+'] = sanCheck;
+    sanClasses['#'] = sanMate;
+    sanClasses['O'] = sanCastle;
+    sanClasses['-'] = sanDash;
+    memset(sanTransitions, 0, sizeof(sanTransitions));
+    for (size_t i = 0; i < sizeof(sanRules) / sizeof(sanRules[0]); ++i) {
+        sanTransitions[sanRules[i].from][sanRules[i].input] = sanRules[i].to | sanRules[i].action << 8;
+    }
+}
+
+/** Parse a move in standard algebraic notation in a single pass over its bytes. Returns false when invalid. */
+static bool parse_san(const char* text, sanMove* code) {
+    sanMove c = pawn;
+    int state = sanStart;
+    for (const uint8_t* s = (const uint8_t*)text; ; ++s) {
+        uint16_t transition = sanTransitions[state][sanClasses[*s]];
+        uint32_t value = sanValues[*s];
+        state = transition & 0xff;
+        switch (transition >> 8) {
+        case sanSetPiece:
+            c = (c & ~7u) | value;
+            break;
+        case sanShiftFile:
+            // a square read earlier is the departure
+            c |= (c >> SAN_DESTINATION_FILE_SHIFT & 15) << SAN_DEPARTURE_FILE_SHIFT;
+            c = (c & ~(15u << SAN_DESTINATION_FILE_SHIFT)) | value << SAN_DESTINATION_FILE_SHIFT;
+            break;
+        case sanShiftRank:
+            c |= (c >> SAN_DESTINATION_RANK_SHIFT & 15) << SAN_DEPARTURE_RANK_SHIFT;
+            c = (c & ~(15u << SAN_DESTINATION_RANK_SHIFT)) | value << SAN_DESTINATION_RANK_SHIFT;
+            break;
+        case sanSetCapture:
+            c |= SAN_CAPTURE;
+            break;
+        case sanSetPromotion:
+            c |= value << SAN_PROMOTION_SHIFT;
+            break;
+        case sanSetCheck:
+            c |= SAN_CHECK;
+            break;
+        case sanSetCheckmate:
+            c |= SAN_CHECKMATE;
+            break;
+        case sanSetShortCastling:
+            c = (c & ~7u) | king | SAN_SHORT_CASTLING;
+            break;
+        case sanSetLongCastling:
+            c ^= SAN_SHORT_CASTLING | SAN_LONG_CASTLING;
+            break;
+        }
+        if (state == sanAccepted) {
+            *code = c;
+            return true;
+        }
+        if (state == sanRejected) {
+            return false;
+        }
     }
-    if (i != strlen(buffer)) {
-        // fprintf(stderr, "not fully parsed %d vs %ld\n", i, strlen(buffer));
+}
+
+/** Fill the notation fields of m from a packed descriptor, leaving its side alone. */
+static void unpack_san_move(sanMove code, move* m) {
+    m->piece = code & 7;
+    m->destination.file = code >> SAN_DESTINATION_FILE_SHIFT & 15;
+    m->destination.rank = code >> SAN_DESTINATION_RANK_SHIFT & 15;
+    m->departurePosition.file = code >> SAN_DEPARTURE_FILE_SHIFT & 15;
+    m->departurePosition.rank = code >> SAN_DEPARTURE_RANK_SHIFT & 15;
+    m->promoteTo = code >> SAN_PROMOTION_SHIFT & 7 ? code >> SAN_PROMOTION_SHIFT & 7 : pawn;
+    m->isCapture = (code & SAN_CAPTURE) != 0;
+    m->isCheck = (code & SAN_CHECK) != 0;
+    m->isCheckmate = (code & SAN_CHECKMATE) != 0;
+    m->isShortCastling = (code & SAN_SHORT_CASTLING) != 0;
+    m->isLongCastling = (code & SAN_LONG_CASTLING) != 0;
+}
+
+/** Parse algebraic notation from buffer into m. Returns NULL when invalid, m is then left unchanged. */
+static move* parse_algebraic_notation2(move* m, char* buffer) {
+    STATS_TIMER(parseAlgebraicNotation);
+    sanMove code;
+    if (!parse_san(buffer, &code)) {
         return NULL;
     }
+    unpack_san_move(code, m);
     return m;
 }
 
-parseResult parse(parser* p) {
-    char buffer[BUFFER_SIZE];
-    bool readTags = true;
+/** Record of a line starting in the current parser state, NULL when out of memory. */
+static sourceLine* new_source_line(parser* p) {
+    sourceLine* line = (sourceLine*)p->allocator.allocate(p->allocator.context, sizeof(sourceLine));
+    STATS_ALLOC(sizeof(sourceLine));
+    if (line == NULL) {
+        return NULL;
+    }
+    line->order = 0;
+    line->stateBefore = p->state;
+    line->tipBefore = p->moveTreeTip;
+    line->roots = NULL;
+    line->rootCount = 0;
+    return line;
+}
+
+#ifndef CHESSLINE_LIBRARY
+/** Make the parser record a sourceLine for every line it reads. Returns false when out of memory. */
+static bool parser_track_lines(parser* p) {
+    p->lineCapacity = 1024;
+    p->lines = (sourceLine**)p->allocator.allocate(p->allocator.context, p->lineCapacity * sizeof(sourceLine*));
+    STATS_ALLOC(p->lineCapacity * sizeof(sourceLine*));
+    return p->lines != NULL;
+}
+#endif
+
+/**
+ * Add node t after the tip, recording it as a root of line when its parent belongs to another line.
+ * Returns false when out of memory, t is then left out of the tree.
+ */
+static bool parser_append_move(parser* p, moveTree* t, sourceLine* line) {
+    t->line = line;
+    if (line != NULL && p->moveTreeTip->line != line) {
+        if ((line->rootCount & (line->rootCount - 1)) == 0) {
+            // grow at powers of two
+            moveTree** roots = (moveTree**)p->allocator.reallocate(p->allocator.context, line->roots, (line->rootCount == 0 ? 1 : 2 * line->rootCount) * sizeof(moveTree*));
+            if (roots == NULL) {
+                return false;
+            }
+            line->roots = roots;
+        }
+        line->roots[line->rootCount++] = t;
+        if (p->deferLinks) {
+            t->previousMove = p->moveTreeTip;
+            return true;
+        }
+    }
+    append_move(p->moveTreeTip, t);
+    return true;
+}
+
+/**
+ * Parse the tokens of one input line, continuing from the parser state left by the previous line.
+ * Nodes created are attributed to line when it is not NULL.
+ */
+static parseResult parse_line(parser* p, char* buffer, sourceLine* line) {
     char tagName[BUFFER_SIZE];
     char errorMessage[ERROR_MESSAGE_SIZE];
-    move* m;
-    int state = 0;
-    int startLine = 1;
-    // parse tags
-    char* buf = fgets(buffer, BUFFER_SIZE, p->file);
-    p->moveTreeTip->move->side = black; // initialize
     lexResult res;
-    char* lexerPtr;
+    char* lexerPtr = NULL;
+    bool startLine = true;
     while (true) {
-        // fprintf(stderr, "STATE: %d\n", state);
-        if (startLine == 1) {
-            res = next_token(buffer, &lexerPtr);
-        } else {
-            res = next_token(NULL, &lexerPtr);
-        }
-
-        startLine = 0;
+        res = next_token(startLine ? buffer : NULL, &lexerPtr);
+        startLine = false;
         if (res.eol) {
-            p->line++;
-            char* buf = fgets(buffer, BUFFER_SIZE, p->file);
-            // fprintf(stderr, "got new buffer:%s\n", buf);
-            if (buf == NULL && state == 10) {
-                break;
-            }
-            else if (buf == NULL) {
-                return make_parse_error(p, "Unexpected end of file.");
-            }
-            if (strlen(buffer) > 255) {
-                return make_parse_error(p, "Lines must be less than 255 characters.");
-            }
-            startLine = 1;
-            continue;
+            return make_parse_parser_result(p);
         } else if (res.hasError) {
             return make_parse_error(p, res.errorMessage);
         }
 
-        if ((state == 0 || state == 1) && res.tokenType != openTagToken) {
-            state = 10;
-        } else if (state == 0 || state == 1) {
-            state = 2;
+        if ((p->state == 0 || p->state == 1) && res.tokenType != openTagToken) {
+            p->state = 10;
+        } else if (p->state == 0 || p->state == 1) {
+            p->state = 2;
             continue;
         }
 
-        if (state == 2) {
+        if (p->state == 2) {
             if (res.tokenType != symbolToken) {
-                sprintf(errorMessage, "Expected tag name, got %d", res.tokenType);
+                snprintf(errorMessage, ERROR_MESSAGE_SIZE, "Expected tag name, got %d", res.tokenType);
                 return make_parse_error(p, errorMessage);
             }
             strcpy(tagName, res.token);
-            state = 3;
+            p->state = 3;
             continue;
         }
 
-        if (state == 3) {
+        if (p->state == 3) {
             if (res.tokenType != quotedStringToken) {
-                sprintf(errorMessage, "Expected tag value, got %s", res.token);
+                snprintf(errorMessage, ERROR_MESSAGE_SIZE, "Expected tag value, got %.*s", ERROR_QUOTE_LENGTH, res.token);
                 return make_parse_error(p, errorMessage);
             }
-            p->initGameState = parse_fen(res.token);
-            if (p->initGameState == NULL) {
-                return make_parse_error(p, "Invalid FEN\n");
+            if (!parse_fen(res.token, p->initGameState)) {
+                return make_parse_error(p, "Invalid FEN");
             }
             p->moveTreeRoot->move->side = p->initGameState->sidePlaying == white ? black : white;
-            state = 4;
+            p->state = 4;
             continue;
         }
         
-        if (state == 4) {
+        if (p->state == 4) {
             if (res.tokenType != closeTagToken) {
-                sprintf(errorMessage, "Expected tag close, got %d", res.tokenType);
+                snprintf(errorMessage, ERROR_MESSAGE_SIZE, "Expected tag close, got %d", res.tokenType);
                 return make_parse_error(p, errorMessage);
             }
-            state = 1;
+            p->state = 1;
             continue;
         }
 
-        if (state == 10 && res.tokenType != fullMoveToken) {
-            state = 11;
-        } else if (state == 10) {
+        if (p->state == 10 && res.tokenType != fullMoveToken) {
+            p->state = 11;
+        } else if (p->state == 10) {
             int targetHalfMoveNo = 2*(res.number-1)+1;
             if (res.side == black) {
                 targetHalfMoveNo += 1;
@@ -606,123 +1311,181 @@ parseResult parse(parser* p) {
             } else if (targetHalfMoveNo == p->moveTreeTip->halfMoveNo + 1) {
                 continue;
             } else if (targetHalfMoveNo > p->moveTreeTip->halfMoveNo + 1) {
-                sprintf(errorMessage, "Wrong move number, skipped moves. %d vs %d\n", targetHalfMoveNo, p->moveTreeTip->halfMoveNo);
+                snprintf(errorMessage, ERROR_MESSAGE_SIZE, "Wrong move number, skipped moves. %d vs %d\n", targetHalfMoveNo, p->moveTreeTip->halfMoveNo);
                 return make_parse_error(p, errorMessage);
+            } else if (targetHalfMoveNo <= p->moveTreeRoot->halfMoveNo) {
+                return make_parse_error(p, "Wrong move number, before the first move");
             }
             // else backtrack to that move
             // fprintf(stderr, "moving %d -> %d", p->moveTreeTip->halfMoveNo, targetHalfMoveNo - 1);
             while (p->moveTreeTip->halfMoveNo > targetHalfMoveNo - 1) {
                 p->moveTreeTip = p->moveTreeTip->previousMove;
             }
-            state = 11;
+            p->state = 11;
             continue;
         }
-        if (state == 11 && res.tokenType != probabilityToken) {
-            p->moveTreeTip->probability = 100;
-            state = 12;
-        } else if (state == 11) {
-            p->moveTreeTip->probability = res.number;
-            state = 12;
+        // the probability is that of the move following it
+        if (p->state == 11 && res.tokenType != probabilityToken) {
+            p->pendingProbability = 100;
+            p->state = 12;
+        } else if (p->state == 11) {
+            p->pendingProbability = res.number;
+            p->state = 12;
             continue;
         }
-        if (state == 12) {
+        if (p->state == 12) {
             if (res.tokenType != symbolToken) {
-                sprintf(errorMessage, "Unexpected algebraic notation move, got %s", res.token);
+                snprintf(errorMessage, ERROR_MESSAGE_SIZE, "Unexpected algebraic notation move, got %.*s", ERROR_QUOTE_LENGTH, res.token);
                 return make_parse_error(p, errorMessage);
             }
-            moveTree* t = new_move_tree();
+            moveTree* t = alloc_move_tree(&p->allocator);
+            if (t == NULL) {
+                return make_parse_failure(p, chesslineOutOfMemory, "Out of memory");
+            }
             t->fullMoveNo = p->moveTreeTip->move->side == white ? p->moveTreeTip->fullMoveNo : p->moveTreeTip->fullMoveNo + 1;
             t->halfMoveNo = p->moveTreeTip->halfMoveNo + 1;
+            t->probability = p->pendingProbability;
             t->move->side = p->moveTreeTip->move->side == white ? black : white;
-            t->move = parse_algebraic_notation2(t->move, res.token);
-            t->move->sidedPiece = t->move->side == white ? t->move->piece : -(t->move->piece);
-            if (t->move == NULL) {
-                sprintf(errorMessage, "Not a valid algebraic notation move: %s", res.token);
+            if (parse_algebraic_notation2(t->move, res.token) == NULL) {
+                p->allocator.release(p->allocator.context, t->move);
+                p->allocator.release(p->allocator.context, t);
+                snprintf(errorMessage, ERROR_MESSAGE_SIZE, "Not a valid algebraic notation move: %.*s", ERROR_QUOTE_LENGTH, res.token);
                 return make_parse_error(p, errorMessage);
             }
-            append_move(p->moveTreeTip, t);
+            t->move->sidedPiece = t->move->side == white ? t->move->piece : -(t->move->piece);
+            if (!parser_append_move(p, t, line)) {
+                p->allocator.release(p->allocator.context, t->move);
+                p->allocator.release(p->allocator.context, t);
+                return make_parse_failure(p, chesslineOutOfMemory, "Out of memory");
+            }
             p->moveTreeTip = t;
-            state = 10;
+            p->state = 10;
             continue;
         }
     }
-
-    return make_parse_parser_result(p);
-}
-
-void print_position(position pos) {
-    if (pos.file) {
-        wprintf(L"%c", 'a' + pos.file - 1);
-    }
-    if (pos.rank) {
-        wprintf(L"%d", pos.rank);
-    }
 }
 
-void print_piece(pieceEnum p) {
-    if (p == pawn) {
-        return;
+/** Ensure room for count more tracked lines. Returns false when out of memory. */
+static bool reserve_source_lines(parser* p, int count) {
+    if (p->lineCount + count > p->lineCapacity) {
+        int capacity = p->lineCapacity;
+        while (p->lineCount + count > capacity) {
+            capacity *= 2;
+        }
+        sourceLine** lines = (sourceLine**)p->allocator.reallocate(p->allocator.context, p->lines, capacity * sizeof(sourceLine*));
+        if (lines == NULL) {
+            return false;
+        }
+        p->lines = lines;
+        p->lineCapacity = capacity;
     }
-    wprintf(L"%c", pieceSymbol[p-1]);
+    return true;
 }
 
-void print_algebraic_notation(move* m) {
-    if (m->isShortCastling) {
-        wprintf(L"O-O");
-        return;
-    }
-    if (m->isLongCastling) {
-        wprintf(L"O-O-O");
-        return;
-    }
-    print_piece(m->piece);
-    if (m->departurePosition.file || m->departurePosition.rank) {
-        print_position(m->departurePosition);
-    }
-    if (m->isCapture) {
-        wprintf(L"x");
+/**
+ * Read the next line of the input into buffer, newline included, refilling the input buffer from the reader.
+ * Returns the length of the line, 0 at the end of the input and -1 when the reader failed.
+ * Lines that do not fit in buffer are cut at BUFFER_SIZE - 1 characters.
+ */
+static int parser_read_line(parser* p, char* buffer) {
+    int length = 0;
+    while (length < BUFFER_SIZE - 1) {
+        if (p->bufferCursor == p->bufferSize) {
+            long n = p->reader.read(p->reader.context, p->buffer, PARSER_INPUT_SIZE);
+            if (n < 0) {
+                return -1;
+            }
+            p->bufferSize = n;
+            p->bufferCursor = 0;
+            if (n == 0) {
+                break;
+            }
+        }
+        char c = p->buffer[p->bufferCursor++];
+        buffer[length++] = c;
+        if (c == '\n') {
+            break;
+        }
     }
-    print_position(m->destination);
-    if (m->promoteTo != pawn) {
-        wprintf(L"=");
-        print_piece(m->promoteTo);
+    buffer[length] = 0;
+    return length;
+}
+
+static parseResult parse(parser* p) {
+    STATS_TIMER(parse);
+    char buffer[BUFFER_SIZE];
+    int length;
+    p->moveTreeTip->move->side = black; // initialize
+    while ((length = parser_read_line(p, buffer)) > 0) {
+        if (length > 255) {
+            return make_parse_error(p, "Lines must be less than 255 characters.");
+        }
+        sourceLine* line = NULL;
+        if (p->lines != NULL) {
+            if (!reserve_source_lines(p, 1) || (line = new_source_line(p)) == NULL) {
+                return make_parse_failure(p, chesslineOutOfMemory, "Out of memory");
+            }
+            line->order = (uint64_t)p->lineCount << SOURCE_LINE_ORDER_BITS;
+            p->lines[p->lineCount++] = line;
+        }
+        parseResult res = parse_line(p, buffer, line);
+        if (res.hasError) {
+            return res;
+        }
+        p->line++;
     }
-    if (m->isCheck) {
-        wprintf(L"+");
+    if (length < 0) {
+        return make_parse_failure(p, chesslineIoError, "Failed to read input");
     }
-    if (m->isCheckmate) {
-        wprintf(L"#");
+    if (p->state != 10) {
+        return make_parse_error(p, "Unexpected end of file.");
     }
+    return make_parse_parser_result(p);
 }
 
-void print_tree(moveTree* m) {
-    // TODO fix because decision level is obsolete
-    if (m->previousMove && m->previousMove->decisionLevel != m->decisionLevel) {
-        wprintf(L"\n");
-        for (int i = 0; i < m->decisionLevel; ++i) {
-            wprintf(L"\t");
+/** Write the algebraic notation of m into buffer, which must hold at least 16 characters. Returns its length. */
+static int format_algebraic_notation(move* m, char* buffer) {
+    int n = 0;
+    if (m->isShortCastling || m->isLongCastling) {
+        n += sprintf(buffer, m->isShortCastling ? "O-O" : "O-O-O");
+    } else {
+        if (m->piece != pawn) {
+            buffer[n++] = pieceSymbol[m->piece-1];
+        }
+        if (m->departurePosition.file) {
+            buffer[n++] = 'a' + m->departurePosition.file - 1;
+        }
+        if (m->departurePosition.rank) {
+            buffer[n++] = '0' + m->departurePosition.rank;
+        }
+        if (m->isCapture) {
+            buffer[n++] = 'x';
+        }
+        buffer[n++] = 'a' + m->destination.file - 1;
+        buffer[n++] = '0' + m->destination.rank;
+        if (m->promoteTo != pawn) {
+            buffer[n++] = '=';
+            buffer[n++] = pieceSymbol[m->promoteTo-1];
         }
     }
-    if (m->probability != 0) {
-        wprintf(L"%d%% ", m->probability);
+    if (m->isCheck) {
+        buffer[n++] = '+';
     }
-    print_algebraic_notation(m->move);
-    wprintf(L" ");
-    moveTree*c = m->firstChoice;
-    while (c != NULL) {
-        wprintf(L"\n");
-        print_tree(c);
-        c = c->nextChoice;
+    if (m->isCheckmate) {
+        buffer[n++] = '#';
     }
+    buffer[n] = 0;
+    return n;
 }
 
-/* Returning a random double floating point from 0 to 1. */
-double random_probability() {
-    return (double)rand() / (double)RAND_MAX;
+/* Returning a random double floating point from 0 to 1, advancing the caller's generator state. */
+static double random_probability(uint64_t* random) {
+    return (splitmix64(random) >> 11) * 0x1.0p-53;
 }
 
 /** Decide which move to use from the movement tree. Selects moves according to their probability weight. */
-moveTree* choose_move(moveTree* currentMove) {
+static moveTree* choose_move(moveTree* currentMove, uint64_t* random) {
+    STATS_TIMER(chooseMove);
     double totalProbabilityWeight = 0;
     moveTree* choice = currentMove->firstChoice;
     while (choice != NULL) {
@@ -730,7 +1493,7 @@ moveTree* choose_move(moveTree* currentMove) {
         choice = choice->nextChoice;
     }
 
-    double targetWeight = random_probability() * totalProbabilityWeight;
+    double targetWeight = random_probability(random) * totalProbabilityWeight;
     double currentWeight = 0;
     choice = currentMove->firstChoice;
     while (choice != NULL) {
@@ -744,13 +1507,232 @@ moveTree* choose_move(moveTree* currentMove) {
     return choice;
 }
 
+#define LINE_FACTOR_ERROR 2.0 // a wrong answer doubles the weight of the line being drilled
+#define LINE_FACTOR_SUCCESS 0.5 // completing a line without one halves it
+#define LINE_FACTOR_MIN (1.0 / 16)
+#define LINE_FACTOR_MAX 64.0
+
+/**
+ * Number the leaves below root in depth-first order, storing in each node the number of the first leaf of its
+ * subtree. The leaves of a subtree are then numbered from its firstLeaf to the firstLeaf of the next node
+ * after it in depth-first order. Returns the number of leaves.
+ */
+static uint32_t number_leaves(moveTree* root) {
+    uint32_t count = 0;
+    moveTree* t = root;
+    while (true) {
+        t->firstLeaf = count;
+        if (t->firstChoice != NULL) {
+            t = t->firstChoice;
+            continue;
+        }
+        count++;
+        while (t != root && t->nextChoice == NULL) {
+            t = t->previousMove;
+        }
+        if (t == root) {
+            return count;
+        }
+        t = t->nextChoice;
+    }
+}
+
+/**
+ * Weights of the whole lines below a root, one per leaf numbered by number_leaves. The weight of a line is its
+ * probability, the product of the shares of its moves among their siblings, times a factor the drill adjusts.
+ * Prefix sums of the weights are kept in a Fenwick tree, so drawing a line and reweighting one are O(log n).
+ */
+typedef struct {
+    moveTree* root;
+    moveTree** leaves;
+    double* probabilities;
+    double* factors;
+    double* sums; // Fenwick tree, sums[i] covers the weights of leaves i - (i & -i) to i - 1
+    uint32_t count;
+    chesslineAllocator allocator;
+} lineSampler;
+
+static void free_line_sampler(lineSampler* s) {
+    s->allocator.release(s->allocator.context, s->leaves);
+    s->allocator.release(s->allocator.context, s->probabilities);
+    s->allocator.release(s->allocator.context, s->factors);
+    s->allocator.release(s->allocator.context, s->sums);
+}
+
+/** Recompute the prefix sums from the probabilities and factors in O(n), after changing many factors at once. */
+static void line_sampler_rebuild(lineSampler* s) {
+    for (uint32_t i = 1; i <= s->count; ++i) {
+        s->sums[i] = s->probabilities[i - 1] * s->factors[i - 1];
+    }
+    for (uint32_t i = 1; i <= s->count; ++i) {
+        uint32_t parent = i + (i & -i);
+        if (parent <= s->count) {
+            s->sums[parent] += s->sums[i];
+        }
+    }
+}
+
+/** Probability of a line down to a depth, and the total weight and number of the moves at the next depth. */
+typedef struct {
+    double probability;
+    double total;
+    int choices;
+} lineFrame;
+
+/** Share of move t among its siblings, siblings whose weights are all zero share evenly. */
+static double line_share(moveTree* t, lineFrame* siblings) {
+    return siblings->total > 0 ? t->probability / siblings->total : 1.0 / siblings->choices;
+}
+
+/**
+ * Set up s over the leafCount leaves below root, which must have been numbered by number_leaves, with all
+ * factors at 1. Returns false when out of memory.
+ */
+static bool build_line_sampler(moveTree* root, uint32_t leafCount, const chesslineAllocator* allocator, lineSampler* s) {
+    s->root = root;
+    s->count = leafCount;
+    s->allocator = *allocator;
+    s->leaves = (moveTree**)allocator->allocate(allocator->context, leafCount * sizeof(moveTree*));
+    s->probabilities = (double*)allocator->allocate(allocator->context, leafCount * sizeof(double));
+    s->factors = (double*)allocator->allocate(allocator->context, leafCount * sizeof(double));
+    s->sums = (double*)allocator->allocate(allocator->context, (leafCount + 1) * sizeof(double));
+    STATS_ALLOC(leafCount * (sizeof(moveTree*) + 3 * sizeof(double)) + sizeof(double));
+    int capacity = 64;
+    lineFrame* frames = (lineFrame*)allocator->allocate(allocator->context, capacity * sizeof(lineFrame));
+    if (s->leaves == NULL || s->probabilities == NULL || s->factors == NULL || s->sums == NULL || frames == NULL) {
+        allocator->release(allocator->context, frames);
+        free_line_sampler(s);
+        return false;
+    }
+
+    // depth-first like number_leaves, frames[depth] describing the line down to t
+    int depth = 0;
+    frames[0].probability = 1;
+    moveTree* t = root;
+    while (true) {
+        if (t->firstChoice != NULL) {
+            if (depth + 1 == capacity) {
+                lineFrame* grown = (lineFrame*)allocator->reallocate(allocator->context, frames, 2 * capacity * sizeof(lineFrame));
+                if (grown == NULL) {
+                    allocator->release(allocator->context, frames);
+                    free_line_sampler(s);
+                    return false;
+                }
+                frames = grown;
+                capacity *= 2;
+            }
+            frames[depth].total = 0;
+            frames[depth].choices = 0;
+            for (moveTree* c = t->firstChoice; c != NULL; c = c->nextChoice) {
+                frames[depth].total += c->probability;
+                frames[depth].choices++;
+            }
+            t = t->firstChoice;
+            depth++;
+            frames[depth].probability = frames[depth - 1].probability * line_share(t, &frames[depth - 1]);
+            continue;
+        }
+        s->leaves[t->firstLeaf] = t;
+        s->probabilities[t->firstLeaf] = frames[depth].probability;
+        while (t != root && t->nextChoice == NULL) {
+            t = t->previousMove;
+            depth--;
+        }
+        if (t == root) {
+            break;
+        }
+        t = t->nextChoice;
+        frames[depth].probability = frames[depth - 1].probability * line_share(t, &frames[depth - 1]);
+    }
+    allocator->release(allocator->context, frames);
+    for (uint32_t i = 0; i < leafCount; ++i) {
+        s->factors[i] = 1;
+    }
+    line_sampler_rebuild(s);
+    return true;
+}
+
+/** Leaf just past the leaves below t. */
+static uint32_t line_sampler_end(lineSampler* s, moveTree* t) {
+    while (t != s->root && t->nextChoice == NULL) {
+        t = t->previousMove;
+    }
+    return t == s->root ? s->count : t->nextChoice->firstLeaf;
+}
+
+/** Total weight of the leaves before leaf end. */
+static double line_sampler_prefix(lineSampler* s, uint32_t end) {
+    double sum = 0;
+    for (uint32_t i = end; i > 0; i -= i & -i) {
+        sum += s->sums[i];
+    }
+    return sum;
+}
+
+/** Multiply the factor of the line ending at leaf by scale, kept between LINE_FACTOR_MIN and LINE_FACTOR_MAX. */
+static void line_sampler_scale(lineSampler* s, moveTree* leaf, double scale) {
+    uint32_t i = leaf->firstLeaf;
+    double factor = fmin(LINE_FACTOR_MAX, fmax(LINE_FACTOR_MIN, s->factors[i] * scale));
+    double delta = s->probabilities[i] * (factor - s->factors[i]);
+    s->factors[i] = factor;
+    for (uint32_t j = i + 1; j <= s->count; j += j & -j) {
+        s->sums[j] += delta;
+    }
+}
+
+/** Draw one of the lines through t according to their weights, returning its leaf. */
+static moveTree* line_sampler_draw(lineSampler* s, moveTree* t, uint64_t* random) {
+    uint32_t first = t->firstLeaf, end = line_sampler_end(s, t);
+    double low = line_sampler_prefix(s, first), high = line_sampler_prefix(s, end);
+    if (!(high > low)) {
+        return s->leaves[first + (uint32_t)(random_probability(random) * (end - first))];
+    }
+    // descend the Fenwick tree to the first leaf whose prefix sum exceeds the target
+    double target = low + random_probability(random) * (high - low);
+    uint32_t i = 0;
+    uint32_t step = 1;
+    while (step <= s->count / 2) {
+        step *= 2;
+    }
+    for (; step > 0; step /= 2) {
+        if (i + step <= s->count && s->sums[i + step] <= target) {
+            i += step;
+            target -= s->sums[i];
+        }
+    }
+    // rounding can land just outside the range
+    i = i < first ? first : i >= end ? end - 1 : i;
+    return s->leaves[i];
+}
+
+/** Child of t on the way to leaf, NULL unless leaf is below t. */
+static moveTree* line_toward(moveTree* t, moveTree* leaf) {
+    for (moveTree* c = leaf; c != NULL; c = c->previousMove) {
+        if (c->previousMove == t) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/** Move from t along the line of target, first drawing a new target line through t unless it is one already. */
+static moveTree* line_sampler_step(lineSampler* s, moveTree* t, moveTree** target, uint64_t* random) {
+    moveTree* next = *target != NULL ? line_toward(t, *target) : NULL;
+    if (next == NULL) {
+        *target = line_sampler_draw(s, t, random);
+        next = line_toward(t, *target);
+    }
+    return next;
+}
+
+#ifndef CHESSLINE_LIBRARY
 /** compare two moves, disregarding child/sibling/parent choices in the tree, and probabilities */
-bool moves_equal(move* m1, move* m2) {
+static bool moves_equal(move* m1, move* m2) {
     return m1->departurePosition.rank == m2->departurePosition.rank && m1->departurePosition.file == m2->departurePosition.file && m1->piece == m2->piece && m1->destination.rank == m2->destination.rank && m1->destination.file == m2->destination.file;
 }
 
 /** Add move to move tree. */
-moveTree* tree_apply_move(moveTree* t, move* newMove) {
+static moveTree* tree_apply_move(moveTree* t, move* newMove) {
     moveTree* c = t->firstChoice;
     while (c != NULL) {
         if (moves_equal(c->move, newMove)) {
@@ -760,39 +1742,25 @@ moveTree* tree_apply_move(moveTree* t, move* newMove) {
     }
     return NULL;
 }
+#endif
 
-typedef struct potentialMoveTag {
+#define MAX_POTENTIAL_MOVES 120 // queen steps from -7 to 7 in 8 directions
+
+typedef struct {
     int rankBy;
     int fileBy;
-    struct potentialMoveTag *nextPotentialMove;
 } potentialMove;
 
-/** Add a potential move to the list. */
-potentialMove* add_potential_move(potentialMove* list, int rankBy, int fileBy) {
-    potentialMove* p = (potentialMove*)malloc(sizeof(potentialMove));
-    if (p == NULL) {
-        fprintf(stderr, "not enough memory for potential move");
-        exit(1);
-    }
-
-    p->rankBy = rankBy;
-    p->fileBy = fileBy;
-    p->nextPotentialMove = list;
-
-    return p;
-}
-
-/** Free memory allocated for potential move list. */
-void free_potential_move(potentialMove* list) {
-    if (list == NULL) {
-        return;
-    }
-    free_potential_move(list->nextPotentialMove);
-    free(list);
+#ifndef CHESSLINE_LIBRARY
+/** Add a potential move to the list holding count moves. */
+static void add_potential_move(potentialMove* list, int* count, int rankBy, int fileBy) {
+    list[*count].rankBy = rankBy;
+    list[*count].fileBy = fileBy;
+    (*count)++;
 }
 
 /** Check if a move from departure (rank, file) to destination (rank, file) would require jumping any pieces, irrespective of moving piece. */
-bool no_pieces_jumped(sidedPiece board[8][8], int fromRank, int fromFile, int toRank, int toFile) {
+static bool no_pieces_jumped(sidedPiece board[8][8], int fromRank, int fromFile, int toRank, int toFile) {
     int rankStep = toRank > fromRank ? 1 : toRank < fromRank ? -1 : 0;
     int fileStep = toFile > fromFile ? 1 : toFile < fromFile ? -1 : 0;
     int currentRank = fromRank + rankStep;
@@ -806,15 +1774,92 @@ bool no_pieces_jumped(sidedPiece board[8][8], int fromRank, int fromFile, int to
     }
     return true;
 }
+#endif
+
+static int knightSteps[8][2] = {{2, 1}, {1, 2}, {-1, 2}, {-2, 1}, {-2, -1}, {-1, -2}, {1, -2}, {2, -1}};
+static int kingSteps[8][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0}, {-1, -1}, {0, -1}, {1, -1}};
+// directions as (rank, file) steps, diagonals first
+static int slidingDirections[8][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}, {1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+
+/** Check if any piece of side attackedBy attacks the square at (rank, file), 0-based. */
+static bool square_attacked(sidedPiece board[8][8], int rank, int file, playerSide attackedBy) {
+    int sign = attackedBy == white ? 1 : -1;
+    int pawnRank = rank - sign;
+    if (pawnRank >= 0 && pawnRank < 8) {
+        if ((file > 0 && board[pawnRank][file-1] == sign*pawn) || (file < 7 && board[pawnRank][file+1] == sign*pawn)) {
+            return true;
+        }
+    }
+    for (int i = 0; i < 8; ++i) {
+        int r = rank + knightSteps[i][0], f = file + knightSteps[i][1];
+        if (r >= 0 && r < 8 && f >= 0 && f < 8 && board[r][f] == sign*knight) {
+            return true;
+        }
+        r = rank + kingSteps[i][0];
+        f = file + kingSteps[i][1];
+        if (r >= 0 && r < 8 && f >= 0 && f < 8 && board[r][f] == sign*king) {
+            return true;
+        }
+    }
+    for (int d = 0; d < 8; ++d) {
+        sidedPiece slider = d < 4 ? sign*bishop : sign*rook;
+        int r = rank + slidingDirections[d][0], f = file + slidingDirections[d][1];
+        while (r >= 0 && r < 8 && f >= 0 && f < 8) {
+            if (board[r][f] != empty) {
+                if (board[r][f] == slider || board[r][f] == sign*queen) {
+                    return true;
+                }
+                break;
+            }
+            r += slidingDirections[d][0];
+            f += slidingDirections[d][1];
+        }
+    }
+    return false;
+}
+
+static bool king_in_check(sidedPiece board[8][8], playerSide side) {
+    sidedPiece k = side == white ? whiteKing : blackKing;
+    for (int rank = 0; rank < 8; ++rank) {
+        for (int file = 0; file < 8; ++file) {
+            if (board[rank][file] == k) {
+                return square_attacked(board, rank, file, side == white ? black : white);
+            }
+        }
+    }
+    return false;
+}
+
+#ifndef CHESSLINE_LIBRARY
+/** Check if moving the piece at (fromRank, fromFile) to (toRank, toFile) would leave the king of side in check. */
+static bool move_exposes_king(sidedPiece board[8][8], int fromRank, int fromFile, int toRank, int toFile, playerSide side) {
+    sidedPiece moved = board[fromRank][fromFile];
+    sidedPiece captured = board[toRank][toFile];
+    bool enPassant = (moved == whitePawn || moved == blackPawn) && fromFile != toFile && captured == empty;
+    sidedPiece enPassantCaptured = board[fromRank][toFile];
+    if (enPassant) {
+        board[fromRank][toFile] = empty;
+    }
+    board[toRank][toFile] = moved;
+    board[fromRank][fromFile] = empty;
+    bool exposed = king_in_check(board, side);
+    board[fromRank][fromFile] = moved;
+    board[toRank][toFile] = captured;
+    if (enPassant) {
+        board[fromRank][toFile] = enPassantCaptured;
+    }
+    return exposed;
+}
 
 /*
  * Apply the move m to the board, returning true if the move was unique and legal.
  *
  * Disambiguates moves such as Re1 that doesn't specify which rook moves to e1.
  * Assumes that the notation already uniquely specifies piece.
- * TODO: fail and warn when move not unique or illegal.
+ * Returns false, leaving the board unchanged, when no piece can make the move.
  */
-bool board_apply_move(sidedPiece board[8][8], move* m) {
+static bool board_apply_move(sidedPiece board[8][8], move* m) {
+    STATS_TIMER(boardApplyMove);
     if (m->isShortCastling) {
         if (m->side == white) {
             board[0][4] = empty;
@@ -842,83 +1887,85 @@ bool board_apply_move(sidedPiece board[8][8], move* m) {
         }
         return true;
     }
-    potentialMove* potentialMoveTip = NULL;
+    potentialMove potentialMoves[MAX_POTENTIAL_MOVES];
+    int potentialCount = 0;
     switch (m->piece) {
         case pawn:
             if (m->isCapture) {
-                potentialMoveTip = add_potential_move(potentialMoveTip, m->side == white ? 1 : -1, 1);
-                potentialMoveTip = add_potential_move(potentialMoveTip, m->side == white ? 1 : -1, -1);
+                add_potential_move(potentialMoves, &potentialCount, m->side == white ? 1 : -1, 1);
+                add_potential_move(potentialMoves, &potentialCount, m->side == white ? 1 : -1, -1);
             } else {
-                potentialMoveTip = add_potential_move(potentialMoveTip, m->side == white ? 1 : -1, 0);
-                potentialMoveTip = add_potential_move(potentialMoveTip, m->side == white ? 2 : -2, 0);
+                add_potential_move(potentialMoves, &potentialCount, m->side == white ? 1 : -1, 0);
+                add_potential_move(potentialMoves, &potentialCount, m->side == white ? 2 : -2, 0);
             }
             break;
         case knight:
-            potentialMoveTip = add_potential_move(potentialMoveTip, 2, 1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -2, 1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, 2, -1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -2, -1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, 1, 2);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -1, 2);
-            potentialMoveTip = add_potential_move(potentialMoveTip, 1, -2);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -1, -2);
+            add_potential_move(potentialMoves, &potentialCount, 2, 1);
+            add_potential_move(potentialMoves, &potentialCount, -2, 1);
+            add_potential_move(potentialMoves, &potentialCount, 2, -1);
+            add_potential_move(potentialMoves, &potentialCount, -2, -1);
+            add_potential_move(potentialMoves, &potentialCount, 1, 2);
+            add_potential_move(potentialMoves, &potentialCount, -1, 2);
+            add_potential_move(potentialMoves, &potentialCount, 1, -2);
+            add_potential_move(potentialMoves, &potentialCount, -1, -2);
             break;
         case bishop:
             for (int i = 1; i < 8; ++i) {
                 // right diagonal
-                potentialMoveTip = add_potential_move(potentialMoveTip, i, i);
-                potentialMoveTip = add_potential_move(potentialMoveTip, -i, -i);
+                add_potential_move(potentialMoves, &potentialCount, i, i);
+                add_potential_move(potentialMoves, &potentialCount, -i, -i);
                 // left diagonal
-                potentialMoveTip = add_potential_move(potentialMoveTip, i, -i);
-                potentialMoveTip = add_potential_move(potentialMoveTip, -i, i);
+                add_potential_move(potentialMoves, &potentialCount, i, -i);
+                add_potential_move(potentialMoves, &potentialCount, -i, i);
             }
             break;
         case rook:
             for (int i = 1; i < 8; ++i) {
                 // same rank
-                potentialMoveTip = add_potential_move(potentialMoveTip, 0, i);
-                potentialMoveTip = add_potential_move(potentialMoveTip, 0, -i);
+                add_potential_move(potentialMoves, &potentialCount, 0, i);
+                add_potential_move(potentialMoves, &potentialCount, 0, -i);
                 // same file
-                potentialMoveTip = add_potential_move(potentialMoveTip, i, 0);
-                potentialMoveTip = add_potential_move(potentialMoveTip, -i, 0);
+                add_potential_move(potentialMoves, &potentialCount, i, 0);
+                add_potential_move(potentialMoves, &potentialCount, -i, 0);
             }
             break;
         case queen:
             for (int i = -7; i < 8; ++i) {
                 // same rank
-                potentialMoveTip = add_potential_move(potentialMoveTip, 0, i);
-                potentialMoveTip = add_potential_move(potentialMoveTip, 0, -i);
+                add_potential_move(potentialMoves, &potentialCount, 0, i);
+                add_potential_move(potentialMoves, &potentialCount, 0, -i);
                 // same file
-                potentialMoveTip = add_potential_move(potentialMoveTip, i, 0);
-                potentialMoveTip = add_potential_move(potentialMoveTip, -i, 0);
+                add_potential_move(potentialMoves, &potentialCount, i, 0);
+                add_potential_move(potentialMoves, &potentialCount, -i, 0);
                 // right diagonal
-                potentialMoveTip = add_potential_move(potentialMoveTip, i, i);
-                potentialMoveTip = add_potential_move(potentialMoveTip, -i, -i);
+                add_potential_move(potentialMoves, &potentialCount, i, i);
+                add_potential_move(potentialMoves, &potentialCount, -i, -i);
                 // left diagonal
-                potentialMoveTip = add_potential_move(potentialMoveTip, i, -i);
-                potentialMoveTip = add_potential_move(potentialMoveTip, -i, i);
+                add_potential_move(potentialMoves, &potentialCount, i, -i);
+                add_potential_move(potentialMoves, &potentialCount, -i, i);
             }
             break;
         case king:
             // same rank
-            potentialMoveTip = add_potential_move(potentialMoveTip, 0, 1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, 0, -1);
+            add_potential_move(potentialMoves, &potentialCount, 0, 1);
+            add_potential_move(potentialMoves, &potentialCount, 0, -1);
             // same file
-            potentialMoveTip = add_potential_move(potentialMoveTip, 1, 0);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -1, 0);
+            add_potential_move(potentialMoves, &potentialCount, 1, 0);
+            add_potential_move(potentialMoves, &potentialCount, -1, 0);
             // right diagonal
-            potentialMoveTip = add_potential_move(potentialMoveTip, 1, 1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -1, -1);
+            add_potential_move(potentialMoves, &potentialCount, 1, 1);
+            add_potential_move(potentialMoves, &potentialCount, -1, -1);
             // left diagonal
-            potentialMoveTip = add_potential_move(potentialMoveTip, 1, -1);
-            potentialMoveTip = add_potential_move(potentialMoveTip, -1, 1);
+            add_potential_move(potentialMoves, &potentialCount, 1, -1);
+            add_potential_move(potentialMoves, &potentialCount, -1, 1);
             break;
     }
     int fromRank = 0, fromFile = 0;
     bool found = false;
-    while (potentialMoveTip != NULL) {
-        fromRank = m->destination.rank-1 - potentialMoveTip->rankBy;
-        fromFile = m->destination.file-1 - potentialMoveTip->fileBy;
+    // latest added first
+    for (int i = potentialCount - 1; i >= 0; --i) {
+        fromRank = m->destination.rank-1 - potentialMoves[i].rankBy;
+        fromFile = m->destination.file-1 - potentialMoves[i].fileBy;
         // fprintf(stderr, "checking %d %d (piece=%d)\n", fromFile, fromRank, m->piece);
         if (fromRank >= 0 && fromFile >= 0 && fromRank < 8 && fromFile < 8 &&
             (m->departurePosition.rank == 0 || m->departurePosition.rank == fromRank+1) &&
@@ -929,135 +1976,6583 @@ bool board_apply_move(sidedPiece board[8][8], move* m) {
             if (s == m->side && p == m->piece) {
                 // cannot go to position occupied by same colored piece
                 if (board[m->destination.rank-1][m->destination.file-1] * sp <= 0) {
-                    if (p == knight || no_pieces_jumped(board, fromRank, fromFile, m->destination.rank-1, m->destination.file-1)) {
+                    if ((p == knight || no_pieces_jumped(board, fromRank, fromFile, m->destination.rank-1, m->destination.file-1)) &&
+                        !move_exposes_king(board, fromRank, fromFile, m->destination.rank-1, m->destination.file-1, m->side)) {
                         found = true;
                         break;
                     }
                 }
             }
         }
-        potentialMoveTip = potentialMoveTip->nextPotentialMove;
     }
-    free_potential_move(potentialMoveTip);
     if (!found) {
-        fprintf(stderr, "illegal move!\n");
-        exit(1);
+        return false;
     }
     // wprintf(L"from rank %d file %d to rank %d file %d\n", fromRank, fromFile, m->destination.rank-1, m->destination.file-1);
+    if (m->piece == pawn && fromFile != (int)m->destination.file-1 && board[m->destination.rank-1][m->destination.file-1] == empty) {
+        // en passant, the captured pawn stands next to the departure square
+        board[fromRank][m->destination.file-1] = empty;
+    }
     board[fromRank][fromFile] = empty;
-    board[m->destination.rank-1][m->destination.file-1] = m->sidedPiece;
+    if (m->promoteTo != pawn) {
+        board[m->destination.rank-1][m->destination.file-1] = m->side == white ? m->promoteTo : -m->promoteTo;
+    } else {
+        board[m->destination.rank-1][m->destination.file-1] = m->sidedPiece;
+    }
     return true;
 }
+#endif
 
-/** Choose random element from an array of pointers. */
-void* random_array_choice(void** choices, int numChoices) {
-    int choiceNum = (int)floor(random_probability() * numChoices);
-    return choices[choiceNum];
-}
-
-void print_greeting() {
-    char* greetings[4] = {"Let's play chess!", "Good luck, have fun!", "Let's go!", "Let's see if you  know how to play this opening."};
-    char* s = (char*)random_array_choice((void**)greetings, sizeof(greetings)/sizeof(char*));
-    wprintf(L"%s\n", s);
-}
+#define MAX_LEGAL_MOVES 256
 
-void print_goodbye() {
-    char* messages[2] = {"Goodbye!", "See you again soon!"};
-    char* s = (char*)random_array_choice((void**)messages, sizeof(messages)/sizeof(char*));
-    wprintf(L"%s\n", s);
-}
+/** State needed to take back a move made with game_make_move. */
+typedef struct {
+    int fromRank, fromFile, toRank, toFile;
+    sidedPiece moved;
+    sidedPiece captured;
+    int capturedRank, capturedFile; // differs from destination for en passant
+    int rookFromFile, rookToFile; // -1 unless castling
+    position enPassantTarget;
+    int castlingAvailability;
+    int halfMoveClock;
+    int fullMoveNo;
+} moveUndo;
 
-void print_do_not_understand() {
-    char* messages[4] = {"Sorry, I did not understand.", "That doesn't look like a move nor a command.", "Sorry, please rephrase.", "Are you sure that's a move (or command)?"};
-    char* s = (char*)random_array_choice((void**)messages, sizeof(messages)/sizeof(char*));
-    wprintf(L"%s\n", s);
-}
+/**
+ * Make a fully specified move (departure file and rank set, as produced by generate_legal_moves),
+ * updating castling rights, en passant target, clocks and the side to play.
+ */
+static void game_make_move(gameState* game, move* m, moveUndo* u) {
+    sidedPiece (*board)[8] = game->board;
+    int backRank = m->side == white ? 0 : 7;
+    u->enPassantTarget = game->enPassantTarget;
+    u->castlingAvailability = game->castlingAvailability;
+    u->halfMoveClock = game->halfMoveClock;
+    u->fullMoveNo = game->fullMoveNo;
+    u->rookFromFile = u->rookToFile = -1;
+    if (m->isShortCastling || m->isLongCastling) {
+        u->fromRank = u->toRank = u->capturedRank = backRank;
+        u->fromFile = 4;
+        u->toFile = u->capturedFile = m->isShortCastling ? 6 : 2;
+        u->rookFromFile = m->isShortCastling ? 7 : 0;
+        u->rookToFile = m->isShortCastling ? 5 : 3;
+    } else {
+        u->fromRank = m->departurePosition.rank - 1;
+        u->fromFile = m->departurePosition.file - 1;
+        u->toRank = u->capturedRank = m->destination.rank - 1;
+        u->toFile = u->capturedFile = m->destination.file - 1;
+    }
+    u->moved = board[u->fromRank][u->fromFile];
+    if (m->piece == pawn && u->fromFile != u->toFile && board[u->toRank][u->toFile] == empty) {
+        u->capturedRank = u->fromRank;
+    }
+    u->captured = board[u->capturedRank][u->capturedFile];
 
-void play(moveTree* tree, gameState* game, bool blindMode) {
-    char* buffer = (char*)malloc(BUFFER_SIZE*sizeof(char));
-    if (buffer == NULL) {
-        fprintf(stderr, "failed to allocate memory for input buffer.");
-        exit(1);
+    board[u->capturedRank][u->capturedFile] = empty;
+    board[u->fromRank][u->fromFile] = empty;
+    board[u->toRank][u->toFile] = m->promoteTo != pawn ? (sidedPiece)(m->side == white ? (int)m->promoteTo : -(int)m->promoteTo) : u->moved;
+    if (u->rookFromFile >= 0) {
+        board[backRank][u->rookToFile] = board[backRank][u->rookFromFile];
+        board[backRank][u->rookFromFile] = empty;
     }
 
-    //print_board(theBoard.board);
-    print_greeting();
-    // setvbuf(stdin, NULL, _IOLBF, -1);
-    moveTree* moveTreeTip = tree;
-    moveTree* moveTreeRoot = tree;
-    bool viewAsWhite = moveTreeRoot->move->side == black;
-    if (!blindMode) {
-        wprintf(L"\n");
-        print_board(game->board, viewAsWhite);
+    // moving the king or a rook, or capturing a rook on its initial square, loses castling rights
+    if (m->piece == king) {
+        game->castlingAvailability &= m->side == white ? ~(WHITE_CAN_CASTLE_KINGSIDE | WHITE_CAN_CASTLE_QUEENSIDE) : ~(BLACK_CAN_CASTLE_KINGSIDE | BLACK_CAN_CASTLE_QUEENSIDE);
     }
-    while (moveTreeTip != NULL) {
-        // printf("currentMove:\n");
-        if (!moveTreeTip->isRoot) {
-            board_apply_move(game->board, moveTreeTip->move);
-            print_algebraic_notation(moveTreeTip->move);
-            wprintf(L"\n");
-            if (!blindMode) {
-                print_board(game->board, viewAsWhite);
-            }
+    int corners[4][3] = {{0, 7, WHITE_CAN_CASTLE_KINGSIDE}, {0, 0, WHITE_CAN_CASTLE_QUEENSIDE}, {7, 7, BLACK_CAN_CASTLE_KINGSIDE}, {7, 0, BLACK_CAN_CASTLE_QUEENSIDE}};
+    for (int i = 0; i < 4; ++i) {
+        if ((u->fromRank == corners[i][0] && u->fromFile == corners[i][1]) || (u->toRank == corners[i][0] && u->toFile == corners[i][1])) {
+            game->castlingAvailability &= ~corners[i][2];
         }
-        if (moveTreeTip->firstChoice == NULL) {
-            break;
-        }
-        // printf("\n");
-        while (true) {
-            wprintf(L"> ");
-            buffer = fgets(buffer, BUFFER_SIZE, stdin);
-            if (buffer == NULL || strcmp(buffer, "exit\n") == 0) {
-                if (buffer == NULL) {
-                    wprintf(L"ctl-d\n");
-                }
-                print_goodbye();
-                exit(0);
-            }
+    }
 
-            buffer[strcspn(buffer, "\n")] = 0;
+    game->enPassantTarget.file = game->enPassantTarget.rank = 0;
+    if (m->piece == pawn && abs(u->toRank - u->fromRank) == 2) {
+        game->enPassantTarget.file = u->fromFile + 1;
+        game->enPassantTarget.rank = (u->fromRank + u->toRank) / 2 + 1;
+    }
+    game->halfMoveClock = (m->piece == pawn || u->captured != empty) ? 0 : game->halfMoveClock + 1;
+    if (m->side == black) {
+        game->fullMoveNo++;
+    }
+    game->sidePlaying = m->side == white ? black : white;
+}
 
-            move*m = new_move();
-            m = parse_algebraic_notation2(m, buffer);
-            if (m == NULL) {
-                //fprintf(stderr, "Failed to parse: %s\n", res.errorMessage);
-                print_do_not_understand();
+static void game_unmake_move(gameState* game, moveUndo* u) {
+    sidedPiece (*board)[8] = game->board;
+    if (u->rookFromFile >= 0) {
+        board[u->fromRank][u->rookFromFile] = board[u->fromRank][u->rookToFile];
+        board[u->fromRank][u->rookToFile] = empty;
+    }
+    board[u->toRank][u->toFile] = empty;
+    board[u->capturedRank][u->capturedFile] = u->captured;
+    board[u->fromRank][u->fromFile] = u->moved;
+    game->enPassantTarget = u->enPassantTarget;
+    game->castlingAvailability = u->castlingAvailability;
+    game->halfMoveClock = u->halfMoveClock;
+    game->fullMoveNo = u->fullMoveNo;
+    game->sidePlaying = game->sidePlaying == white ? black : white;
+}
+
+static void add_generated_move(move* moves, int* n, gameState* game, int fromRank, int fromFile, int toRank, int toFile, pieceEnum piece, pieceEnum promoteTo) {
+    move* m = &moves[(*n)++];
+    memset(m, 0, sizeof(move));
+    m->side = game->sidePlaying;
+    m->piece = piece;
+    m->sidedPiece = game->sidePlaying == white ? piece : -piece;
+    m->promoteTo = promoteTo;
+    m->departurePosition.rank = fromRank + 1;
+    m->departurePosition.file = fromFile + 1;
+    m->destination.rank = toRank + 1;
+    m->destination.file = toFile + 1;
+    m->isCapture = game->board[toRank][toFile] != empty || (piece == pawn && fromFile != toFile);
+}
+
+static void add_generated_pawn_move(move* moves, int* n, gameState* game, int fromRank, int fromFile, int toRank, int toFile) {
+    if (toRank == 0 || toRank == 7) {
+        for (pieceEnum p = queen; p >= knight; --p) {
+            add_generated_move(moves, n, game, fromRank, fromFile, toRank, toFile, pawn, p);
+        }
+    } else {
+        add_generated_move(moves, n, game, fromRank, fromFile, toRank, toFile, pawn, pawn);
+    }
+}
+
+/** Generate moves following piece movement rules, possibly leaving the own king in check. */
+static int generate_pseudo_legal_moves(gameState* game, move* moves) {
+    sidedPiece (*board)[8] = game->board;
+    int sign = game->sidePlaying == white ? 1 : -1;
+    int n = 0;
+    for (int rank = 0; rank < 8; ++rank) {
+        for (int file = 0; file < 8; ++file) {
+            sidedPiece sp = board[rank][file];
+            if (sp * sign <= 0) {
                 continue;
             }
-
-            // printf("got move:\n");
-            // print_algebraic_notation(res.moveTreeRoot);
-            moveTree* goToMove = tree_apply_move(moveTreeTip, m);
-            if (goToMove == NULL) {
-                wprintf(L"wrong move! try again:\n");
+            pieceEnum p = sp * sign;
+            if (p == pawn) {
+                int r = rank + sign;
+                if (board[r][file] == empty) {
+                    add_generated_pawn_move(moves, &n, game, rank, file, r, file);
+                    if ((rank == 1 && sign == 1) || (rank == 6 && sign == -1)) {
+                        if (board[r+sign][file] == empty) {
+                            add_generated_move(moves, &n, game, rank, file, r+sign, file, pawn, pawn);
+                        }
+                    }
+                }
+                for (int df = -1; df <= 1; df += 2) {
+                    int f = file + df;
+                    if (f < 0 || f > 7) {
+                        continue;
+                    }
+                    if (board[r][f] * sign < 0) {
+                        add_generated_pawn_move(moves, &n, game, rank, file, r, f);
+                    } else if ((int)game->enPassantTarget.file == f+1 && (int)game->enPassantTarget.rank == r+1) {
+                        add_generated_move(moves, &n, game, rank, file, r, f, pawn, pawn);
+                    }
+                }
+            } else if (p == knight || p == king) {
+                int (*steps)[2] = p == knight ? knightSteps : kingSteps;
+                for (int i = 0; i < 8; ++i) {
+                    int r = rank + steps[i][0], f = file + steps[i][1];
+                    if (r >= 0 && r < 8 && f >= 0 && f < 8 && board[r][f] * sign <= 0) {
+                        add_generated_move(moves, &n, game, rank, file, r, f, p, pawn);
+                    }
+                }
             } else {
-                moveTreeTip = goToMove;
-                board_apply_move(game->board, moveTreeTip->move);
-                if (!blindMode) {
-                    print_board(game->board, viewAsWhite);
+                int first = p == rook ? 4 : 0;
+                int last = p == bishop ? 4 : 8;
+                for (int d = first; d < last; ++d) {
+                    int r = rank + slidingDirections[d][0], f = file + slidingDirections[d][1];
+                    while (r >= 0 && r < 8 && f >= 0 && f < 8 && board[r][f] * sign <= 0) {
+                        add_generated_move(moves, &n, game, rank, file, r, f, p, pawn);
+                        if (board[r][f] != empty) {
+                            break;
+                        }
+                        r += slidingDirections[d][0];
+                        f += slidingDirections[d][1];
+                    }
                 }
-                break;
             }
         }
-        moveTreeTip = choose_move(moveTreeTip);
     }
-    wprintf(L"Line played correctly. Good job!\n");
-    free(buffer);
+
+    // castling, the king may not be in check nor pass through an attacked square
+    int backRank = sign == 1 ? 0 : 7;
+    playerSide opponent = game->sidePlaying == white ? black : white;
+    int kingside = sign == 1 ? WHITE_CAN_CASTLE_KINGSIDE : BLACK_CAN_CASTLE_KINGSIDE;
+    int queenside = sign == 1 ? WHITE_CAN_CASTLE_QUEENSIDE : BLACK_CAN_CASTLE_QUEENSIDE;
+    if ((game->castlingAvailability & (kingside | queenside)) && board[backRank][4] == sign*king && !square_attacked(board, backRank, 4, opponent)) {
+        if ((game->castlingAvailability & kingside) && board[backRank][7] == sign*rook &&
+            board[backRank][5] == empty && board[backRank][6] == empty &&
+            !square_attacked(board, backRank, 5, opponent) && !square_attacked(board, backRank, 6, opponent)) {
+            add_generated_move(moves, &n, game, backRank, 4, backRank, 6, king, pawn);
+            moves[n-1].isShortCastling = true;
+        }
+        if ((game->castlingAvailability & queenside) && board[backRank][0] == sign*rook &&
+            board[backRank][1] == empty && board[backRank][2] == empty && board[backRank][3] == empty &&
+            !square_attacked(board, backRank, 3, opponent) && !square_attacked(board, backRank, 2, opponent)) {
+            add_generated_move(moves, &n, game, backRank, 4, backRank, 2, king, pawn);
+            moves[n-1].isLongCastling = true;
+        }
+    }
+    return n;
 }
 
-typedef struct {
-    char* inputPath;
-    bool asBlack;
-    bool asWhite;
-    bool blindMode;
-} options;
+#ifndef CHESSLINE_LIBRARY
+/** Fill moves with all legal moves of the side playing, returning their number. */
+static int generate_legal_moves(gameState* game, move* moves) {
+    int n = generate_pseudo_legal_moves(game, moves);
+    int legal = 0;
+    moveUndo u;
+    for (int i = 0; i < n; ++i) {
+        playerSide side = game->sidePlaying;
+        game_make_move(game, &moves[i], &u);
+        if (!king_in_check(game->board, side)) {
+            moves[legal++] = moves[i];
+        }
+        game_unmake_move(game, &u);
+    }
+    return legal;
+}
+#endif
 
-options init_options() {
+/** Pack the coordinates of a fully specified move into 15 bits. */
+static uint16_t pack_move(move* m) {
+    return ((m->departurePosition.rank - 1) * 8 + m->departurePosition.file - 1) << 9 |
+        ((m->destination.rank - 1) * 8 + m->destination.file - 1) << 3 | (m->promoteTo & 7);
+}
+
+/** Check if the fully specified move c is one that algebraic notation move m may refer to. */
+static bool algebraic_move_matches(move* m, move* c) {
+    if (m->isShortCastling || m->isLongCastling || c->isShortCastling || c->isLongCastling) {
+        return c->isShortCastling == m->isShortCastling && c->isLongCastling == m->isLongCastling;
+    }
+    return c->piece == m->piece && c->promoteTo == m->promoteTo &&
+        c->destination.file == m->destination.file && c->destination.rank == m->destination.rank &&
+        (m->departurePosition.file == 0 || m->departurePosition.file == c->departurePosition.file) &&
+        (m->departurePosition.rank == 0 || m->departurePosition.rank == c->departurePosition.rank);
+}
+
+/**
+ * Find the legal move that algebraic notation move m refers to, storing it in resolved.
+ * Returns false when no legal move matches.
+ */
+static bool game_resolve_move(gameState* game, move* m, move* resolved) {
+    move moves[MAX_LEGAL_MOVES];
+    moveUndo u;
+    // only candidates matching the notation need the legality check
+    int n = generate_pseudo_legal_moves(game, moves);
+    for (int i = 0; i < n; ++i) {
+        move* c = &moves[i];
+        if (algebraic_move_matches(m, c)) {
+            playerSide side = game->sidePlaying;
+            game_make_move(game, c, &u);
+            bool legal = !king_in_check(game->board, side);
+            game_unmake_move(game, &u);
+            if (legal) {
+                *resolved = *c;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+#ifndef CHESSLINE_LIBRARY
+/**
+ * Find the legal move whose pack_move() is code, as given by coordinate notation, storing it in resolved.
+ * Returns false when there is none.
+ */
+static bool game_resolve_packed_move(gameState* game, uint16_t code, move* resolved) {
+    move moves[MAX_LEGAL_MOVES];
+    moveUndo u;
+    int n = generate_pseudo_legal_moves(game, moves);
+    for (int i = 0; i < n; ++i) {
+        if (pack_move(&moves[i]) == code) {
+            playerSide side = game->sidePlaying;
+            game_make_move(game, &moves[i], &u);
+            bool legal = !king_in_check(game->board, side);
+            game_unmake_move(game, &u);
+            if (legal) {
+                *resolved = moves[i];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Convert a fully specified legal move into the form the parser produces from standard algebraic notation:
+ * departure square reduced to what is needed for disambiguation, check and checkmate flags set.
+ */
+static move algebraic_notation_move(gameState* game, move* m) {
+    move moves[MAX_LEGAL_MOVES];
+    move san = *m;
+    int n = generate_legal_moves(game, moves);
+    san.departurePosition.file = san.departurePosition.rank = 0;
+    if (m->piece == pawn) {
+        if (m->isCapture) {
+            san.departurePosition.file = m->departurePosition.file;
+        }
+    } else if (!m->isShortCastling && !m->isLongCastling) {
+        bool ambiguous = false, sameFile = false, sameRank = false;
+        for (int i = 0; i < n; ++i) {
+            move* c = &moves[i];
+            if (c->piece == m->piece && c->destination.file == m->destination.file && c->destination.rank == m->destination.rank &&
+                (c->departurePosition.file != m->departurePosition.file || c->departurePosition.rank != m->departurePosition.rank)) {
+                ambiguous = true;
+                sameFile |= c->departurePosition.file == m->departurePosition.file;
+                sameRank |= c->departurePosition.rank == m->departurePosition.rank;
+            }
+        }
+        if (ambiguous) {
+            if (!sameFile) {
+                san.departurePosition.file = m->departurePosition.file;
+            } else if (!sameRank) {
+                san.departurePosition.rank = m->departurePosition.rank;
+            } else {
+                san.departurePosition = m->departurePosition;
+            }
+        }
+    }
+    moveUndo u;
+    game_make_move(game, m, &u);
+    if (king_in_check(game->board, game->sidePlaying)) {
+        if (generate_legal_moves(game, moves) == 0) {
+            san.isCheckmate = true;
+        } else {
+            san.isCheck = true;
+        }
+    }
+    game_unmake_move(game, &u);
+    return san;
+}
+#endif
+
+#ifndef CHESSLINE_LIBRARY
+/** What a visitor asks of a tree walk after entering a node. */
+typedef enum {walkContinue, walkSkipChildren, walkStop} walkAction;
+
+typedef struct {
+    moveTree* node;
+    moveTree* nextChild; // next child to enter, NULL once all were or when pruned
+    moveUndo undo;
+    bool moved; // whether the move of node was made on the board
+} treeWalkFrame;
+
+/**
+ * Iterative pre and post-order walk over a move tree, with an explicit stack so that the depth of the tree
+ * is only limited by memory. When tracking the board, moves are made on entering a node and unmade on leaving it.
+ */
+typedef struct treeWalkTag {
+    walkAction (*enter)(struct treeWalkTag* walk, moveTree* t); // pre-order, NULL to only leave nodes
+    void (*leave)(struct treeWalkTag* walk, moveTree* t); // post-order, may free t
+    void* context;
+    bool trackBoard;
+    gameState game; // position at the current node when tracking the board
+    move resolved; // move of the current node as made on the board
+    bool legal; // false when the move of the current node could not be made, its children are then skipped
+    int depth; // of the current node below the start of the walk
+    bool outOfMemory; // set when the walk ended because its stack could not grow
+    chesslineAllocator allocator; // of the stack
+    treeWalkFrame* stack;
+    int capacity;
+} treeWalk;
+
+/**
+ * Set up a walk calling enter and leave with context, its stack taken from allocator. Pass the position at the
+ * root of the tree as game to track the board, or NULL.
+ */
+static void init_tree_walk(treeWalk* walk, gameState* game, walkAction (*enter)(treeWalk*, moveTree*), void (*leave)(treeWalk*, moveTree*), void* context, const chesslineAllocator* allocator) {
+    walk->enter = enter;
+    walk->leave = leave;
+    walk->context = context;
+    walk->trackBoard = game != NULL;
+    if (game != NULL) {
+        walk->game = *game;
+    }
+    walk->legal = true;
+    walk->depth = 0;
+    walk->outOfMemory = false;
+    walk->allocator = *allocator;
+    walk->stack = NULL; // allocated by the first walk
+    walk->capacity = 0;
+}
+
+static void free_tree_walk(treeWalk* walk) {
+    walk->allocator.release(walk->allocator.context, walk->stack);
+}
+
+/**
+ * Walk the tree below start, start included but not its siblings. When tracking the board, walk->game must hold
+ * the position before the move of start, and holds it again afterwards.
+ * Returns false when a visitor stopped the walk or when out of memory, nodes on the stack are then not left.
+ */
+static bool walk_tree(treeWalk* walk, moveTree* start) {
+    int depth = 0;
+    moveTree* t = start;
+    while (true) {
+        if (t != NULL) {
+            if (depth == walk->capacity) {
+                int capacity = walk->capacity ? 2 * walk->capacity : 64;
+                treeWalkFrame* stack = (treeWalkFrame*)walk->allocator.reallocate(walk->allocator.context, walk->stack, capacity * sizeof(treeWalkFrame));
+                STATS_ALLOC((capacity - walk->capacity) * sizeof(treeWalkFrame));
+                if (stack == NULL) {
+                    walk->outOfMemory = true;
+                    while (depth > 0) {
+                        treeWalkFrame* f = &walk->stack[--depth];
+                        if (f->moved) {
+                            game_unmake_move(&walk->game, &f->undo);
+                        }
+                    }
+                    return false;
+                }
+                walk->stack = stack;
+                walk->capacity = capacity;
+            }
+            treeWalkFrame* f = &walk->stack[depth];
+            f->node = t;
+            f->moved = false;
+            walk->legal = true;
+            if (walk->trackBoard && !t->isRoot) {
+                walk->legal = game_resolve_move(&walk->game, t->move, &walk->resolved);
+                if (walk->legal) {
+                    game_make_move(&walk->game, &walk->resolved, &f->undo);
+                    f->moved = true;
+                }
+            }
+            walk->depth = depth++;
+            walkAction action = walk->enter == NULL ? walkContinue : walk->enter(walk, t);
+            if (action == walkStop) {
+                while (depth > 0) {
+                    f = &walk->stack[--depth];
+                    if (f->moved) {
+                        game_unmake_move(&walk->game, &f->undo);
+                    }
+                }
+                return false;
+            }
+            f->nextChild = action == walkContinue && walk->legal ? t->firstChoice : NULL;
+        }
+        treeWalkFrame* f = &walk->stack[depth-1];
+        if (f->nextChild != NULL) {
+            t = f->nextChild;
+            f->nextChild = t->nextChoice;
+            continue;
+        }
+        t = NULL;
+        walk->depth = depth - 1;
+        if (walk->leave != NULL) {
+            walk->leave(walk, f->node);
+        }
+        if (f->moved) {
+            game_unmake_move(&walk->game, &f->undo);
+        }
+        if (--depth == 0) {
+            return true;
+        }
+    }
+}
+
+/** Position in 38 bytes, for snapshots kept alongside a tree. */
+typedef struct {
+    uint8_t squares[32]; // two squares per byte, low nibble first, pieces as 4 bit signed values
+    uint8_t sideAndCastling; // castling availability, and 16 when black plays
+    uint8_t enPassantTarget; // file in the high nibble, rank in the low one
+    uint16_t halfMoveClock;
+    uint16_t fullMoveNo;
+} packedGameState;
+
+static void pack_game_state(gameState* game, packedGameState* packed) {
+    for (int square = 0; square < 64; square += 2) {
+        packed->squares[square / 2] = (game->board[square / 8][square % 8] & 15) | (game->board[square / 8][square % 8 + 1] & 15) << 4;
+    }
+    packed->sideAndCastling = game->castlingAvailability | (game->sidePlaying == black ? 16 : 0);
+    packed->enPassantTarget = game->enPassantTarget.file << 4 | game->enPassantTarget.rank;
+    packed->halfMoveClock = game->halfMoveClock;
+    packed->fullMoveNo = game->fullMoveNo;
+}
+
+static void unpack_game_state(packedGameState* packed, gameState* game) {
+    for (int square = 0; square < 64; ++square) {
+        int nibble = packed->squares[square / 2] >> (square % 2 * 4) & 15;
+        game->board[square / 8][square % 8] = (sidedPiece)(nibble >= 8 ? nibble - 16 : nibble);
+    }
+    game->castlingAvailability = packed->sideAndCastling & 15;
+    game->sidePlaying = packed->sideAndCastling & 16 ? black : white;
+    game->enPassantTarget.file = (chessFile)(packed->enPassantTarget >> 4);
+    game->enPassantTarget.rank = packed->enPassantTarget & 15;
+    game->halfMoveClock = packed->halfMoveClock;
+    game->fullMoveNo = packed->fullMoveNo;
+}
+
+/** Position after the move of node, as gathered while building checkpoints. */
+typedef struct {
+    moveTree* node;
+    packedGameState position;
+} positionCheckpoint;
+
+#define CHECKPOINT_MAX_INTERVAL 64 // bounds the moves replayed from a checkpoint
+
+/**
+ * Positions after the moves of the nodes every interval plies below a root, so that the position at any node is
+ * at most interval - 1 moves away. An interval of 1 keeps a snapshot per node, larger ones trade replay for memory.
+ * Checkpoints are stored level after level in arrays of exactly their number, 46 bytes each, the nodes of a level
+ * sorted by address so that the one above any node is found by a binary search within its level.
+ * Read only once built, lookups are safe from any number of threads.
+ */
+typedef struct {
+    chesslineAllocator allocator;
+    moveTree* root;
+    int interval;
+    int levelCount;
+    uint64_t* levels; // first checkpoint of each level, level i being i * interval plies below root, then count
+    moveTree** nodes;
+    packedGameState* positions; // after the move of the node of the same index
+    uint64_t count;
+} positionCheckpoints;
+
+/** Index of the checkpoint of node, which is level * interval plies below the root, or -1 when it has none. */
+static int64_t find_checkpoint(positionCheckpoints* checkpoints, moveTree* node, int level) {
+    if (level >= checkpoints->levelCount) {
+        return -1;
+    }
+    uint64_t low = checkpoints->levels[level], high = checkpoints->levels[level + 1];
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if ((uintptr_t)checkpoints->nodes[middle] < (uintptr_t)node) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < checkpoints->levels[level + 1] && checkpoints->nodes[low] == node ? (int64_t)low : -1;
+}
+
+static int compare_checkpoints_by_node(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((positionCheckpoint*)a)->node, y = (uintptr_t)((positionCheckpoint*)b)->node;
+    return x < y ? -1 : x > y;
+}
+
+/** Append a level of count checkpoints, sorting them by node. Returns false when out of memory. */
+static bool add_checkpoint_level(positionCheckpoints* checkpoints, positionCheckpoint* level, uint64_t count) {
+    qsort(level, count, sizeof(positionCheckpoint), compare_checkpoints_by_node);
+    uint64_t total = checkpoints->count + count;
+    chesslineAllocator* allocator = &checkpoints->allocator;
+    uint64_t* levels = (uint64_t*)allocator->reallocate(allocator->context, checkpoints->levels, (checkpoints->levelCount + 2) * sizeof(uint64_t));
+    if (levels == NULL) {
+        return false;
+    }
+    checkpoints->levels = levels;
+    moveTree** nodes = (moveTree**)allocator->reallocate(allocator->context, checkpoints->nodes, total * sizeof(moveTree*));
+    if (nodes == NULL) {
+        return false;
+    }
+    checkpoints->nodes = nodes;
+    packedGameState* positions = (packedGameState*)allocator->reallocate(allocator->context, checkpoints->positions, total * sizeof(packedGameState));
+    if (positions == NULL) {
+        return false;
+    }
+    checkpoints->positions = positions;
+    STATS_ALLOC(count * (sizeof(moveTree*) + sizeof(packedGameState)) + sizeof(uint64_t));
+    for (uint64_t i = 0; i < count; ++i) {
+        nodes[checkpoints->count + i] = level[i].node;
+        positions[checkpoints->count + i] = level[i].position;
+    }
+    levels[checkpoints->levelCount] = checkpoints->count;
+    levels[++checkpoints->levelCount] = total;
+    checkpoints->count = total;
+    return true;
+}
+
+/**
+ * Set game to the position after the move of node, from the nearest checkpoint above it.
+ * Returns false when a move on the way is illegal, or node is not below the root of the checkpoints.
+ */
+static bool checkpoint_position(positionCheckpoints* checkpoints, moveTree* node, gameState* game) {
+    moveTree* path[CHECKPOINT_MAX_INTERVAL];
+    int length = 0;
+    int depth = node->halfMoveNo - checkpoints->root->halfMoveNo;
+    if (depth < 0) {
+        return false;
+    }
+    for (int i = depth % checkpoints->interval; i > 0; --i) {
+        path[length++] = node;
+        node = node->previousMove;
+    }
+    int64_t checkpoint = find_checkpoint(checkpoints, node, depth / checkpoints->interval);
+    if (checkpoint < 0) {
+        return false;
+    }
+    unpack_game_state(&checkpoints->positions[checkpoint], game);
+    move resolved;
+    moveUndo u;
+    while (length > 0) {
+        if (!game_resolve_move(game, path[--length]->move, &resolved)) {
+            return false;
+        }
+        game_make_move(game, &resolved, &u);
+    }
+    return true;
+}
+
+static void free_position_checkpoints(positionCheckpoints* checkpoints) {
+    chesslineAllocator* allocator = &checkpoints->allocator;
+    allocator->release(allocator->context, checkpoints->levels);
+    allocator->release(allocator->context, checkpoints->nodes);
+    allocator->release(allocator->context, checkpoints->positions);
+}
+
+/** Nodes handed out to the threads of walk_nodes_parallel. */
+typedef struct {
+    moveTree** starts;
+    int count;
+    int next;
+    bool stopped;
+    positionCheckpoints* checkpoints;
+} subtreeQueue;
+
+typedef struct {
+    subtreeQueue* queue;
+    treeWalk* walk;
+} subtreeWorker;
+
+static void* walk_subtrees_worker(void* arg) {
+    subtreeWorker* w = (subtreeWorker*)arg;
+    subtreeQueue* q = w->queue;
+    while (!__atomic_load_n(&q->stopped, __ATOMIC_RELAXED)) {
+        int i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED);
+        if (i >= q->count) {
+            break;
+        }
+        if (q->checkpoints != NULL && !checkpoint_position(q->checkpoints, q->starts[i]->previousMove, &w->walk->game)) {
+            continue; // below an illegal move
+        }
+        if (!walk_tree(w->walk, q->starts[i])) {
+            __atomic_store_n(&q->stopped, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Walk the subtrees below each of the count nodes of starts, which must not be roots, on one thread per walk,
+ * each walk having its own context. When tracking the board, walks start from the positions of the checkpoints,
+ * or without checkpoints from the position they hold, which must then be that before the move of every start.
+ * Nodes are handed out one at a time so that threads stay busy whatever the sizes of their subtrees.
+ * Returns false when a visitor stopped the walk or when out of memory, outOfMemory of one of the walks is then set.
+ * When a thread cannot be started, its walk runs on the calling thread.
+ */
+static bool walk_nodes_parallel(moveTree** starts, int count, positionCheckpoints* checkpoints, treeWalk* walks, int threads) {
+    subtreeQueue queue;
+    queue.starts = starts;
+    queue.count = count;
+    queue.next = 0;
+    queue.stopped = false;
+    queue.checkpoints = checkpoints;
+    subtreeWorker workers[threads];
+    pthread_t ids[threads];
+    bool started[threads];
+    for (int i = 0; i < threads; ++i) {
+        workers[i].queue = &queue;
+        workers[i].walk = &walks[i];
+        started[i] = pthread_create(&ids[i], NULL, walk_subtrees_worker, &workers[i]) == 0;
+        if (!started[i]) {
+            walk_subtrees_worker(&workers[i]);
+        }
+    }
+    for (int i = 0; i < threads; ++i) {
+        if (started[i]) {
+            pthread_join(ids[i], NULL);
+        }
+    }
+    return !queue.stopped;
+}
+
+/**
+ * Walk the subtrees of the children of root on one thread per walk, each walk having its own context and,
+ * when tracking the board, the position at root. root itself is not visited. See walk_nodes_parallel.
+ */
+static bool walk_subtrees_parallel(moveTree* root, treeWalk* walks, int threads) {
+    int count = 0;
+    for (moveTree* c = root->firstChoice; c != NULL; c = c->nextChoice) {
+        count++;
+    }
+    chesslineAllocator* allocator = &walks[0].allocator;
+    moveTree** children = (moveTree**)allocator->allocate(allocator->context, (count + 1) * sizeof(moveTree*));
+    STATS_ALLOC((count + 1) * sizeof(moveTree*));
+    if (children == NULL) {
+        walks[0].outOfMemory = true;
+        return false;
+    }
+    int i = 0;
+    for (moveTree* c = root->firstChoice; c != NULL; c = c->nextChoice) {
+        children[i++] = c;
+    }
+    bool completed = walk_nodes_parallel(children, count, NULL, walks, threads);
+    allocator->release(allocator->context, children);
+    return completed;
+}
+
+/** Checkpoints gathered by one thread while building a level. */
+typedef struct {
+    positionCheckpoint* found;
+    uint64_t count;
+    uint64_t capacity;
+    int interval;
+    bool outOfMemory;
+} checkpointLevel;
+
+static walkAction add_checkpoint_node(treeWalk* walk, moveTree* t) {
+    checkpointLevel* level = (checkpointLevel*)walk->context;
+    if (!walk->legal) {
+        return walkSkipChildren;
+    }
+    if (walk->depth < level->interval - 1) {
+        return walkContinue;
+    }
+    if (level->count == level->capacity) {
+        uint64_t capacity = level->capacity ? 2 * level->capacity : 256;
+        positionCheckpoint* found = (positionCheckpoint*)walk->allocator.reallocate(walk->allocator.context, level->found, capacity * sizeof(positionCheckpoint));
+        STATS_ALLOC((capacity - level->capacity) * sizeof(positionCheckpoint));
+        if (found == NULL) {
+            level->outOfMemory = true;
+            return walkStop;
+        }
+        level->found = found;
+        level->capacity = capacity;
+    }
+    level->found[level->count].node = t;
+    pack_game_state(&walk->game, &level->found[level->count++].position);
+    return walkSkipChildren;
+}
+
+/**
+ * Snapshot the positions every interval plies below root, at position initial, down to maxDepth plies, in memory
+ * from allocator. interval is at most CHECKPOINT_MAX_INTERVAL. Levels of checkpoints are built one after the other,
+ * each on all threads from the one above. Returns false when out of memory.
+ */
+static bool build_position_checkpoints(moveTree* root, gameState* initial, int interval, int maxDepth, int threads, positionCheckpoints* checkpoints, const chesslineAllocator* allocator) {
+    checkpoints->allocator = *allocator;
+    checkpoints->root = root;
+    checkpoints->interval = interval < 1 ? 1 : interval < CHECKPOINT_MAX_INTERVAL ? interval : CHECKPOINT_MAX_INTERVAL;
+    checkpoints->levelCount = 0;
+    checkpoints->levels = NULL;
+    checkpoints->nodes = NULL;
+    checkpoints->positions = NULL;
+    checkpoints->count = 0;
+    positionCheckpoint rootCheckpoint;
+    rootCheckpoint.node = root;
+    pack_game_state(initial, &rootCheckpoint.position);
+    if (!add_checkpoint_level(checkpoints, &rootCheckpoint, 1)) {
+        free_position_checkpoints(checkpoints);
+        return false;
+    }
+
+    checkpointLevel levels[threads];
+    treeWalk walks[threads];
+    for (int i = 0; i < threads; ++i) {
+        memset(&levels[i], 0, sizeof(checkpointLevel));
+        levels[i].interval = checkpoints->interval;
+        init_tree_walk(&walks[i], initial, add_checkpoint_node, NULL, &levels[i], allocator);
+    }
+    // starts are the children of the nodes of the last level
+    moveTree** starts = NULL;
+    uint64_t startCount = 0, startCapacity = 0;
+    bool completed = true;
+    for (int depth = checkpoints->interval; depth <= maxDepth && completed; depth += checkpoints->interval) {
+        startCount = 0;
+        for (uint64_t i = checkpoints->levels[checkpoints->levelCount - 1]; i < checkpoints->count; ++i) {
+            for (moveTree* c = checkpoints->nodes[i]->firstChoice; c != NULL; c = c->nextChoice) {
+                if (startCount == startCapacity) {
+                    startCapacity = startCapacity ? 2 * startCapacity : 1024;
+                    moveTree** grown = (moveTree**)allocator->reallocate(allocator->context, starts, startCapacity * sizeof(moveTree*));
+                    STATS_ALLOC(startCapacity / 2 * sizeof(moveTree*));
+                    if (grown == NULL) {
+                        completed = false;
+                        break;
+                    }
+                    starts = grown;
+                }
+                starts[startCount++] = c;
+            }
+        }
+        if (startCount == 0) {
+            break;
+        }
+        completed = completed && startCount <= INT_MAX && walk_nodes_parallel(starts, (int)startCount, checkpoints, walks, threads);
+        uint64_t found = 0;
+        for (int i = 0; i < threads; ++i) {
+            found += levels[i].count;
+        }
+        if (found == 0) {
+            break;
+        }
+        // gather the level of all threads into the records of the first one
+        positionCheckpoint* level = completed ? (positionCheckpoint*)allocator->reallocate(allocator->context, levels[0].found, found * sizeof(positionCheckpoint)) : NULL;
+        completed = level != NULL;
+        if (completed) {
+            levels[0].found = level;
+            levels[0].capacity = found;
+            for (int i = 1; i < threads; ++i) {
+                if (levels[i].count > 0) {
+                    memcpy(level + levels[0].count, levels[i].found, levels[i].count * sizeof(positionCheckpoint));
+                }
+                levels[0].count += levels[i].count;
+                levels[i].count = 0;
+            }
+            completed = add_checkpoint_level(checkpoints, level, found);
+            levels[0].count = 0;
+        }
+    }
+    allocator->release(allocator->context, starts);
+    for (int i = 0; i < threads; ++i) {
+        allocator->release(allocator->context, levels[i].found);
+        free_tree_walk(&walks[i]);
+    }
+    if (!completed) {
+        free_position_checkpoints(checkpoints);
+    }
+    return completed;
+}
+#endif
+
+/**
+ * Free the tree below t, t included but not its siblings. Lists of children are spliced into a single list
+ * of nodes left to free, so that freeing needs no memory.
+ */
+static void release_move_tree(const chesslineAllocator* allocator, moveTree* t) {
+    if (t == NULL) {
+        return;
+    }
+    moveTree* pending = t->firstChoice;
+    allocator->release(allocator->context, t->move);
+    allocator->release(allocator->context, t);
+    while (pending != NULL) {
+        moveTree* n = pending;
+        pending = n->nextChoice;
+        if (n->firstChoice != NULL) {
+            moveTree* last = n->firstChoice;
+            while (last->nextChoice != NULL) {
+                last = last->nextChoice;
+            }
+            last->nextChoice = pending;
+            pending = n->firstChoice;
+        }
+        allocator->release(allocator->context, n->move);
+        allocator->release(allocator->context, n);
+    }
+}
+
+#ifndef CHESSLINE_LIBRARY
+/** Free a move tree with all its choices. */
+static void free_move_tree(moveTree* t) {
+    release_move_tree(&defaultAllocator, t);
+}
+#endif
+
+static void free_source_line(parser* p, sourceLine* line) {
+    p->allocator.release(p->allocator.context, line->roots);
+    p->allocator.release(p->allocator.context, line);
+}
+
+/** Free a parser along with its tree and tracked lines. */
+static void free_parser(parser* p) {
+    chesslineAllocator allocator = p->allocator;
+    release_move_tree(&allocator, p->moveTreeRoot);
+    for (int i = 0; i < p->lineCount; ++i) {
+        free_source_line(p, p->lines[i]);
+    }
+    allocator.release(allocator.context, p->lines);
+    allocator.release(allocator.context, p->initGameState);
+    allocator.release(allocator.context, p);
+}
+
+
+static pthread_once_t chesslineInitOnce = PTHREAD_ONCE_INIT;
+
+static void chessline_init_once() {
+    init_zobrist_keys();
+    init_token_scanner();
+    init_san_parser();
+}
+
+void chessline_init(void) {
+    pthread_once(&chesslineInitOnce, chessline_init_once);
+}
+
+static long read_memory_input(void* context, char* buffer, size_t size) {
+    chesslineMemoryInput* input = (chesslineMemoryInput*)context;
+    size_t n = input->length - input->offset < size ? input->length - input->offset : size;
+    memcpy(buffer, input->text + input->offset, n);
+    input->offset += n;
+    return n;
+}
+
+chesslineReader chessline_memory_reader(chesslineMemoryInput* input) {
+    chesslineReader reader = {read_memory_input, input};
+    return reader;
+}
+
+struct chesslineRepertoireTag {
+    parser* parser; // owns the tree, the position at its root and the allocator
+    uint32_t leafCount; // the leaves are numbered on loading, the tree is not written afterwards
+};
+
+struct chesslineSchedulerTag {
+    chesslineRepertoire* repertoire;
+    lineSampler lines;
+};
+
+struct chesslineSessionTag {
+    chesslineRepertoire* repertoire;
+    moveTree* tip;
+    gameState game; // position after the move of tip
+    uint64_t random;
+    chesslineScheduler* scheduler; // NULL to draw each reply by the weights of the moves
+    moveTree* target; // leaf of the line being drilled, when scheduled
+    bool missed; // whether a wrong move was played on the current line
+};
+
+chesslineStatus chessline_load(chesslineReader reader, const chesslineAllocator* allocator, chesslineRepertoire** repertoire, char* errorMessage, size_t errorSize) {
+    *repertoire = NULL;
+    allocator = allocator != NULL ? allocator : &defaultAllocator;
+    parser* p = new_parser(reader, allocator);
+    if (p == NULL) {
+        if (errorMessage != NULL) {
+            snprintf(errorMessage, errorSize, "Out of memory");
+        }
+        return chesslineOutOfMemory;
+    }
+    parseResult res = parse(p);
+    if (res.hasError) {
+        if (errorMessage != NULL) {
+            snprintf(errorMessage, errorSize, "%s", res.errorMessage);
+        }
+        free_parser(p);
+        return res.status;
+    }
+    chesslineRepertoire* r = (chesslineRepertoire*)allocator->allocate(allocator->context, sizeof(chesslineRepertoire));
+    if (r == NULL) {
+        if (errorMessage != NULL) {
+            snprintf(errorMessage, errorSize, "Out of memory");
+        }
+        free_parser(p);
+        return chesslineOutOfMemory;
+    }
+    r->parser = p;
+    r->leafCount = number_leaves(p->moveTreeRoot);
+    *repertoire = r;
+    return chesslineOk;
+}
+
+void chessline_free(chesslineRepertoire* repertoire) {
+    if (repertoire == NULL) {
+        return;
+    }
+    chesslineAllocator allocator = repertoire->parser->allocator;
+    free_parser(repertoire->parser);
+    allocator.release(allocator.context, repertoire);
+}
+
+chesslineStatus chessline_session_new(chesslineRepertoire* repertoire, uint64_t seed, chesslineSession** session) {
+    chesslineAllocator* allocator = &repertoire->parser->allocator;
+    chesslineSession* s = (chesslineSession*)allocator->allocate(allocator->context, sizeof(chesslineSession));
+    *session = s;
+    if (s == NULL) {
+        return chesslineOutOfMemory;
+    }
+    s->repertoire = repertoire;
+    s->random = seed;
+    s->scheduler = NULL;
+    chessline_session_reset(s);
+    return chesslineOk;
+}
+
+void chessline_session_free(chesslineSession* session) {
+    if (session != NULL) {
+        chesslineAllocator* allocator = &session->repertoire->parser->allocator;
+        allocator->release(allocator->context, session);
+    }
+}
+
+void chessline_session_reset(chesslineSession* session) {
+    session->tip = session->repertoire->parser->moveTreeRoot;
+    session->game = *session->repertoire->parser->initGameState;
+    session->target = NULL;
+    session->missed = false;
+}
+
+chesslineStatus chessline_scheduler_new(chesslineRepertoire* repertoire, chesslineScheduler** scheduler) {
+    chesslineAllocator* allocator = &repertoire->parser->allocator;
+    chesslineScheduler* s = (chesslineScheduler*)allocator->allocate(allocator->context, sizeof(chesslineScheduler));
+    *scheduler = s;
+    if (s == NULL) {
+        return chesslineOutOfMemory;
+    }
+    s->repertoire = repertoire;
+    if (!build_line_sampler(repertoire->parser->moveTreeRoot, repertoire->leafCount, allocator, &s->lines)) {
+        allocator->release(allocator->context, s);
+        *scheduler = NULL;
+        return chesslineOutOfMemory;
+    }
+    return chesslineOk;
+}
+
+void chessline_scheduler_free(chesslineScheduler* scheduler) {
+    if (scheduler != NULL) {
+        chesslineAllocator* allocator = &scheduler->repertoire->parser->allocator;
+        free_line_sampler(&scheduler->lines);
+        allocator->release(allocator->context, scheduler);
+    }
+}
+
+void chessline_session_schedule(chesslineSession* session, chesslineScheduler* scheduler) {
+    session->scheduler = scheduler != NULL && scheduler->repertoire == session->repertoire ? scheduler : NULL;
+    session->target = NULL;
+}
+
+/** Move to c, and when the line ends there, lighten it unless a wrong move was played on it. */
+static void session_advance(chesslineSession* session, moveTree* c) {
+    session->tip = c;
+    if (c->firstChoice == NULL && session->scheduler != NULL && !session->missed) {
+        line_sampler_scale(&session->scheduler->lines, c, LINE_FACTOR_SUCCESS);
+    }
+}
+
+chesslineStatus chessline_session_play(chesslineSession* session, const char* san) {
+    char buffer[BUFFER_SIZE];
+    move m, played, resolved;
+    moveUndo u;
+    if (session->tip->firstChoice == NULL) {
+        return chesslineEndOfLine;
+    }
+    if (strlen(san) >= BUFFER_SIZE) {
+        return chesslineInvalidMove;
+    }
+    strcpy(buffer, san);
+    init_move(&m);
+    m.side = session->game.sidePlaying;
+    if (parse_algebraic_notation2(&m, buffer) == NULL || !game_resolve_move(&session->game, &m, &played)) {
+        return chesslineInvalidMove;
+    }
+    // compare squares rather than notation, Nbd2 and Nd2 are the same move when unambiguous
+    for (moveTree* c = session->tip->firstChoice; c != NULL; c = c->nextChoice) {
+        if (game_resolve_move(&session->game, c->move, &resolved) && pack_move(&resolved) == pack_move(&played)) {
+            game_make_move(&session->game, &resolved, &u);
+            session_advance(session, c);
+            return chesslineOk;
+        }
+    }
+    if (session->scheduler != NULL) {
+        // weigh the line the trainee was expected to follow
+        if (session->target == NULL || line_toward(session->tip, session->target) == NULL) {
+            session->target = line_sampler_draw(&session->scheduler->lines, session->tip, &session->random);
+        }
+        line_sampler_scale(&session->scheduler->lines, session->target, LINE_FACTOR_ERROR);
+        session->missed = true;
+    }
+    return chesslineWrongMove;
+}
+
+chesslineStatus chessline_session_reply(chesslineSession* session, char* san, size_t size) {
+    move resolved;
+    moveUndo u;
+    if (session->tip->firstChoice == NULL) {
+        return chesslineEndOfLine;
+    }
+    moveTree* c;
+    if (session->scheduler != NULL) {
+        c = line_sampler_step(&session->scheduler->lines, session->tip, &session->target, &session->random);
+    } else {
+        c = choose_move(session->tip, &session->random);
+    }
+    if (c == NULL) {
+        // all weights are zero
+        c = session->tip->firstChoice;
+    }
+    if (!game_resolve_move(&session->game, c->move, &resolved)) {
+        return chesslineInvalidMove;
+    }
+    if (san != NULL) {
+        if (size < 16) {
+            return chesslineInvalidMove;
+        }
+        format_algebraic_notation(c->move, san);
+    }
+    game_make_move(&session->game, &resolved, &u);
+    session_advance(session, c);
+    return chesslineOk;
+}
+
+bool chessline_session_finished(chesslineSession* session) {
+    return session->tip->firstChoice == NULL;
+}
+
+uint64_t chessline_session_position(chesslineSession* session) {
+    return board_hash(session->game.board, session->game.sidePlaying);
+}
+
+#ifndef CHESSLINE_LIBRARY
+
+void print_board(sidedPiece board[8][8], bool aswhite) {
+    STATS_TIMER(printBoard);
+    for (int rank = aswhite ? 7 : 0; aswhite ? rank >= 0 : rank < 8; aswhite ? rank-- : rank++) {
+        for (int file = aswhite ? 0 : 7; aswhite ? file <= 7 : file >= 0; aswhite ? file++ : file--) {
+            sidedPiece sp = board[rank][file];
+            pieceEnum p = sp > 0 ? sp : -sp;
+            wchar_t unicodePoint = UNICODE_BLACK_CHESS_PAWN - p + 1;
+            if (p == 0) {
+                unicodePoint = UNICODE_SPACE;
+            }
+
+            int tileColor = (rank+file) % 2 == 0 ? DARK_TILE_COLOR : LIGHT_TILE_COLOR;
+            int pieceColor = sp > 0 ? WHITE_PIECE_COLOR : BLACK_PIECE_COLOR;
+
+            // set foreground color, set background color and print unicode point
+            // only half of the chess piece appears unless there is a space after it
+            wprintf(L"\e[38;5;%dm\e[48;5;%dm %lc ", pieceColor, tileColor, unicodePoint);
+        }
+        // reset colors and newline
+        wprintf(L"\e[0m\n");
+    }
+    wprintf(L"\n");
+}
+
+typedef enum {diagramSvg, diagramPpm} diagramFormat;
+
+#define DIAGRAM_GRID 16 // cells per side of a piece mask, also the SVG units per square
+#define DIAGRAM_PIECES 13 // empty square, then white and black pieces in pieceEnum order
+
+/** Pieces on a grid of DIAGRAM_GRID cells: '#' for the outline, 'o' for the body and '.' where the square shows. */
+const char* diagramMasks[7][DIAGRAM_GRID] = {
+    {NULL},
+    {
+        "................", "................", "................", "......####......",
+        ".....#oooo#.....", ".....#oooo#.....", "......#oo#......", ".....#oooo#.....",
+        "....#oooooo#....", ".....#oooo#.....", ".....#oooo#.....", "....#oooooo#....",
+        "...#oooooooo#...", "...##########...", "................", "................"
+    },
+    {
+        "................", "................", ".......##.......", "......#oo##.....",
+        ".....#oooooo#...", "....#oo#ooooo#..", "...#oooooooooo#.", "..#ooooooooooo#.",
+        "..#ooo##oooooo#.", "...###.#oooooo#.", "......#ooooooo#.", ".....#oooooooo#.",
+        "....#ooooooooo#.", "....###########.", "................", "................"
+    },
+    {
+        "................", ".......##.......", "......#oo#......", ".......##.......",
+        "......#oo#......", ".....#oo#o#.....", "....#oo#ooo#....", "....#oooooo#....",
+        ".....#oooo#.....", "......#oo#......", ".....#oooo#.....", "....#oooooo#....",
+        "...#oooooooo#...", "...##########...", "................", "................"
+    },
+    {
+        "................", "................", "...##..##..##...", "...#o##oo##o#...",
+        "...#oooooooo#...", "....#oooooo#....", "....#oooooo#....", "....#oooooo#....",
+        "....#oooooo#....", "....#oooooo#....", "....#oooooo#....", "...#oooooooo#...",
+        "..#oooooooooo#..", "..############..", "................", "................"
+    },
+    {
+        "................", "................", "..#...#..#...#..", "..##.#o##o#.##..",
+        "..#o#oooooo#o#..", "..#oooooooooo#..", "...#oooooooo#...", "....#oooooo#....",
+        ".....#oooo#.....", ".....#oooo#.....", "....#oooooo#....", "...#oooooooo#...",
+        "..#oooooooooo#..", "..############..", "................", "................"
+    },
+    {
+        "................", "......####......", "......#oo#......", "....###oo###....",
+        "....#oooooo#....", "....###oo###....", "......#oo#......", "...####oo####...",
+        "..#oooooooooo#..", "..#oooooooooo#..", "...#oooooooo#...", "....#oooooo#....",
+        "...#oooooooo#...", "...##########...", "................", "................"
+    }
+};
+
+/** Dark and light squares, then the same as the squares of the last move. */
+const uint8_t diagramSquareColors[4][3] = {{181, 136, 99}, {240, 217, 181}, {170, 162, 58}, {205, 210, 106}};
+const uint8_t diagramOutlineColor[3] = {0, 0, 0};
+const uint8_t diagramBodyColors[2][3] = {{255, 255, 255}, {64, 64, 64}};
+
+/**
+ * Everything a diagram is assembled from, built once and shared read only by the rendering threads: for PPM, every
+ * square already rasterized with each piece on it, copied row by row into place; for SVG, the document up to the
+ * empty board, pieces being references to its definitions.
+ */
+typedef struct {
+    diagramFormat format;
+    int squareSize; // in pixels
+    uint8_t* tiles; // PPM only, RGB of squareSize x squareSize pixels by square color then piece
+    char* prologue; // SVG only
+    size_t prologueLength;
+    size_t bufferSize; // enough for any diagram
+} diagramTemplates;
+
+int diagram_piece_index(sidedPiece sp) {
+    return sp >= 0 ? sp : king - sp;
+}
+
+/**
+ * Append the cells of mask holding c to an SVG path, as one rectangle per run of cells on a row. The outline
+ * covers the body as well, which is drawn over it, for fewer runs.
+ */
+size_t append_mask_path(const char** mask, char c, char* buffer) {
+    size_t n = 0;
+    for (int y = 0; y < DIAGRAM_GRID; ++y) {
+        for (int x = 0; x < DIAGRAM_GRID; ++x) {
+            if (mask[y][x] != c && (c != '#' || mask[y][x] == '.')) {
+                continue;
+            }
+            int run = 1;
+            while (x + run < DIAGRAM_GRID && (mask[y][x + run] == c || (c == '#' && mask[y][x + run] != '.'))) {
+                run++;
+            }
+            n += sprintf(buffer + n, "M%d %dh%dv1h-%dz", x, y, run, run);
+            x += run - 1;
+        }
+    }
+    return n;
+}
+
+void build_diagram_templates(diagramTemplates* t, diagramFormat format, int squareSize) {
+    memset(t, 0, sizeof(diagramTemplates));
+    t->format = format;
+    t->squareSize = squareSize;
+    if (format == diagramPpm) {
+        size_t tileSize = (size_t)squareSize * squareSize * 3;
+        t->tiles = (uint8_t*)malloc(4 * DIAGRAM_PIECES * tileSize);
+        STATS_ALLOC(4 * DIAGRAM_PIECES * tileSize);
+        if (t->tiles == NULL) {
+            fprintf(stderr, "Failed to allocate memory for diagram templates.\n");
+            exit(1);
+        }
+        for (int color = 0; color < 4; ++color) {
+            for (int piece = 0; piece < DIAGRAM_PIECES; ++piece) {
+                uint8_t* tile = t->tiles + (color * DIAGRAM_PIECES + piece) * tileSize;
+                const char** mask = diagramMasks[piece > king ? piece - king : piece];
+                int side = piece > king ? black : white;
+                for (int y = 0; y < squareSize; ++y) {
+                    for (int x = 0; x < squareSize; ++x) {
+                        char cell = piece == 0 ? '.' : mask[y * DIAGRAM_GRID / squareSize][x * DIAGRAM_GRID / squareSize];
+                        const uint8_t* rgb = cell == '#' ? diagramOutlineColor : cell == 'o' ? diagramBodyColors[side] : diagramSquareColors[color];
+                        memcpy(tile + (y * squareSize + x) * 3, rgb, 3);
+                    }
+                }
+            }
+        }
+        t->bufferSize = 32 + 64 * tileSize;
+        return;
+    }
+
+    // pieces take at most a rectangle of 16 characters per cell, the rest of the document a few kilobytes
+    size_t capacity = 4096 + 12 * (128 + DIAGRAM_GRID * DIAGRAM_GRID * 16);
+    t->prologue = (char*)malloc(capacity);
+    STATS_ALLOC(capacity);
+    if (t->prologue == NULL) {
+        fprintf(stderr, "Failed to allocate memory for diagram templates.\n");
+        exit(1);
+    }
+    int boardSize = 8 * DIAGRAM_GRID;
+    char* s = t->prologue;
+    s += sprintf(s, "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" width=\"%d\" height=\"%d\" "
+        "viewBox=\"0 0 %d %d\" shape-rendering=\"crispEdges\">\n<defs>\n", 8 * squareSize, 8 * squareSize, boardSize, boardSize);
+    for (int side = white; side <= black; ++side) {
+        for (int piece = pawn; piece <= king; ++piece) {
+            const uint8_t* body = diagramBodyColors[side];
+            s += sprintf(s, "<g id=\"%c%c\"><path fill=\"#%02x%02x%02x\" d=\"", "wb"[side], " pnbrqk"[piece], diagramOutlineColor[0], diagramOutlineColor[1], diagramOutlineColor[2]);
+            s += append_mask_path(diagramMasks[piece], '#', s);
+            s += sprintf(s, "\"/><path fill=\"#%02x%02x%02x\" d=\"", body[0], body[1], body[2]);
+            s += append_mask_path(diagramMasks[piece], 'o', s);
+            s += sprintf(s, "\"/></g>\n");
+        }
+    }
+    const uint8_t* light = diagramSquareColors[1];
+    const uint8_t* dark = diagramSquareColors[0];
+    s += sprintf(s, "</defs>\n<rect width=\"%d\" height=\"%d\" fill=\"#%02x%02x%02x\"/>\n<path fill=\"#%02x%02x%02x\" d=\"",
+        boardSize, boardSize, light[0], light[1], light[2], dark[0], dark[1], dark[2]);
+    // the top left square is light whichever side the board is seen from
+    for (int y = 0; y < 8; ++y) {
+        for (int x = (y + 1) % 2; x < 8; x += 2) {
+            s += sprintf(s, "M%d %dh%dv%dh-%dz", x * DIAGRAM_GRID, y * DIAGRAM_GRID, DIAGRAM_GRID, DIAGRAM_GRID, DIAGRAM_GRID);
+        }
+    }
+    s += sprintf(s, "\"/>\n");
+    t->prologueLength = s - t->prologue;
+    t->bufferSize = t->prologueLength + 66 * 96;
+}
+
+void free_diagram_templates(diagramTemplates* t) {
+    free(t->tiles);
+    free(t->prologue);
+}
+
+/**
+ * Render board into buffer, of at least t->bufferSize bytes, seen from white or black, with the squares from and
+ * to of the last move highlighted unless negative. Returns the length of the diagram.
+ */
+size_t render_diagram(diagramTemplates* t, sidedPiece board[8][8], bool aswhite, int from, int to, char* buffer) {
+    if (t->format == diagramPpm) {
+        int s = t->squareSize;
+        size_t row = (size_t)s * 3;
+        size_t tileSize = row * s;
+        size_t n = sprintf(buffer, "P6\n%d %d\n255\n", 8 * s, 8 * s);
+        uint8_t* out = (uint8_t*)buffer + n;
+        for (int y = 0; y < 8; ++y) {
+            const uint8_t* tiles[8];
+            for (int x = 0; x < 8; ++x) {
+                int rank = aswhite ? 7 - y : y;
+                int file = aswhite ? x : 7 - x;
+                int square = rank * 8 + file;
+                int color = (rank + file) % 2 + (square == from || square == to ? 2 : 0);
+                tiles[x] = t->tiles + (color * DIAGRAM_PIECES + diagram_piece_index(board[rank][file])) * tileSize;
+            }
+            for (int line = 0; line < s; ++line) {
+                for (int x = 0; x < 8; ++x) {
+                    memcpy(out, tiles[x] + line * row, row);
+                    out += row;
+                }
+            }
+        }
+        return n + 64 * tileSize;
+    }
+
+    memcpy(buffer, t->prologue, t->prologueLength);
+    char* s = buffer + t->prologueLength;
+    for (int i = 0; i < 2; ++i) {
+        int square = i == 0 ? from : to;
+        if (square < 0) {
+            continue;
+        }
+        int rank = square / 8, file = square % 8;
+        const uint8_t* rgb = diagramSquareColors[2 + (rank + file) % 2];
+        s += sprintf(s, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" fill=\"#%02x%02x%02x\"/>\n",
+            (aswhite ? file : 7 - file) * DIAGRAM_GRID, (aswhite ? 7 - rank : rank) * DIAGRAM_GRID, DIAGRAM_GRID, DIAGRAM_GRID, rgb[0], rgb[1], rgb[2]);
+    }
+    for (int rank = 0; rank < 8; ++rank) {
+        for (int file = 0; file < 8; ++file) {
+            sidedPiece sp = board[rank][file];
+            if (sp != empty) {
+                s += sprintf(s, "<use xlink:href=\"#%c%c\" x=\"%d\" y=\"%d\"/>\n", sp > 0 ? 'w' : 'b', " pnbrqk"[sp > 0 ? sp : -sp],
+                    (aswhite ? file : 7 - file) * DIAGRAM_GRID, (aswhite ? 7 - rank : rank) * DIAGRAM_GRID);
+            }
+        }
+    }
+    s += sprintf(s, "</svg>\n");
+    return s - buffer;
+}
+
+void print_algebraic_notation(move* m) {
+    char buffer[16];
+    format_algebraic_notation(m, buffer);
+    wprintf(L"%s", buffer);
+}
+
+walkAction print_tree_node(treeWalk* walk, moveTree* m) {
+    if (walk->depth > 0) {
+        wprintf(L"\n");
+    }
+    // TODO fix because decision level is obsolete
+    if (m->previousMove && m->previousMove->decisionLevel != m->decisionLevel) {
+        wprintf(L"\n");
+        for (int i = 0; i < m->decisionLevel; ++i) {
+            wprintf(L"\t");
+        }
+    }
+    if (m->probability != 0) {
+        wprintf(L"%d%% ", m->probability);
+    }
+    print_algebraic_notation(m->move);
+    wprintf(L" ");
+    return walkContinue;
+}
+
+void print_tree(moveTree* m) {
+    treeWalk walk;
+    init_tree_walk(&walk, NULL, print_tree_node, NULL, NULL, &defaultAllocator);
+    walk_tree(&walk, m);
+    free_tree_walk(&walk);
+}
+
+#ifdef CHESSLINE_STATS
+walkAction stats_record_node(treeWalk* walk, moveTree* m) {
+    int children = 0;
+    int depth = walk->depth;
+    stats_add(&stats.nodes, 1);
+    stats_add(&stats.depthHistogram[depth < STATS_MAX_DEPTH ? depth : STATS_MAX_DEPTH-1], 1);
+    stats_max(&stats.maxDepth, depth);
+    for (moveTree* c = m->firstChoice; c != NULL; c = c->nextChoice) {
+        children++;
+    }
+    stats_add(&stats.branchingHistogram[children < STATS_MAX_BRANCHING ? children : STATS_MAX_BRANCHING-1], 1);
+    return walkContinue;
+}
+
+/** Collect node count, depth and branching histograms of the tree into the statistics. */
+void stats_record_tree(moveTree* root) {
+    treeWalk walk;
+    init_tree_walk(&walk, NULL, stats_record_node, NULL, NULL, &defaultAllocator);
+    walk_tree(&walk, root);
+    free_tree_walk(&walk);
+}
+
+void print_stats_timer_json(FILE* out, char* name, statsTimer* timer, bool last) {
+    fprintf(out, "    \"%s\": {\"calls\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}%s\n",
+        name, timer->calls, timer->totalNs, timer->maxNs, last ? "" : ",");
+}
+
+void print_stats_histogram_json(FILE* out, uint64_t* histogram, int size) {
+    int used = size;
+    while (used > 0 && histogram[used-1] == 0) {
+        used--;
+    }
+    fprintf(out, "[");
+    for (int i = 0; i < used; ++i) {
+        fprintf(out, "%s%" PRIu64, i == 0 ? "" : ", ", histogram[i]);
+    }
+    fprintf(out, "]");
+}
+
+/** Dump the statistics as a single JSON object, meant to be run on exit. */
+void print_stats_json() {
+    FILE* out = stderr;
+    fprintf(out, "{\n  \"timers\": {\n");
+    print_stats_timer_json(out, "next_token", &stats.nextToken, false);
+    print_stats_timer_json(out, "parse_algebraic_notation2", &stats.parseAlgebraicNotation, false);
+    print_stats_timer_json(out, "parse", &stats.parse, false);
+    print_stats_timer_json(out, "board_apply_move", &stats.boardApplyMove, false);
+    print_stats_timer_json(out, "choose_move", &stats.chooseMove, false);
+    print_stats_timer_json(out, "print_board", &stats.printBoard, true);
+    fprintf(out, "  },\n  \"allocations\": {\"count\": %" PRIu64 ", \"bytes\": %" PRIu64 "},\n", stats.allocations, stats.allocatedBytes);
+    fprintf(out, "  \"tree\": {\"nodes\": %" PRIu64 ", \"max_depth\": %" PRIu64 ", \"depth_histogram\": ", stats.nodes, stats.maxDepth);
+    print_stats_histogram_json(out, stats.depthHistogram, STATS_MAX_DEPTH);
+    fprintf(out, ", \"branching_histogram\": ");
+    print_stats_histogram_json(out, stats.branchingHistogram, STATS_MAX_BRANCHING);
+    fprintf(out, "}\n}\n");
+}
+#endif
+
+long read_stdio(void* context, char* buffer, size_t size) {
+    FILE* fp = (FILE*)context;
+    size_t n = fread(buffer, 1, size, fp);
+    return n == 0 && ferror(fp) ? -1 : (long)n;
+}
+
+/** Create a parser reading fp with the default allocator. */
+parser* new_file_parser(FILE* fp) {
+    chesslineReader reader = {read_stdio, fp};
+    parser* p = new_parser(reader, NULL);
+    if (p == NULL) {
+        fprintf(stderr, "Failed to allocate memory for parser.\n");
+        exit(1);
+    }
+    return p;
+}
+
+move* new_move() {
+    move* m = (move*)malloc(sizeof(move));
+    STATS_ALLOC(sizeof(move));
+    if (m == NULL) {
+        fprintf(stderr, "failed to allocate memory for new move\n");
+        exit(1);
+    }
+    init_move(m);
+    return m;
+}
+
+moveTree* new_move_tree() {
+    moveTree* t = alloc_move_tree(&defaultAllocator);
+    if (t == NULL) {
+        fprintf(stderr, "failed to allocate memory for new move tree\n");
+        exit(1);
+    }
+    return t;
+}
+
+gameState* new_game() {
+    gameState* game = (gameState*)malloc(sizeof(gameState));
+    STATS_ALLOC(sizeof(gameState));
+    if (game == NULL) {
+        fprintf(stderr, "Failed to allocate memory for game state.\n");
+        exit(1);
+    }
+    init_game(game);
+    return game;
+}
+
+/** Apply a move of the repertoire to the board being drilled, which cannot go on past an illegal one. */
+void apply_repertoire_move(sidedPiece board[8][8], move* m) {
+    if (!board_apply_move(board, m)) {
+        fprintf(stderr, "illegal move!\n");
+        exit(1);
+    }
+}
+
+/** Choose random element from an array of pointers. */
+void* random_array_choice(void** choices, int numChoices, uint64_t* random) {
+    int choiceNum = (int)floor(random_probability(random) * numChoices);
+    return choices[choiceNum];
+}
+
+void print_greeting(uint64_t* random) {
+    char* greetings[4] = {"Let's play chess!", "Good luck, have fun!", "Let's go!", "Let's see if you  know how to play this opening."};
+    char* s = (char*)random_array_choice((void**)greetings, sizeof(greetings)/sizeof(char*), random);
+    wprintf(L"%s\n", s);
+}
+
+void print_goodbye(uint64_t* random) {
+    char* messages[2] = {"Goodbye!", "See you again soon!"};
+    char* s = (char*)random_array_choice((void**)messages, sizeof(messages)/sizeof(char*), random);
+    wprintf(L"%s\n", s);
+}
+
+void print_do_not_understand(uint64_t* random) {
+    char* messages[4] = {"Sorry, I did not understand.", "That doesn't look like a move nor a command.", "Sorry, please rephrase.", "Are you sure that's a move (or command)?"};
+    char* s = (char*)random_array_choice((void**)messages, sizeof(messages)/sizeof(char*), random);
+    wprintf(L"%s\n", s);
+}
+
+#define PROGRESS_MAGIC 0x73736572676f7270ULL // "progress"
+#define PROGRESS_VERSION 1
+#define PROGRESS_INITIAL_CAPACITY (1 << 16)
+#define PROGRESS_DEFAULT_EASE 2.5f
+#define PROGRESS_MIN_EASE 1.3f
+
+/**
+ * Training progress of a single position.
+ * The same layout is used for log records and index slots; log records hold absolute values
+ * rather than increments, so replaying a record that was already applied is harmless.
+ */
+typedef struct {
+    uint64_t hash; // 0 marks an empty index slot
+    uint32_t attempts;
+    uint32_t errors;
+    int64_t lastSeen;
+    float easeFactor;
+    uint32_t checksum; // only meaningful for log records
+} progressEntry;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t dirty; // set while the index is being resized, forces a rebuild from the log
+    uint64_t capacity; // number of slots, always a power of two
+    uint64_t count;
+    uint64_t appliedLogSize; // log bytes already reflected in the slots
+    uint8_t padding[24];
+} progressIndexHeader;
+
+/**
+ * On-disk training progress keyed by position hash.
+ *
+ * The log (path) is the source of truth: an append-only sequence of checksummed records.
+ * The index (path.idx) is an mmap'd open addressing table holding the latest entry per position,
+ * plus how much of the log it reflects, so opening only replays the tail written after the last
+ * update that reached the index. All operations run under an exclusive flock on the log so that
+ * several trainees can share one store.
+ */
+typedef struct {
+    int logFd;
+    int indexFd;
+    progressIndexHeader* header;
+    progressEntry* slots;
+    size_t mappedSize;
+} progressStore;
+
+uint32_t progress_checksum(progressEntry* e) {
+    // FNV-1a over everything but the checksum itself
+    uint32_t h = 2166136261u;
+    unsigned char* bytes = (unsigned char*)e;
+    for (size_t i = 0; i < offsetof(progressEntry, checksum); ++i) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+/** Map the index file with the given number of slots, growing the file if needed. */
+bool progress_map_index(progressStore* store, uint64_t capacity) {
+    if (store->header != NULL) {
+        munmap(store->header, store->mappedSize);
+        store->header = NULL;
+    }
+    size_t size = sizeof(progressIndexHeader) + capacity * sizeof(progressEntry);
+    struct stat st;
+    if (fstat(store->indexFd, &st) != 0) {
+        return false;
+    }
+    if ((size_t)st.st_size < size && ftruncate(store->indexFd, size) != 0) {
+        return false;
+    }
+    void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, store->indexFd, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    store->header = (progressIndexHeader*)addr;
+    store->slots = (progressEntry*)(store->header + 1);
+    store->mappedSize = size;
+    return true;
+}
+
+/** Find the slot holding hash, or the empty slot where it would be inserted. */
+progressEntry* progress_find_slot(progressStore* store, uint64_t hash) {
+    uint64_t mask = store->header->capacity - 1;
+    uint64_t i = hash & mask;
+    while (store->slots[i].hash != 0 && store->slots[i].hash != hash) {
+        i = (i + 1) & mask;
+    }
+    return &store->slots[i];
+}
+
+bool progress_grow_index(progressStore* store) {
+    uint64_t oldCapacity = store->header->capacity;
+    size_t oldSlotsSize = oldCapacity * sizeof(progressEntry);
+    progressEntry* old = (progressEntry*)malloc(oldSlotsSize);
+    STATS_ALLOC(oldSlotsSize);
+    if (old == NULL) {
+        return false;
+    }
+    memcpy(old, store->slots, oldSlotsSize);
+    store->header->dirty = 1;
+    if (!progress_map_index(store, oldCapacity * 2)) {
+        free(old);
+        return false;
+    }
+    memset(store->slots, 0, oldCapacity * 2 * sizeof(progressEntry));
+    store->header->capacity = oldCapacity * 2;
+    for (uint64_t i = 0; i < oldCapacity; ++i) {
+        if (old[i].hash != 0) {
+            *progress_find_slot(store, old[i].hash) = old[i];
+        }
+    }
+    store->header->dirty = 0;
+    free(old);
+    return true;
+}
+
+/** Write an entry into the index, which must already have room for it. */
+void progress_index_put(progressStore* store, progressEntry* e) {
+    progressEntry* slot = progress_find_slot(store, e->hash);
+    if (slot->hash == 0) {
+        store->header->count++;
+    }
+    *slot = *e;
+    slot->checksum = 0;
+}
+
+/** Apply log records from the index's applied offset up to the end of the log. */
+bool progress_replay_log(progressStore* store) {
+    struct stat st;
+    if (fstat(store->logFd, &st) != 0) {
+        return false;
+    }
+    off_t torn = st.st_size % (off_t)sizeof(progressEntry);
+    if (torn != 0) {
+        // a partial record from a torn write, drop it so later appends stay aligned
+        if (ftruncate(store->logFd, st.st_size - torn) != 0) {
+            return false;
+        }
+        st.st_size -= torn;
+    }
+    off_t offset = store->header->appliedLogSize;
+    progressEntry buffer[1024];
+    while (offset + (off_t)sizeof(progressEntry) <= st.st_size) {
+        ssize_t n = pread(store->logFd, buffer, sizeof(buffer), offset);
+        if (n <= 0) {
+            return false;
+        }
+        int records = n / sizeof(progressEntry);
+        for (int i = 0; i < records; ++i) {
+            if (buffer[i].checksum != progress_checksum(&buffer[i])) {
+                // torn write at the end of the log, drop it so later appends stay aligned
+                return ftruncate(store->logFd, offset) == 0;
+            }
+            if ((store->header->count + 1) * 10 > store->header->capacity * 7 && !progress_grow_index(store)) {
+                return false;
+            }
+            progress_index_put(store, &buffer[i]);
+            offset += sizeof(progressEntry);
+            store->header->appliedLogSize = offset;
+        }
+    }
+    return true;
+}
+
+/** Reset the index to an empty table that reflects none of the log. */
+bool progress_reset_index(progressStore* store) {
+    if (!progress_map_index(store, PROGRESS_INITIAL_CAPACITY)) {
+        return false;
+    }
+    memset(store->header, 0, store->mappedSize);
+    store->header->magic = PROGRESS_MAGIC;
+    store->header->version = PROGRESS_VERSION;
+    store->header->capacity = PROGRESS_INITIAL_CAPACITY;
+    return true;
+}
+
+/** Bring the index up to date with the log; caller must hold the lock. */
+bool progress_sync(progressStore* store) {
+    if (store->header->dirty || store->mappedSize != sizeof(progressIndexHeader) + store->header->capacity * sizeof(progressEntry)) {
+        // another process resized the index, or a resize was interrupted
+        uint64_t capacity = store->header->capacity;
+        if (store->header->dirty || !progress_map_index(store, capacity)) {
+            if (!progress_reset_index(store)) {
+                return false;
+            }
+        }
+    }
+    return progress_replay_log(store);
+}
+
+void close_progress_store(progressStore* store) {
+    if (store->header != NULL) {
+        munmap(store->header, store->mappedSize);
+    }
+    fdatasync(store->logFd);
+    close(store->logFd);
+    close(store->indexFd);
+    free(store);
+}
+
+progressStore* open_progress_store(char* path) {
+    progressStore* store = (progressStore*)malloc(sizeof(progressStore));
+    STATS_ALLOC(sizeof(progressStore));
+    if (store == NULL) {
+        fprintf(stderr, "Failed to allocate memory for progress store.\n");
+        exit(1);
+    }
+    store->header = NULL;
+    store->logFd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    char indexPath[PATH_MAX];
+    snprintf(indexPath, PATH_MAX, "%s.idx", path);
+    store->indexFd = open(indexPath, O_RDWR | O_CREAT, 0644);
+    if (store->logFd < 0 || store->indexFd < 0) {
+        fprintf(stderr, "Failed to open progress store %s.\n", path);
+        exit(1);
+    }
+
+    struct stat st;
+    if (flock(store->logFd, LOCK_EX) != 0 || fstat(store->indexFd, &st) != 0) {
+        fprintf(stderr, "Failed to load progress store %s.\n", path);
+        exit(1);
+    }
+    bool valid = (size_t)st.st_size >= sizeof(progressIndexHeader);
+    if (valid) {
+        progressIndexHeader header;
+        valid = pread(store->indexFd, &header, sizeof(header), 0) == sizeof(header) &&
+            header.magic == PROGRESS_MAGIC && header.version == PROGRESS_VERSION && !header.dirty &&
+            header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0 &&
+            progress_map_index(store, header.capacity);
+    }
+    if (fstat(store->logFd, &st) != 0) {
+        fprintf(stderr, "Failed to load progress store %s.\n", path);
+        exit(1);
+    }
+    if (valid && (off_t)store->header->appliedLogSize > st.st_size) {
+        valid = false; // log was truncated or replaced
+    }
+    if ((!valid && !progress_reset_index(store)) || !progress_replay_log(store)) {
+        fprintf(stderr, "Failed to load progress store %s.\n", path);
+        exit(1);
+    }
+    flock(store->logFd, LOCK_UN);
+    return store;
+}
+
+/**
+ * Progress of a position in the index as it stands, zeroed with the default ease factor for unseen positions or
+ * when store is NULL. Caller must hold the lock and have synced the index.
+ */
+progressEntry progress_find(progressStore* store, uint64_t hash) {
+    progressEntry e;
+    hash = hash == 0 ? 1 : hash;
+    if (store == NULL) {
+        memset(&e, 0, sizeof(e));
+    } else {
+        e = *progress_find_slot(store, hash);
+    }
+    if (e.hash == 0) {
+        e.hash = hash;
+        e.easeFactor = PROGRESS_DEFAULT_EASE;
+    }
+    return e;
+}
+
+/**
+ * Record one answer given at a position: append it to the log, then update the index in place. The record is on
+ * disk before the index counts it, so the index never claims log bytes lost with a crash.
+ */
+void progress_record_answer(progressStore* store, uint64_t hash, bool correct) {
+    hash = hash == 0 ? 1 : hash;
+    flock(store->logFd, LOCK_EX);
+    if (!progress_sync(store)) {
+        fprintf(stderr, "Failed to update progress store.\n");
+        flock(store->logFd, LOCK_UN);
+        return;
+    }
+    if ((store->header->count + 1) * 10 > store->header->capacity * 7 && !progress_grow_index(store)) {
+        fprintf(stderr, "Failed to grow progress store index.\n");
+        flock(store->logFd, LOCK_UN);
+        return;
+    }
+    progressEntry* slot = progress_find_slot(store, hash);
+    progressEntry e = *slot;
+    if (e.hash == 0) {
+        e.hash = hash;
+        e.easeFactor = PROGRESS_DEFAULT_EASE;
+    }
+    e.attempts++;
+    if (correct) {
+        e.easeFactor += 0.1f;
+    } else {
+        e.errors++;
+        e.easeFactor = fmaxf(PROGRESS_MIN_EASE, e.easeFactor - 0.2f);
+    }
+    e.lastSeen = time(NULL);
+    e.checksum = progress_checksum(&e);
+    if (write(store->logFd, &e, sizeof(e)) != sizeof(e) || fdatasync(store->logFd) != 0) {
+        fprintf(stderr, "Failed to append to progress log.\n");
+        flock(store->logFd, LOCK_UN);
+        return;
+    }
+    progress_index_put(store, &e);
+    store->header->appliedLogSize += sizeof(e);
+    flock(store->logFd, LOCK_UN);
+}
+
+/**
+ * Factor of a position in the weight of the lines through it, from 2 for a position never answered up to 4 for
+ * one always failed and not seen for a month, down to a fraction for one answered right many times recently.
+ */
+double progress_factor(progressEntry* e, int64_t now) {
+    double errorRate = (e->errors + 1.0) / (e->attempts + 2.0);
+    double days = e->attempts > 0 ? (now - e->lastSeen) / 86400.0 : 30;
+    return 2 * errorRate * (1 + fmin(fmax(days, 0), 30) / 30);
+}
+
+/** Context of weigh_lines_by_progress. */
+typedef struct {
+    lineSampler* lines;
+    progressStore* progress; // locked and synced for the walk, NULL when it could not be synced
+    playerSide trainee;
+    int64_t now;
+    double* factors; // largest factor of the positions down to each depth
+    int capacity;
+} lineWeighing;
+
+walkAction weigh_line_node(treeWalk* walk, moveTree* t) {
+    lineWeighing* w = (lineWeighing*)walk->context;
+    if (walk->depth == w->capacity) {
+        int grown = w->capacity ? w->capacity : 64;
+        w->capacity += grown;
+        w->factors = (double*)realloc(w->factors, w->capacity * sizeof(double));
+        STATS_ALLOC(grown * sizeof(double));
+        if (w->factors == NULL) {
+            fprintf(stderr, "Failed to allocate memory for line weights.\n");
+            exit(1);
+        }
+    }
+    double factor = walk->depth > 0 ? w->factors[walk->depth - 1] : LINE_FACTOR_MIN;
+    if (walk->legal && walk->game.sidePlaying == w->trainee && t->firstChoice != NULL) {
+        progressEntry e = progress_find(w->progress, board_hash(walk->game.board, walk->game.sidePlaying));
+        factor = fmax(factor, progress_factor(&e, w->now));
+    }
+    w->factors[walk->depth] = factor;
+    if (t->firstChoice == NULL) {
+        w->lines->factors[t->firstLeaf] = fmin(LINE_FACTOR_MAX, factor);
+    }
+    return walkContinue;
+}
+
+/**
+ * Set the factors of the lines of s from the progress at the positions where the trainee is to move, the
+ * weakest position of a line counting. game holds the position before the move of the root of s. The store is
+ * locked and synced once for the whole walk.
+ */
+void weigh_lines_by_progress(lineSampler* s, gameState* game, progressStore* progress, playerSide trainee) {
+    flock(progress->logFd, LOCK_EX);
+    lineWeighing w = {s, progress_sync(progress) ? progress : NULL, trainee, time(NULL), NULL, 0};
+    treeWalk walk;
+    init_tree_walk(&walk, game, weigh_line_node, NULL, &w, &defaultAllocator);
+    bool completed = walk_tree(&walk, s->root);
+    flock(progress->logFd, LOCK_UN);
+    if (!completed) {
+        fprintf(stderr, "Failed to allocate memory for line weights.\n");
+        exit(1);
+    }
+    free_tree_walk(&walk);
+    free(w.factors);
+    line_sampler_rebuild(s);
+}
+
+/** Number the leaves below root and set up s over them, weighted by progress. */
+void schedule_lines(lineSampler* s, moveTree* root, gameState* game, progressStore* progress, playerSide trainee) {
+    if (!build_line_sampler(root, number_leaves(root), &defaultAllocator, s)) {
+        fprintf(stderr, "Failed to allocate memory for line weights.\n");
+        exit(1);
+    }
+    weigh_lines_by_progress(s, game, progress, trainee);
+}
+
+#define TABLEBASE_CACHE_SIZE (1 << 20) // slots of the probe cache, a power of two
+
+/**
+ * Tablebase outcome for the side to move, with the values of Fathom. A cursed win or a blessed loss is a draw
+ * under the 50-move rule.
+ */
+typedef enum {tablebaseUnknown = -1, tablebaseLoss = 0, tablebaseBlessedLoss = 1, tablebaseDraw = 2, tablebaseCursedWin = 3, tablebaseWin = 4} tablebaseResult;
+char* tablebaseResultNames[] = {"loss", "blessed loss", "draw", "cursed win", "win"};
+
+/**
+ * Syzygy endgame tablebases, probed through Fathom when built with CHESSLINE_SYZYGY. Fathom maps the files of
+ * a material signature on the first probe needing them. Results are cached by position hash in a direct-mapped
+ * table: each slot holds the hash with the result in its low 3 bits, read and written atomically, so the
+ * threads of `check` share it without a lock.
+ */
+typedef struct {
+    uint64_t* cache;
+    int largest; // pieces in the largest tables found
+} tablebase;
+
+/** Set up probing of the tables in path, a list of directories separated by colons. Returns NULL when none is found. */
+tablebase* open_tablebase(char* path) {
+#ifdef CHESSLINE_SYZYGY
+    if (!tb_init(path) || TB_LARGEST == 0) {
+        fprintf(stderr, "No Syzygy tables found in %s.\n", path);
+        return NULL;
+    }
+    tablebase* tb = (tablebase*)malloc(sizeof(tablebase));
+    STATS_ALLOC(sizeof(tablebase));
+    uint64_t* cache = (uint64_t*)calloc(TABLEBASE_CACHE_SIZE, sizeof(uint64_t));
+    STATS_ALLOC(TABLEBASE_CACHE_SIZE * sizeof(uint64_t));
+    if (tb == NULL || cache == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tablebase cache.\n");
+        exit(1);
+    }
+    tb->cache = cache;
+    tb->largest = TB_LARGEST;
+    return tb;
+#else
+    (void)path;
+    fprintf(stderr, "Tablebases are not available, compile with -DCHESSLINE_SYZYGY and Fathom.\n");
+    return NULL;
+#endif
+}
+
+void close_tablebase(tablebase* tb) {
+#ifdef CHESSLINE_SYZYGY
+    tb_free();
+#endif
+    free(tb->cache);
+    free(tb);
+}
+
+/** Castling rights allowed by the board, those whose king and rook are still on their squares. */
+int castling_in_place(sidedPiece board[8][8]) {
+    int rights = 0;
+    if (board[0][4] == whiteKing) {
+        rights |= (board[0][7] == whiteRook ? WHITE_CAN_CASTLE_KINGSIDE : 0) | (board[0][0] == whiteRook ? WHITE_CAN_CASTLE_QUEENSIDE : 0);
+    }
+    if (board[7][4] == blackKing) {
+        rights |= (board[7][7] == blackRook ? BLACK_CAN_CASTLE_KINGSIDE : 0) | (board[7][0] == blackRook ? BLACK_CAN_CASTLE_QUEENSIDE : 0);
+    }
+    return rights;
+}
+
+/** Probe the WDL tables without the cache, ignoring the halfmove clock. */
+tablebaseResult probe_wdl(gameState* game) {
+#ifdef CHESSLINE_SYZYGY
+    uint64_t sides[2] = {0, 0};
+    uint64_t pieces[7] = {0};
+    for (int rank = 0; rank < 8; ++rank) {
+        for (int file = 0; file < 8; ++file) {
+            sidedPiece sp = game->board[rank][file];
+            if (sp != empty) {
+                uint64_t square = 1ULL << (rank * 8 + file);
+                sides[sp < 0] |= square;
+                pieces[sp < 0 ? -sp : sp] |= square;
+            }
+        }
+    }
+    unsigned enPassant = game->enPassantTarget.file != 0 ? (game->enPassantTarget.rank - 1) * 8 + game->enPassantTarget.file - 1 : 0;
+    unsigned result = tb_probe_wdl(sides[white], sides[black], pieces[king], pieces[queen], pieces[rook], pieces[bishop], pieces[knight], pieces[pawn],
+        0, 0, enPassant, game->sidePlaying == white);
+    return result == TB_RESULT_FAILED ? tablebaseUnknown : (tablebaseResult)result;
+#else
+    (void)game;
+    return tablebaseUnknown;
+#endif
+}
+
+/** Outcome of the position for the side to move, unknown with castling rights or more pieces than the tables. */
+tablebaseResult probe_tablebase(tablebase* tb, gameState* game) {
+    int pieces = 0;
+    for (int rank = 0; rank < 8; ++rank) {
+        for (int file = 0; file < 8; ++file) {
+            pieces += game->board[rank][file] != empty;
+        }
+    }
+    if (pieces > tb->largest || game->castlingAvailability != 0) {
+        return tablebaseUnknown;
+    }
+    uint64_t hash = board_hash(game->board, game->sidePlaying) ^ game->enPassantTarget.file * 0x9e3779b97f4a7c15ULL;
+    uint64_t* slot = &tb->cache[hash & (TABLEBASE_CACHE_SIZE - 1)];
+    uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    if ((entry & 7) != 0 && ((entry ^ hash) & ~7ULL) == 0) {
+        return (tablebaseResult)((entry & 7) - 2);
+    }
+    tablebaseResult result = probe_wdl(game);
+    // failed probes are cached too, as 1
+    __atomic_store_n(slot, (hash & ~7ULL) | (uint64_t)(result + 2), __ATOMIC_RELAXED);
+    return result;
+}
+
+/** Outcome of a resolved move for the side making it. */
+tablebaseResult tablebase_after_move(tablebase* tb, gameState* game, move* resolved) {
+    moveUndo u;
+    game_make_move(game, resolved, &u);
+    tablebaseResult result = probe_tablebase(tb, game);
+    game_unmake_move(game, &u);
+    return result == tablebaseUnknown ? result : tablebaseWin - result;
+}
+
+/**
+ * Find a move of the repertoire at tip that keeps the tablebase outcome of the position, when m, which is not in
+ * the repertoire, keeps it as well. game holds the board after the move of tip. Returns NULL otherwise.
+ */
+moveTree* tablebase_equivalent_move(tablebase* tb, gameState* game, moveTree* tip, move* m, tablebaseResult* outcome) {
+    // only the board is kept up to date while drilling
+    gameState position = *game;
+    position.sidePlaying = tip->move->side == white ? black : white;
+    position.castlingAvailability &= castling_in_place(game->board);
+    position.enPassantTarget.file = 0;
+    tablebaseResult best = probe_tablebase(tb, &position);
+    move resolved;
+    m->side = position.sidePlaying;
+    if (best == tablebaseUnknown || !game_resolve_move(&position, m, &resolved) || tablebase_after_move(tb, &position, &resolved) != best) {
+        return NULL;
+    }
+    for (moveTree* c = tip->firstChoice; c != NULL; c = c->nextChoice) {
+        if (game_resolve_move(&position, c->move, &resolved) && tablebase_after_move(tb, &position, &resolved) == best) {
+            *outcome = best;
+            return c;
+        }
+    }
+    return NULL;
+}
+
+#define PGN_CHUNK_SIZE (1 << 20)
+#define PGN_MAX_TOKEN 64
+
+typedef enum {resultUnknown, resultWhiteWins, resultBlackWins, resultDraw} gameResult;
+
+/** A game read from a PGN database, with its moves resolved against the legal move list. */
+typedef struct {
+    size_t offset; // first byte of the game in the database
+    size_t length;
+    gameState start;
+    move* moves;
+    int moveCount;
+    int moveCapacity;
+    bool valid; // false when a move could not be read, moves then holds the moves before it
+    gameResult result;
+} pgnGame;
+
+/**
+ * Sequential reader of PGN games from an mmap'd database, tokenized a chunk at a time with scan_tokens.
+ * Tag pairs other than FEN are skipped, so are comments, NAGs and variations.
+ */
+typedef struct {
+    int fd;
+    char* text;
+    size_t length;
+    size_t end; // stop at the first game starting at or after this offset
+    size_t chunkStart;
+    size_t chunkEnd;
+    tokenMasks* masks;
+    tokenScanState scanState;
+    tokenIterator it;
+    bool hasPending; // token pushed back by the game reader
+    size_t pendingOffset, pendingLength;
+    bool pendingNumeric;
+    int maxPlies; // moves after these are skipped without being read
+} pgnReader;
+
+pgnReader* open_pgn_reader(char* path) {
+    pgnReader* r = (pgnReader*)malloc(sizeof(pgnReader));
+    STATS_ALLOC(sizeof(pgnReader));
+    if (r == NULL) {
+        fprintf(stderr, "Failed to allocate memory for PGN reader.\n");
+        exit(1);
+    }
+    r->fd = open(path, O_RDONLY);
+    struct stat st;
+    if (r->fd < 0 || fstat(r->fd, &st) != 0) {
+        fprintf(stderr, "Failed to open %s for reading.\n", path);
+        exit(1);
+    }
+    r->length = r->end = st.st_size;
+    r->text = r->length > 0 ? (char*)mmap(NULL, r->length, PROT_READ, MAP_PRIVATE, r->fd, 0) : NULL;
+    if (r->text == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s.\n", path);
+        exit(1);
+    }
+    madvise(r->text, r->length, MADV_SEQUENTIAL);
+    r->masks = (tokenMasks*)malloc((PGN_CHUNK_SIZE / 64 + 2) * sizeof(tokenMasks));
+    STATS_ALLOC((PGN_CHUNK_SIZE / 64 + 2) * sizeof(tokenMasks));
+    if (r->masks == NULL) {
+        fprintf(stderr, "Failed to allocate memory for PGN reader.\n");
+        exit(1);
+    }
+    r->chunkStart = r->chunkEnd = 0;
+    r->hasPending = false;
+    r->maxPlies = INT_MAX;
+    memset(&r->scanState, 0, sizeof(r->scanState));
+    init_token_iterator(&r->it, r->text, 0, r->masks);
+    return r;
+}
+
+/**
+ * Restrict the reader to games starting in [start, end), as used to split a database between threads.
+ * start is moved forward to the beginning of a game.
+ */
+void pgn_reader_seek(pgnReader* r, size_t start, size_t end) {
+    // a game starts with a tag at the beginning of a line following a line that is not a tag
+    while (start > 0 && start < r->length) {
+        char* tag = (char*)memchr(r->text + start - 1, '\n', r->length - start + 1);
+        if (tag == NULL) {
+            start = r->length;
+            break;
+        }
+        start = tag - r->text + 1;
+        if (start < r->length && r->text[start] == '[') {
+            size_t previous = start - 1;
+            while (previous > 0 && r->text[previous-1] != '\n') {
+                previous--;
+            }
+            if (r->text[previous] != '[') {
+                break;
+            }
+        }
+        start++;
+    }
+    r->chunkStart = r->chunkEnd = start < r->length ? start : r->length;
+    r->end = end;
+    r->hasPending = false;
+    memset(&r->scanState, 0, sizeof(r->scanState));
+    init_token_iterator(&r->it, r->text + r->chunkStart, 0, r->masks);
+}
+
+void close_pgn_reader(pgnReader* r) {
+    if (r->text != NULL) {
+        munmap(r->text, r->length);
+    }
+    close(r->fd);
+    free(r->masks);
+    free(r);
+}
+
+/** Next token of the database as an absolute offset and length, scanning a new chunk when needed. */
+bool pgn_next_token(pgnReader* r, size_t* offset, size_t* length, bool* numeric) {
+    if (r->hasPending) {
+        r->hasPending = false;
+        *offset = r->pendingOffset;
+        *length = r->pendingLength;
+        *numeric = r->pendingNumeric;
+        return true;
+    }
+    while (!next_scanned_token(&r->it, offset, length, numeric)) {
+        if (r->chunkEnd >= r->length) {
+            return false;
+        }
+        // chunks end after a newline so that no token crosses them
+        r->chunkStart = r->chunkEnd;
+        size_t end = r->chunkStart + PGN_CHUNK_SIZE;
+        if (end >= r->length) {
+            end = r->length;
+        } else {
+            while (end > r->chunkStart && r->text[end-1] != '\n') {
+                end--;
+            }
+            if (end == r->chunkStart) {
+                end = r->chunkStart + PGN_CHUNK_SIZE;
+            }
+        }
+        r->chunkEnd = end;
+        scan_tokens(r->text + r->chunkStart, end - r->chunkStart, r->masks, &r->scanState);
+        init_token_iterator(&r->it, r->text + r->chunkStart, end - r->chunkStart, r->masks);
+    }
+    *offset += r->chunkStart;
+    return true;
+}
+
+void pgn_push_back_token(pgnReader* r, size_t offset, size_t length, bool numeric) {
+    r->hasPending = true;
+    r->pendingOffset = offset;
+    r->pendingLength = length;
+    r->pendingNumeric = numeric;
+}
+
+pgnGame* new_pgn_game() {
+    pgnGame* g = (pgnGame*)malloc(sizeof(pgnGame));
+    STATS_ALLOC(sizeof(pgnGame));
+    if (g == NULL) {
+        fprintf(stderr, "Failed to allocate memory for PGN game.\n");
+        exit(1);
+    }
+    g->moveCapacity = 256;
+    g->moves = (move*)malloc(g->moveCapacity * sizeof(move));
+    STATS_ALLOC(g->moveCapacity * sizeof(move));
+    if (g->moves == NULL) {
+        fprintf(stderr, "Failed to allocate memory for PGN game.\n");
+        exit(1);
+    }
+    return g;
+}
+
+void free_pgn_game(pgnGame* g) {
+    free(g->moves);
+    free(g);
+}
+
+bool is_pgn_result(char* token) {
+    return strcmp(token, "1-0") == 0 || strcmp(token, "0-1") == 0 || strcmp(token, "1/2-1/2") == 0 || strcmp(token, "*") == 0;
+}
+
+/**
+ * Read the next game, returning false at the end of the database (or of the range set with pgn_reader_seek).
+ * The moves of the game are made on position, which ends up holding the final position.
+ */
+bool next_pgn_game(pgnReader* r, pgnGame* g, gameState* position) {
+    size_t offset, length;
+    bool numeric;
+    char token[PGN_MAX_TOKEN];
+    char tagName[PGN_MAX_TOKEN] = "";
+    int variationDepth = 0;
+    bool inTag = false, started = false;
+    g->moveCount = 0;
+    g->valid = true;
+    g->result = resultUnknown;
+    gameState* initial = new_game();
+    g->start = *initial;
+    free(initial);
+    *position = g->start;
+    while (pgn_next_token(r, &offset, &length, &numeric)) {
+        char* text = r->text + offset;
+        if (!started) {
+            if (offset >= r->end) {
+                return false;
+            }
+            started = true;
+            g->offset = offset;
+        }
+        g->length = offset + length - g->offset;
+        if (*text == '[' && variationDepth == 0) {
+            if (g->moveCount > 0) {
+                // next game begins without a result for this one
+                pgn_push_back_token(r, offset, length, numeric);
+                g->length = offset - g->offset;
+                return true;
+            }
+            inTag = true;
+            tagName[0] = 0;
+            continue;
+        }
+        if (inTag) {
+            if (*text == ']') {
+                inTag = false;
+            } else if (*text == '"' && strcmp(tagName, "FEN") == 0 && length >= 2) {
+                char fen[BUFFER_SIZE];
+                size_t fenLength = length - 2 < BUFFER_SIZE - 1 ? length - 2 : BUFFER_SIZE - 1;
+                memcpy(fen, text + 1, fenLength);
+                fen[fenLength] = 0;
+                if (parse_fen(fen, &g->start)) {
+                    *position = g->start;
+                } else {
+                    g->valid = false;
+                }
+            } else if (*text != '"') {
+                size_t n = length < PGN_MAX_TOKEN - 1 ? length : PGN_MAX_TOKEN - 1;
+                memcpy(tagName, text, n);
+                tagName[n] = 0;
+            }
+            continue;
+        }
+        if (*text == '(') {
+            variationDepth++;
+            continue;
+        } else if (*text == ')') {
+            variationDepth -= variationDepth > 0;
+            continue;
+        }
+        if (variationDepth > 0 || numeric || *text == '$' || length >= PGN_MAX_TOKEN) {
+            continue;
+        }
+        memcpy(token, text, length);
+        token[length] = 0;
+        if (is_pgn_result(token)) {
+            g->result = token[1] == '/' ? resultDraw : token[0] == '1' ? resultWhiteWins : token[0] == '0' ? resultBlackWins : resultUnknown;
+            return true;
+        }
+        if (!g->valid || g->moveCount >= r->maxPlies) {
+            continue;
+        }
+
+        // move numbers glued to the move ("12.e4", "12...Nf6") and annotations ("e4!?")
+        char* san = token;
+        while ((*san >= '0' && *san <= '9') || *san == '.') {
+            san++;
+        }
+        int sanLength = strlen(san);
+        while (sanLength > 0 && (san[sanLength-1] == '!' || san[sanLength-1] == '?')) {
+            san[--sanLength] = 0;
+        }
+        if (sanLength == 0 || strcmp(san, "e.p.") == 0) {
+            continue;
+        }
+        if (strncmp(san, "0-0", 3) == 0) {
+            san[0] = san[2] = 'O';
+            if (strncmp(san + 3, "-0", 2) == 0) {
+                san[4] = 'O';
+            }
+        }
+        move m;
+        init_move(&m);
+        if (parse_algebraic_notation2(&m, san) == NULL) {
+            g->valid = false;
+            continue;
+        }
+        if (g->moveCount == g->moveCapacity) {
+            g->moveCapacity *= 2;
+            g->moves = (move*)realloc(g->moves, g->moveCapacity * sizeof(move));
+            if (g->moves == NULL) {
+                fprintf(stderr, "Failed to allocate memory for PGN game.\n");
+                exit(1);
+            }
+        }
+        moveUndo u;
+        if (!game_resolve_move(position, &m, &g->moves[g->moveCount])) {
+            g->valid = false;
+            continue;
+        }
+        game_make_move(position, &g->moves[g->moveCount++], &u);
+    }
+    return started;
+}
+
+size_t write_varint(uint8_t* out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+uint64_t read_varint(const uint8_t** in) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (**in & 0x80) {
+        value |= (uint64_t)(*(*in)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint64_t)(*(*in)++) << shift;
+    return value;
+}
+
+size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+#define POSITION_INDEX_MAGIC 0x7864697370726367ULL // "gcrpsidx"
+#define POSITION_INDEX_VERSION 1
+#define POSITION_INDEX_DIRECTORY_BITS 16
+#define POSITION_INDEX_RUN_SIZE (1 << 24) // postings sorted in memory at once
+#define POSITION_INDEX_DEFAULT_PLIES 40
+
+/**
+ * Layout of a position index file:
+ * header, database path, posting lists, entries sorted by hash, directory, game offsets.
+ * A posting list is the varint count of games followed by varint deltas of sorted game ids.
+ * The directory maps the top bits of a hash to the first entry with those bits.
+ */
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t plies;
+    uint64_t gameCount;
+    uint64_t entryCount;
+    uint64_t entriesOffset;
+    uint64_t directoryOffset;
+    uint64_t gamesOffset;
+    uint64_t databasePathLength; // the path follows the header
+} positionIndexHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint64_t postingsOffset;
+} positionIndexEntry;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t game;
+    uint32_t padding;
+} positionPosting;
+
+/** Stable LSD radix sort of postings by hash, keeping game order within a hash. counts has room for 1 << 16 buckets. */
+void sort_position_postings(positionPosting* postings, positionPosting* scratch, size_t* counts, size_t n) {
+    for (int shift = 0; shift < 64; shift += 16) {
+        memset(counts, 0, (1 << 16) * sizeof(size_t));
+        for (size_t i = 0; i < n; ++i) {
+            counts[(postings[i].hash >> shift) & 0xffff]++;
+        }
+        size_t total = 0;
+        for (int b = 0; b < (1 << 16); ++b) {
+            size_t c = counts[b];
+            counts[b] = total;
+            total += c;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            scratch[counts[(postings[i].hash >> shift) & 0xffff]++] = postings[i];
+        }
+        positionPosting* swap = postings;
+        postings = scratch;
+        scratch = swap;
+    }
+}
+
+/** Sorted run of postings spilled to a temporary file during index construction. */
+typedef struct {
+    FILE* file;
+    positionPosting current;
+    bool done;
+} positionPostingRun;
+
+void advance_posting_run(positionPostingRun* run) {
+    run->done = fread(&run->current, sizeof(positionPosting), 1, run->file) != 1;
+}
+
+/**
+ * Build the position index of a PGN database: every position within the first plies of each game
+ * maps to the ids of the games reaching it. Postings are sorted in runs and merged, so memory use
+ * stays bounded whatever the database size.
+ */
+bool build_position_index(char* databasePath, char* indexPath, int plies) {
+    pgnReader* reader = open_pgn_reader(databasePath);
+    reader->maxPlies = plies;
+    pgnGame* game = new_pgn_game();
+    gameState position;
+    positionPosting* postings = (positionPosting*)malloc(POSITION_INDEX_RUN_SIZE * sizeof(positionPosting));
+    positionPosting* scratch = (positionPosting*)malloc(POSITION_INDEX_RUN_SIZE * sizeof(positionPosting));
+    size_t* counts = (size_t*)malloc((1 << 16) * sizeof(size_t));
+    size_t gameCapacity = 1024, gameCount = 0, postingCount = 0;
+    uint64_t* gameOffsets = (uint64_t*)malloc(gameCapacity * sizeof(uint64_t));
+    positionPostingRun* runs = NULL;
+    int runCount = 0;
+    if (postings == NULL || scratch == NULL || counts == NULL || gameOffsets == NULL) {
+        fprintf(stderr, "Failed to allocate memory for position index.\n");
+        exit(1);
+    }
+
+    while (true) {
+        bool more = next_pgn_game(reader, game, &position);
+        if (more) {
+            if (gameCount == gameCapacity) {
+                gameCapacity *= 2;
+                gameOffsets = (uint64_t*)realloc(gameOffsets, gameCapacity * sizeof(uint64_t));
+                if (gameOffsets == NULL) {
+                    fprintf(stderr, "Failed to allocate memory for position index.\n");
+                    exit(1);
+                }
+            }
+            gameOffsets[gameCount] = game->offset;
+            // replay from the start to hash every position
+            gameState replay = game->start;
+            moveUndo u;
+            int moves = game->moveCount < plies ? game->moveCount : plies;
+            for (int i = 0; i <= moves; ++i) {
+                if (i > 0) {
+                    game_make_move(&replay, &game->moves[i-1], &u);
+                }
+                postings[postingCount].hash = board_hash(replay.board, replay.sidePlaying);
+                postings[postingCount].game = gameCount;
+                postings[postingCount++].padding = 0;
+                if (postingCount == POSITION_INDEX_RUN_SIZE) {
+                    break;
+                }
+            }
+            gameCount++;
+        }
+        if (postingCount + plies + 1 > POSITION_INDEX_RUN_SIZE || (!more && postingCount > 0)) {
+            sort_position_postings(postings, scratch, counts, postingCount);
+            runs = (positionPostingRun*)realloc(runs, (runCount + 1) * sizeof(positionPostingRun));
+            FILE* runFile = tmpfile();
+            if (runs == NULL || runFile == NULL || fwrite(postings, sizeof(positionPosting), postingCount, runFile) != postingCount) {
+                fprintf(stderr, "Failed to write temporary position index run.\n");
+                exit(1);
+            }
+            rewind(runFile);
+            runs[runCount].file = runFile;
+            advance_posting_run(&runs[runCount++]);
+            postingCount = 0;
+        }
+        if (!more) {
+            break;
+        }
+    }
+    free(postings);
+    free(scratch);
+    free(counts);
+    free_pgn_game(game);
+    close_pgn_reader(reader);
+
+    FILE* out = fopen(indexPath, "wb");
+    FILE* entries = tmpfile();
+    char absolutePath[PATH_MAX];
+    if (out == NULL || entries == NULL || realpath(databasePath, absolutePath) == NULL) {
+        fprintf(stderr, "Failed to create position index %s.\n", indexPath);
+        return false;
+    }
+    positionIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = POSITION_INDEX_MAGIC;
+    header.version = POSITION_INDEX_VERSION;
+    header.plies = plies;
+    header.gameCount = gameCount;
+    header.databasePathLength = strlen(absolutePath);
+    // every write is checked so that a full disk cannot leave an index that looks complete
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(absolutePath, 1, header.databasePathLength, out) == header.databasePathLength;
+
+    // merge the runs, runs hold increasing game ids so ties go to the earlier run
+    size_t directorySize = ((1 << POSITION_INDEX_DIRECTORY_BITS) + 1) * sizeof(uint64_t);
+    uint64_t* directory = (uint64_t*)calloc(1, directorySize);
+    uint32_t* games = (uint32_t*)malloc((gameCount + 1) * sizeof(uint32_t));
+    uint8_t* encoded = (uint8_t*)malloc((gameCount + 1) * 10);
+    if (directory == NULL || games == NULL || encoded == NULL) {
+        fprintf(stderr, "Failed to allocate memory for position index.\n");
+        exit(1);
+    }
+    uint64_t offset = sizeof(header) + header.databasePathLength;
+    while (true) {
+        int smallest = -1;
+        for (int i = 0; i < runCount; ++i) {
+            if (!runs[i].done && (smallest < 0 || runs[i].current.hash < runs[smallest].current.hash)) {
+                smallest = i;
+            }
+        }
+        if (smallest < 0) {
+            break;
+        }
+        uint64_t hash = runs[smallest].current.hash;
+        size_t count = 0;
+        for (int i = 0; i < runCount; ++i) {
+            while (!runs[i].done && runs[i].current.hash == hash) {
+                if (count == 0 || games[count-1] != runs[i].current.game) {
+                    games[count++] = runs[i].current.game;
+                }
+                advance_posting_run(&runs[i]);
+            }
+        }
+        size_t n = write_varint(encoded, count);
+        uint32_t previous = 0;
+        for (size_t i = 0; i < count; ++i) {
+            n += write_varint(encoded + n, games[i] - previous);
+            previous = games[i];
+        }
+        positionIndexEntry entry = {hash, offset};
+        written = fwrite(encoded, 1, n, out) == n && fwrite(&entry, sizeof(entry), 1, entries) == 1 && written;
+        offset += n;
+        directory[(hash >> (64 - POSITION_INDEX_DIRECTORY_BITS)) + 1]++;
+        header.entryCount++;
+    }
+    for (int i = 0; i < runCount; ++i) {
+        fclose(runs[i].file);
+    }
+    free(runs);
+    free(games);
+    free(encoded);
+
+    // entries must be 8-byte aligned in the mapped file
+    while (offset % 8 != 0) {
+        written = fputc(0, out) != EOF && written;
+        offset++;
+    }
+    header.entriesOffset = offset;
+    rewind(entries);
+    positionIndexEntry buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, sizeof(positionIndexEntry), 4096, entries)) > 0) {
+        written = fwrite(buffer, sizeof(positionIndexEntry), n, out) == n && written;
+    }
+    written = !ferror(entries) && written;
+    fclose(entries);
+    for (int i = 1; i <= (1 << POSITION_INDEX_DIRECTORY_BITS); ++i) {
+        directory[i] += directory[i-1];
+    }
+    header.directoryOffset = header.entriesOffset + header.entryCount * sizeof(positionIndexEntry);
+    written = fwrite(directory, directorySize, 1, out) == 1 && written;
+    free(directory);
+    header.gamesOffset = header.directoryOffset + directorySize;
+    written = fwrite(gameOffsets, sizeof(uint64_t), gameCount, out) == gameCount && written;
+    free(gameOffsets);
+    rewind(out);
+    written = fwrite(&header, sizeof(header), 1, out) == 1 && written;
+    if (fclose(out) != 0 || !written) {
+        fprintf(stderr, "Failed to write position index %s.\n", indexPath);
+        unlink(indexPath);
+        return false;
+    }
+    fprintf(stderr, "Indexed %" PRIu64 " positions of %" PRIu64 " games.\n", header.entryCount, header.gameCount);
+    return true;
+}
+
+/** A position index mapped for querying. */
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    positionIndexHeader* header;
+    positionIndexEntry* entries;
+    uint64_t* directory;
+    uint64_t* gameOffsets;
+    char databasePath[PATH_MAX];
+} positionIndex;
+
+positionIndex* open_position_index(char* path) {
+    positionIndex* index = (positionIndex*)malloc(sizeof(positionIndex));
+    STATS_ALLOC(sizeof(positionIndex));
+    if (index == NULL) {
+        fprintf(stderr, "Failed to allocate memory for position index.\n");
+        exit(1);
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(positionIndexHeader)) {
+        fprintf(stderr, "Failed to open position index %s.\n", path);
+        exit(1);
+    }
+    index->size = st.st_size;
+    index->data = (uint8_t*)mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    index->header = (positionIndexHeader*)index->data;
+    positionIndexHeader* h = index->header;
+    size_t directorySize = ((1 << POSITION_INDEX_DIRECTORY_BITS) + 1) * sizeof(uint64_t);
+    // the sections must follow each other as build_position_index lays them out, within the file;
+    // counts are checked by division so that no sum can overflow
+    bool valid = index->data != MAP_FAILED && h->magic == POSITION_INDEX_MAGIC && h->version == POSITION_INDEX_VERSION &&
+        h->databasePathLength < PATH_MAX &&
+        h->entriesOffset >= sizeof(positionIndexHeader) + h->databasePathLength && h->entriesOffset % 8 == 0 &&
+        h->entriesOffset <= index->size && h->entryCount <= (index->size - h->entriesOffset) / sizeof(positionIndexEntry) &&
+        h->directoryOffset == h->entriesOffset + h->entryCount * sizeof(positionIndexEntry) &&
+        directorySize <= index->size - h->directoryOffset &&
+        h->gamesOffset == h->directoryOffset + directorySize &&
+        h->gameCount <= (index->size - h->gamesOffset) / sizeof(uint64_t);
+    if (valid) {
+        // the directory bounds every binary search, so it must only point at entries
+        index->directory = (uint64_t*)(index->data + h->directoryOffset);
+        valid = index->directory[0] == 0 && index->directory[1 << POSITION_INDEX_DIRECTORY_BITS] == h->entryCount;
+        for (int i = 0; valid && i < (1 << POSITION_INDEX_DIRECTORY_BITS); ++i) {
+            valid = index->directory[i] <= index->directory[i + 1];
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "Invalid position index %s.\n", path);
+        exit(1);
+    }
+    index->entries = (positionIndexEntry*)(index->data + h->entriesOffset);
+    index->gameOffsets = (uint64_t*)(index->data + h->gamesOffset);
+    memcpy(index->databasePath, index->data + sizeof(positionIndexHeader), index->header->databasePathLength);
+    index->databasePath[index->header->databasePathLength] = 0;
+    return index;
+}
+
+void close_position_index(positionIndex* index) {
+    munmap(index->data, index->size);
+    free(index);
+}
+
+/**
+ * Find the games reaching the position with the given hash, storing up to maxGames ids in games.
+ * Returns the total number of games, which may be larger than maxGames. A posting list outside the postings of
+ * the file, or naming a game that is not indexed, counts as no games.
+ */
+size_t position_index_query(positionIndex* index, uint64_t hash, uint32_t* games, size_t maxGames) {
+    uint64_t bucket = hash >> (64 - POSITION_INDEX_DIRECTORY_BITS);
+    uint64_t low = index->directory[bucket], high = index->directory[bucket + 1];
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (index->entries[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low >= index->directory[bucket + 1] || index->entries[low].hash != hash) {
+        return 0;
+    }
+    uint64_t postingsOffset = index->entries[low].postingsOffset;
+    if (postingsOffset < sizeof(positionIndexHeader) + index->header->databasePathLength || postingsOffset >= index->header->entriesOffset) {
+        return 0;
+    }
+    const uint8_t* p = index->data + postingsOffset;
+    size_t count = read_varint(&p);
+    uint32_t game = 0;
+    for (size_t i = 0; i < count && i < maxGames; ++i) {
+        game += read_varint(&p);
+        if (game >= index->header->gameCount) {
+            return 0;
+        }
+        games[i] = game;
+    }
+    return count;
+}
+
+/** Text of a game in the indexed database, not null terminated. */
+char* position_index_game_text(positionIndex* index, char* database, size_t databaseLength, uint32_t game, size_t* length) {
+    uint64_t start = index->gameOffsets[game];
+    uint64_t end = game + 1 < index->header->gameCount ? index->gameOffsets[game + 1] : databaseLength;
+    // the database may have changed since it was indexed
+    start = start < databaseLength ? start : databaseLength;
+    end = end < databaseLength ? end : databaseLength;
+    *length = end > start ? end - start : 0;
+    return database + start;
+}
+
+/** Entry point of `chessline index`, building the position index of a PGN database. */
+int index_main(int argc, char* argv[]) {
+    char* paths[2] = {NULL, NULL};
+    int pathCount = 0;
+    int plies = POSITION_INDEX_DEFAULT_PLIES;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--plies=", 8) == 0) {
+            plies = atoi(argv[i] + 8);
+        } else if (argv[i][0] != '-' && pathCount < 2) {
+            paths[pathCount++] = argv[i];
+        } else {
+            pathCount = 0;
+            break;
+        }
+    }
+    if (pathCount != 2 || plies < 0) {
+        fprintf(stderr, "Usage: $ chessline index DATABASE.pgn INDEX [--plies=N]\n");
+        return 1;
+    }
+    return build_position_index(paths[0], paths[1], plies) ? 0 : 1;
+}
+
+// squares attacked from each square, a1 being 0 and h8 63
+uint64_t knightAttacks[64];
+uint64_t kingAttacks[64];
+uint64_t pawnAttacks[2][64]; // by a pawn of each side
+uint64_t rays[8][64]; // squares up to the edge in each direction, the first four towards higher squares
+const int rayDirections[8][2] = {{1, 0}, {0, 1}, {1, 1}, {1, -1}, {-1, 0}, {0, -1}, {-1, -1}, {-1, 1}}; // rank, file
+
+void init_attack_tables() {
+    for (int square = 0; square < 64; ++square) {
+        int rank = square / 8, file = square % 8;
+        knightAttacks[square] = kingAttacks[square] = pawnAttacks[white][square] = pawnAttacks[black][square] = 0;
+        for (int dr = -2; dr <= 2; ++dr) {
+            for (int df = -2; df <= 2; ++df) {
+                if (rank + dr < 0 || rank + dr > 7 || file + df < 0 || file + df > 7) {
+                    continue;
+                }
+                uint64_t target = 1ULL << (square + dr * 8 + df);
+                if (dr * dr + df * df == 5) {
+                    knightAttacks[square] |= target;
+                } else if (dr * dr <= 1 && df * df <= 1 && (dr != 0 || df != 0)) {
+                    kingAttacks[square] |= target;
+                    if (df != 0 && dr != 0) {
+                        pawnAttacks[dr > 0 ? white : black][square] |= target;
+                    }
+                }
+            }
+        }
+        for (int d = 0; d < 8; ++d) {
+            rays[d][square] = 0;
+            for (int r = rank + rayDirections[d][0], f = file + rayDirections[d][1]; r >= 0 && r < 8 && f >= 0 && f < 8; r += rayDirections[d][0], f += rayDirections[d][1]) {
+                rays[d][square] |= 1ULL << (r * 8 + f);
+            }
+        }
+    }
+}
+
+/** Squares reached from square in a direction, up to and including the first occupied one. */
+uint64_t slide_attacks(int square, int direction, uint64_t occupied) {
+    uint64_t attacks = rays[direction][square];
+    uint64_t blockers = attacks & occupied;
+    if (blockers != 0) {
+        int blocker = direction < 4 ? __builtin_ctzll(blockers) : 63 - __builtin_clzll(blockers);
+        attacks ^= rays[direction][blocker];
+    }
+    return attacks;
+}
+
+uint64_t rook_attacks(int square, uint64_t occupied) {
+    return slide_attacks(square, 0, occupied) | slide_attacks(square, 1, occupied) | slide_attacks(square, 4, occupied) | slide_attacks(square, 5, occupied);
+}
+
+uint64_t bishop_attacks(int square, uint64_t occupied) {
+    return slide_attacks(square, 2, occupied) | slide_attacks(square, 3, occupied) | slide_attacks(square, 6, occupied) | slide_attacks(square, 7, occupied);
+}
+
+/** Bitboards of a position. */
+typedef struct {
+    uint64_t sides[2];
+    uint64_t pieces[7]; // by pieceEnum, of both sides
+    uint8_t squares[64]; // pieceEnum, 0 when empty
+} bitboards;
+
+void init_bitboards(bitboards* b, sidedPiece board[8][8]) {
+    memset(b, 0, sizeof(bitboards));
+    // without branches, which positions of real games mispredict: empty squares go to pieces[empty], cleared after
+    for (int square = 0; square < 64; ++square) {
+        sidedPiece sp = board[square / 8][square % 8];
+        pieceEnum p = sp < 0 ? -sp : sp;
+        b->sides[sp < 0] |= (uint64_t)(sp != empty) << square;
+        b->pieces[p] |= 1ULL << square;
+        b->squares[square] = p;
+    }
+    b->pieces[empty] = 0;
+}
+
+/** Pieces of both sides attacking square with the given occupancy, sliders seeing through the squares left empty. */
+uint64_t attackers_to(bitboards* b, int square, uint64_t occupied) {
+    return (pawnAttacks[black][square] & b->pieces[pawn] & b->sides[white])
+        | (pawnAttacks[white][square] & b->pieces[pawn] & b->sides[black])
+        | (knightAttacks[square] & b->pieces[knight])
+        | (kingAttacks[square] & b->pieces[king])
+        | (bishop_attacks(square, occupied) & (b->pieces[bishop] | b->pieces[queen]))
+        | (rook_attacks(square, occupied) & (b->pieces[rook] | b->pieces[queen]));
+}
+
+/** Squares attacked by the pieces of side. */
+uint64_t attacked_by(bitboards* b, playerSide side) {
+    uint64_t occupied = b->sides[white] | b->sides[black];
+    uint64_t attacks = 0;
+    for (uint64_t pieces = b->sides[side] & ~b->pieces[pawn]; pieces != 0; pieces &= pieces - 1) {
+        int square = __builtin_ctzll(pieces);
+        switch (b->squares[square]) {
+        case knight:
+            attacks |= knightAttacks[square];
+            break;
+        case bishop:
+            attacks |= bishop_attacks(square, occupied);
+            break;
+        case rook:
+            attacks |= rook_attacks(square, occupied);
+            break;
+        case queen:
+            attacks |= bishop_attacks(square, occupied) | rook_attacks(square, occupied);
+            break;
+        default:
+            attacks |= kingAttacks[square];
+        }
+    }
+    uint64_t pawns = b->sides[side] & b->pieces[pawn];
+    uint64_t notAFile = 0xfefefefefefefefeULL, notHFile = 0x7f7f7f7f7f7f7f7fULL;
+    if (side == white) {
+        attacks |= ((pawns & notAFile) << 7) | ((pawns & notHFile) << 9);
+    } else {
+        attacks |= ((pawns & notAFile) >> 9) | ((pawns & notHFile) >> 7);
+    }
+    return attacks;
+}
+
+int add_pawn_codes(uint16_t* codes, int n, uint64_t targets, int step, uint64_t lastRank) {
+    for (; targets != 0; targets &= targets - 1) {
+        int to = __builtin_ctzll(targets);
+        uint16_t code = (to - step) << 9 | to << 3;
+        if ((lastRank >> to & 1) != 0) {
+            for (pieceEnum p = queen; p >= knight; --p) {
+                codes[n++] = code | p;
+            }
+        } else {
+            codes[n++] = code | pawn;
+        }
+    }
+    return n;
+}
+
+int add_piece_codes(uint16_t* codes, int n, int from, uint64_t targets) {
+    for (; targets != 0; targets &= targets - 1) {
+        codes[n++] = from << 9 | __builtin_ctzll(targets) << 3 | pawn;
+    }
+    return n;
+}
+
+/**
+ * Generate the pack_move() codes of the moves following piece movement rules, possibly leaving the own king in
+ * check, like generate_pseudo_legal_moves but from bitboards b of game and a piece type at a time, without
+ * filling in whole moves: pawn pushes, double pushes and captures, then knights, bishops, rooks, queens and the
+ * king, pieces and their destinations from a1 to h8, promotions from queen to knight, and castling last.
+ */
+int generate_move_codes(gameState* game, bitboards* b, uint16_t* codes) {
+    playerSide side = game->sidePlaying;
+    playerSide opponent = side == white ? black : white;
+    uint64_t own = b->sides[side];
+    uint64_t occupied = b->sides[white] | b->sides[black];
+    uint64_t enPassant = game->enPassantTarget.file != 0 ? 1ULL << ((game->enPassantTarget.rank - 1) * 8 + game->enPassantTarget.file - 1) : 0;
+    uint64_t captures = b->sides[opponent] | enPassant;
+    uint64_t pawns = own & b->pieces[pawn];
+    uint64_t notAFile = 0xfefefefefefefefeULL, notHFile = 0x7f7f7f7f7f7f7f7fULL;
+    int n = 0;
+    if (side == white) {
+        uint64_t pushes = pawns << 8 & ~occupied;
+        n = add_pawn_codes(codes, n, pushes, 8, 0xff00000000000000ULL);
+        n = add_pawn_codes(codes, n, (pushes & 0xff0000ULL) << 8 & ~occupied, 16, 0);
+        n = add_pawn_codes(codes, n, (pawns & notAFile) << 7 & captures, 7, 0xff00000000000000ULL);
+        n = add_pawn_codes(codes, n, (pawns & notHFile) << 9 & captures, 9, 0xff00000000000000ULL);
+    } else {
+        uint64_t pushes = pawns >> 8 & ~occupied;
+        n = add_pawn_codes(codes, n, pushes, -8, 0xffULL);
+        n = add_pawn_codes(codes, n, (pushes & 0xff0000000000ULL) >> 8 & ~occupied, -16, 0);
+        n = add_pawn_codes(codes, n, (pawns & notAFile) >> 9 & captures, -9, 0xffULL);
+        n = add_pawn_codes(codes, n, (pawns & notHFile) >> 7 & captures, -7, 0xffULL);
+    }
+    for (uint64_t pieces = own & b->pieces[knight]; pieces != 0; pieces &= pieces - 1) {
+        int from = __builtin_ctzll(pieces);
+        n = add_piece_codes(codes, n, from, knightAttacks[from] & ~own);
+    }
+    for (uint64_t pieces = own & b->pieces[bishop]; pieces != 0; pieces &= pieces - 1) {
+        int from = __builtin_ctzll(pieces);
+        n = add_piece_codes(codes, n, from, bishop_attacks(from, occupied) & ~own);
+    }
+    for (uint64_t pieces = own & b->pieces[rook]; pieces != 0; pieces &= pieces - 1) {
+        int from = __builtin_ctzll(pieces);
+        n = add_piece_codes(codes, n, from, rook_attacks(from, occupied) & ~own);
+    }
+    for (uint64_t pieces = own & b->pieces[queen]; pieces != 0; pieces &= pieces - 1) {
+        int from = __builtin_ctzll(pieces);
+        n = add_piece_codes(codes, n, from, (bishop_attacks(from, occupied) | rook_attacks(from, occupied)) & ~own);
+    }
+    for (uint64_t pieces = own & b->pieces[king]; pieces != 0; pieces &= pieces - 1) {
+        int from = __builtin_ctzll(pieces);
+        n = add_piece_codes(codes, n, from, kingAttacks[from] & ~own);
+    }
+
+    // castling, the king may not be in check nor pass through an attacked square
+    int kingSquare = side == white ? 4 : 60;
+    int kingside = side == white ? WHITE_CAN_CASTLE_KINGSIDE : BLACK_CAN_CASTLE_KINGSIDE;
+    int queenside = side == white ? WHITE_CAN_CASTLE_QUEENSIDE : BLACK_CAN_CASTLE_QUEENSIDE;
+    uint64_t rooks = b->sides[side] & b->pieces[rook];
+    bool castleShort = (game->castlingAvailability & kingside) && (rooks >> (kingSquare + 3) & 1) && (occupied >> (kingSquare + 1) & 3) == 0;
+    bool castleLong = (game->castlingAvailability & queenside) && (rooks >> (kingSquare - 4) & 1) && (occupied >> (kingSquare - 3) & 7) == 0;
+    // attacks are only looked for once a path is clear
+    if ((castleShort || castleLong) && (b->sides[side] & b->pieces[king] & 1ULL << kingSquare) &&
+        (attackers_to(b, kingSquare, occupied) & b->sides[opponent]) == 0) {
+        if (castleShort && (attackers_to(b, kingSquare + 1, occupied) & b->sides[opponent]) == 0 &&
+            (attackers_to(b, kingSquare + 2, occupied) & b->sides[opponent]) == 0) {
+            codes[n++] = kingSquare << 9 | (kingSquare + 2) << 3 | pawn;
+        }
+        if (castleLong && (attackers_to(b, kingSquare - 1, occupied) & b->sides[opponent]) == 0 &&
+            (attackers_to(b, kingSquare - 2, occupied) & b->sides[opponent]) == 0) {
+            codes[n++] = kingSquare << 9 | (kingSquare - 2) << 3 | pawn;
+        }
+    }
+    return n;
+}
+
+/** Make the move of a pack_move() code, as generate_move_codes produces, on game and its bitboards. */
+void game_make_move_code(gameState* game, bitboards* b, uint16_t code) {
+    int from = code >> 9, to = code >> 3 & 63;
+    playerSide side = game->sidePlaying;
+    pieceEnum p = b->squares[from];
+    pieceEnum placed = (code & 7) != pawn ? (pieceEnum)(code & 7) : p;
+    move m;
+    memset(&m, 0, sizeof(move));
+    m.side = side;
+    m.piece = p;
+    m.sidedPiece = side == white ? p : -p;
+    m.promoteTo = code & 7;
+    m.departurePosition.rank = from / 8 + 1;
+    m.departurePosition.file = from % 8 + 1;
+    m.destination.rank = to / 8 + 1;
+    m.destination.file = to % 8 + 1;
+    m.isShortCastling = p == king && to - from == 2;
+    m.isLongCastling = p == king && from - to == 2;
+
+    int captureSquare = p == pawn && from % 8 != to % 8 && b->squares[to] == 0 ? from / 8 * 8 + to % 8 : to;
+    pieceEnum captured = b->squares[captureSquare];
+    m.isCapture = captured != 0;
+    if (captured != 0) {
+        b->sides[side == white ? black : white] ^= 1ULL << captureSquare;
+        b->pieces[captured] ^= 1ULL << captureSquare;
+        b->squares[captureSquare] = 0;
+    }
+    b->sides[side] ^= 1ULL << from | 1ULL << to;
+    b->pieces[p] ^= 1ULL << from;
+    b->pieces[placed] ^= 1ULL << to;
+    b->squares[from] = 0;
+    b->squares[to] = placed;
+    if (m.isShortCastling || m.isLongCastling) {
+        int rookFrom = m.isShortCastling ? from + 3 : from - 4, rookTo = m.isShortCastling ? from + 1 : from - 1;
+        b->sides[side] ^= 1ULL << rookFrom | 1ULL << rookTo;
+        b->pieces[rook] ^= 1ULL << rookFrom | 1ULL << rookTo;
+        b->squares[rookFrom] = 0;
+        b->squares[rookTo] = rook;
+    }
+    moveUndo u;
+    game_make_move(game, &m, &u);
+}
+
+#define GAME_STORE_MAGIC 0x65726f7473676c63ULL // "clgstore"
+#define GAME_STORE_VERSION 1
+#define GAME_STORE_BUFFER_WORDS 8192 // move bits written at once
+#define GAME_STORE_MAX_PLIES 65535
+#define GAME_STORE_RECENT_STARTS 16 // start positions looked up before adding one
+
+/**
+ * Layout of a game store file: header, move stream, start positions, then one fixed-width record per game,
+ * sections aligned to 8 bytes. Each ply is stored as the index of its move among the codes generate_move_codes
+ * finds in the position, in as many bits as that number of codes needs (none for a forced move), so decoding
+ * only has to generate the moves. The move stream is bit-packed in 64-bit little-endian words.
+ */
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t gameStateSize;
+    uint64_t gameCount;
+    uint64_t plyCount;
+    uint64_t bitCount;
+    uint64_t startCount; // the first start position is the standard one
+    uint64_t movesOffset;
+    uint64_t startsOffset;
+    uint64_t gamesOffset;
+    uint64_t size;
+} gameStoreHeader;
+
+/** Fixed-width entry of a game in a store, so that any game is found in constant time. */
+typedef struct {
+    uint64_t firstBit; // of its moves in the move stream
+    uint32_t start; // index of its start position
+    uint16_t plies;
+    uint8_t result; // gameResult
+    uint8_t truncated; // a move of the game could not be read, only the moves before it are stored
+} gameStoreRecord;
+
+/** A game store being written, the move stream streamed to the file and the records kept until the end. */
+typedef struct {
+    FILE* out;
+    gameStoreHeader header;
+    uint64_t words[GAME_STORE_BUFFER_WORDS + 1];
+    uint64_t bufferBits;
+    gameStoreRecord* games;
+    size_t gameCapacity;
+    gameState* starts;
+    size_t startCapacity;
+} gameStoreWriter;
+
+/** A game store mapped for decoding. */
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    gameStoreHeader* header;
+    const uint64_t* words;
+    const gameState* starts;
+    const gameStoreRecord* games;
+} gameStore;
+
+/** Position and next move of a game being decoded from a store. */
+typedef struct {
+    gameState game; // position before the move last read, or the final one once all are read
+    bitboards boards; // of game
+    const uint64_t* words;
+    uint64_t bit;
+    uint64_t endBit; // of the move stream
+    int ply;
+    int plies;
+    bool pending; // the move last read is still to be made on game
+    uint16_t code;
+} gameStoreCursor;
+
+/** Number of bits an index among n moves takes. */
+int move_index_width(int n) {
+    return n > 1 ? 64 - __builtin_clzll(n - 1) : 0;
+}
+
+gameStoreWriter* open_game_store_writer(char* path) {
+    gameStoreWriter* w = (gameStoreWriter*)calloc(1, sizeof(gameStoreWriter));
+    STATS_ALLOC(sizeof(gameStoreWriter));
+    if (w == NULL) {
+        fprintf(stderr, "Failed to allocate memory for game store.\n");
+        exit(1);
+    }
+    w->out = fopen(path, "wb");
+    if (w->out == NULL) {
+        fprintf(stderr, "Failed to create game store %s.\n", path);
+        exit(1);
+    }
+    w->header.magic = GAME_STORE_MAGIC;
+    w->header.version = GAME_STORE_VERSION;
+    w->header.gameStateSize = sizeof(gameState);
+    w->header.movesOffset = sizeof(gameStoreHeader);
+    fwrite(&w->header, sizeof(gameStoreHeader), 1, w->out);
+    w->gameCapacity = 1024;
+    w->startCapacity = 16;
+    w->games = (gameStoreRecord*)malloc(w->gameCapacity * sizeof(gameStoreRecord));
+    w->starts = (gameState*)malloc(w->startCapacity * sizeof(gameState));
+    STATS_ALLOC(w->gameCapacity * sizeof(gameStoreRecord) + w->startCapacity * sizeof(gameState));
+    gameState* standard = new_game();
+    if (w->games == NULL || w->starts == NULL || standard == NULL) {
+        fprintf(stderr, "Failed to allocate memory for game store.\n");
+        exit(1);
+    }
+    w->starts[w->header.startCount++] = *standard;
+    free(standard);
+    return w;
+}
+
+void write_move_index(gameStoreWriter* w, uint64_t index, int width) {
+    uint64_t word = w->bufferBits / 64;
+    int offset = w->bufferBits % 64;
+    w->words[word] |= index << offset;
+    if (offset + width > 64) {
+        w->words[word + 1] |= index >> (64 - offset);
+    }
+    w->bufferBits += width;
+    w->header.bitCount += width;
+    if (w->bufferBits >= GAME_STORE_BUFFER_WORDS * 64) {
+        fwrite(w->words, sizeof(uint64_t), GAME_STORE_BUFFER_WORDS, w->out);
+        w->words[0] = w->words[GAME_STORE_BUFFER_WORDS];
+        memset(w->words + 1, 0, GAME_STORE_BUFFER_WORDS * sizeof(uint64_t));
+        w->bufferBits -= GAME_STORE_BUFFER_WORDS * 64;
+    }
+}
+
+/** Append a game of fully specified legal moves, from position start. */
+void add_stored_game(gameStoreWriter* w, gameState* start, move* moves, int moveCount, gameResult result, bool truncated) {
+    if (w->header.gameCount == w->gameCapacity) {
+        w->gameCapacity *= 2;
+        w->games = (gameStoreRecord*)realloc(w->games, w->gameCapacity * sizeof(gameStoreRecord));
+        if (w->games == NULL) {
+            fprintf(stderr, "Failed to allocate memory for game store.\n");
+            exit(1);
+        }
+    }
+    gameStoreRecord* r = &w->games[w->header.gameCount++];
+    r->firstBit = w->header.bitCount;
+    r->start = 0;
+    r->result = result;
+    r->truncated = truncated || moveCount > GAME_STORE_MAX_PLIES;
+    r->plies = moveCount > GAME_STORE_MAX_PLIES ? GAME_STORE_MAX_PLIES : moveCount;
+    // games from a position tag mostly follow others from the same position
+    for (uint64_t i = w->header.startCount; i > 0 && i + GAME_STORE_RECENT_STARTS > w->header.startCount && r->start == 0; --i) {
+        if (memcmp(start, &w->starts[i - 1], sizeof(gameState)) == 0) {
+            r->start = i - 1;
+        }
+    }
+    if (r->start == 0 && memcmp(start, &w->starts[0], sizeof(gameState)) != 0) {
+        if (w->header.startCount == w->startCapacity) {
+            w->startCapacity *= 2;
+            w->starts = (gameState*)realloc(w->starts, w->startCapacity * sizeof(gameState));
+            if (w->starts == NULL) {
+                fprintf(stderr, "Failed to allocate memory for game store.\n");
+                exit(1);
+            }
+        }
+        r->start = w->header.startCount;
+        w->starts[w->header.startCount++] = *start;
+    }
+    gameState game = *start;
+    bitboards boards;
+    init_bitboards(&boards, game.board);
+    uint16_t codes[MAX_LEGAL_MOVES];
+    for (int i = 0; i < r->plies; ++i) {
+        int n = generate_move_codes(&game, &boards, codes);
+        uint16_t code = pack_move(&moves[i]);
+        int index = 0;
+        while (index < n && codes[index] != code) {
+            index++;
+        }
+        if (index == n) {
+            // not a legal move, the game ends before it
+            r->plies = i;
+            r->truncated = true;
+            break;
+        }
+        write_move_index(w, index, move_index_width(n));
+        game_make_move_code(&game, &boards, code);
+    }
+    w->header.plyCount += r->plies;
+}
+
+/** Write the end of the move stream, the start positions and the records, then the header, copied to header. */
+bool close_game_store_writer(gameStoreWriter* w, gameStoreHeader* header) {
+    size_t words = (w->bufferBits + 63) / 64;
+    fwrite(w->words, sizeof(uint64_t), words, w->out);
+    w->header.startsOffset = w->header.movesOffset + (w->header.bitCount + 63) / 64 * sizeof(uint64_t);
+    fwrite(w->starts, sizeof(gameState), w->header.startCount, w->out);
+    w->header.gamesOffset = align8(w->header.startsOffset + w->header.startCount * sizeof(gameState));
+    for (uint64_t offset = w->header.startsOffset + w->header.startCount * sizeof(gameState); offset < w->header.gamesOffset; ++offset) {
+        fputc(0, w->out);
+    }
+    fwrite(w->games, sizeof(gameStoreRecord), w->header.gameCount, w->out);
+    w->header.size = w->header.gamesOffset + w->header.gameCount * sizeof(gameStoreRecord);
+    rewind(w->out);
+    fwrite(&w->header, sizeof(gameStoreHeader), 1, w->out);
+    *header = w->header;
+    bool written = !ferror(w->out);
+    written = fclose(w->out) == 0 && written;
+    free(w->games);
+    free(w->starts);
+    free(w);
+    return written;
+}
+
+/** Map a game store file written by `chessline store`. */
+gameStore* open_game_store(char* path) {
+    gameStore* store = (gameStore*)malloc(sizeof(gameStore));
+    STATS_ALLOC(sizeof(gameStore));
+    if (store == NULL) {
+        fprintf(stderr, "Failed to allocate memory for game store.\n");
+        exit(1);
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(gameStoreHeader)) {
+        fprintf(stderr, "Failed to open game store %s.\n", path);
+        exit(1);
+    }
+    store->size = st.st_size;
+    store->data = (uint8_t*)mmap(NULL, store->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    store->header = (gameStoreHeader*)store->data;
+    gameStoreHeader* h = store->header;
+    if (store->data == MAP_FAILED || h->magic != GAME_STORE_MAGIC || h->version != GAME_STORE_VERSION ||
+        h->gameStateSize != sizeof(gameState) || h->size != store->size || h->startCount == 0 ||
+        h->startsOffset < h->movesOffset + (h->bitCount + 63) / 64 * sizeof(uint64_t) ||
+        h->gamesOffset < h->startsOffset + h->startCount * sizeof(gameState) ||
+        h->gamesOffset + h->gameCount * sizeof(gameStoreRecord) > store->size) {
+        fprintf(stderr, "Invalid game store %s.\n", path);
+        exit(1);
+    }
+    madvise(store->data, store->size, MADV_SEQUENTIAL);
+    store->words = (const uint64_t*)(store->data + h->movesOffset);
+    store->starts = (const gameState*)(store->data + h->startsOffset);
+    store->games = (const gameStoreRecord*)(store->data + h->gamesOffset);
+    return store;
+}
+
+void close_game_store(gameStore* store) {
+    munmap(store->data, store->size);
+    free(store);
+}
+
+/** Whether the file at path is a game store rather than a PGN database. */
+bool is_game_store_file(char* path) {
+    FILE* fp = fopen(path, "rb");
+    uint64_t magic = 0;
+    bool store = fp != NULL && fread(&magic, sizeof(magic), 1, fp) == 1 && magic == GAME_STORE_MAGIC;
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    return store;
+}
+
+/** Start decoding game number index of store. */
+void open_stored_game(gameStore* store, uint64_t index, gameStoreCursor* c) {
+    const gameStoreRecord* r = &store->games[index];
+    bool valid = r->start < store->header->startCount && r->firstBit <= store->header->bitCount;
+    c->game = store->starts[valid ? r->start : 0];
+    init_bitboards(&c->boards, c->game.board);
+    c->words = store->words;
+    c->bit = r->firstBit;
+    c->endBit = store->header->bitCount;
+    c->ply = 0;
+    c->plies = valid ? r->plies : 0;
+    c->pending = false;
+}
+
+/**
+ * Read the code of the next move into code, leaving the position before it in the cursor until the following
+ * call. Returns false after the last move, the cursor then holding the final position.
+ */
+bool next_stored_move(gameStoreCursor* c, uint16_t* code) {
+    if (c->pending) {
+        game_make_move_code(&c->game, &c->boards, c->code);
+        c->pending = false;
+    }
+    if (c->ply == c->plies) {
+        return false;
+    }
+    uint16_t codes[MAX_LEGAL_MOVES];
+    int n = generate_move_codes(&c->game, &c->boards, codes);
+    int width = move_index_width(n);
+    if (c->bit + width > c->endBit) {
+        return false;
+    }
+    int offset = c->bit % 64;
+    uint64_t bits = c->words[c->bit / 64] >> offset;
+    if (offset + width > 64) {
+        bits |= c->words[c->bit / 64 + 1] << (64 - offset);
+    }
+    uint64_t index = bits & ((1ULL << width) - 1);
+    if ((int)index >= n) {
+        return false;
+    }
+    c->bit += width;
+    c->ply++;
+    c->pending = true;
+    c->code = *code = codes[index];
+    return true;
+}
+
+/** Encode the games of a PGN database into a game store. */
+bool build_game_store(char* databasePath, char* storePath) {
+    pgnReader* reader = open_pgn_reader(databasePath);
+    gameStoreWriter* writer = open_game_store_writer(storePath);
+    pgnGame* game = new_pgn_game();
+    gameState position;
+    uint64_t start = stats_now_ns();
+    while (next_pgn_game(reader, game, &position)) {
+        add_stored_game(writer, &game->start, game->moves, game->moveCount, game->result, !game->valid);
+    }
+    uint64_t elapsed = stats_now_ns() - start;
+    size_t databaseLength = reader->length;
+    free_pgn_game(game);
+    close_pgn_reader(reader);
+    gameStoreHeader header;
+    if (!close_game_store_writer(writer, &header)) {
+        fprintf(stderr, "Failed to write game store %s.\n", storePath);
+        return false;
+    }
+    wprintf(L"Stored %" PRIu64 " games, %" PRIu64 " plies in %" PRIu64 " bytes, %.2f bits per ply against %.2f bytes of PGN (%.2fs).\n",
+        header.gameCount, header.plyCount, header.size, header.plyCount ? (double)header.bitCount / header.plyCount : 0.0,
+        header.plyCount ? (double)databaseLength / header.plyCount : 0.0, elapsed / 1e9);
+    return true;
+}
+
+/** Games of a store decoded on one thread, with the tally of their results. */
+typedef struct {
+    gameStore* store;
+    uint64_t first;
+    uint64_t last;
+    uint64_t plies;
+    uint64_t results[4]; // by gameResult
+    uint64_t truncated; // games with fewer plies decoded than recorded, or stored so
+} gameStoreDecoder;
+
+void* decode_game_store_worker(void* arg) {
+    gameStoreDecoder* d = (gameStoreDecoder*)arg;
+    gameStoreCursor cursor;
+    uint16_t code;
+    for (uint64_t i = d->first; i < d->last; ++i) {
+        open_stored_game(d->store, i, &cursor);
+        while (next_stored_move(&cursor, &code));
+        d->plies += cursor.ply;
+        d->results[d->store->games[i].result & 3]++;
+        d->truncated += cursor.ply < d->store->games[i].plies || d->store->games[i].truncated;
+    }
+    return NULL;
+}
+
+/** Entry point of `chessline store`, encoding a PGN database into a game store, or decoding a whole store. */
+int store_main(int argc, char* argv[]) {
+    char* paths[2] = {NULL, NULL};
+    int pathCount = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (argv[i][0] != '-' && pathCount < 2) {
+            paths[pathCount++] = argv[i];
+        } else {
+            pathCount = 0;
+            break;
+        }
+    }
+    if (pathCount == 0 || threads < 1) {
+        fprintf(stderr, "Usage: $ chessline store DATABASE.pgn STORE\n       $ chessline store STORE [--threads=T]\n");
+        return 1;
+    }
+    if (pathCount == 2) {
+        return build_game_store(paths[0], paths[1]) ? 0 : 1;
+    }
+
+    // each thread decodes a range of games, found through the records
+    gameStore* store = open_game_store(paths[0]);
+    uint64_t start = stats_now_ns();
+    gameStoreDecoder decoders[threads];
+    pthread_t ids[threads];
+    for (int i = 0; i < threads; ++i) {
+        memset(&decoders[i], 0, sizeof(gameStoreDecoder));
+        decoders[i].store = store;
+        decoders[i].first = store->header->gameCount * i / threads;
+        decoders[i].last = store->header->gameCount * (i + 1) / threads;
+        if (pthread_create(&ids[i], NULL, decode_game_store_worker, &decoders[i]) != 0) {
+            fprintf(stderr, "Failed to start decoding thread.\n");
+            exit(1);
+        }
+    }
+    gameStoreDecoder total;
+    memset(&total, 0, sizeof(gameStoreDecoder));
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        total.plies += decoders[i].plies;
+        total.truncated += decoders[i].truncated;
+        for (int r = 0; r < 4; ++r) {
+            total.results[r] += decoders[i].results[r];
+        }
+    }
+    uint64_t elapsed = stats_now_ns() - start;
+    wprintf(L"%" PRIu64 " games, %" PRIu64 " plies decoded (%.2fs, %.1fM plies/s, %d threads)\n", store->header->gameCount, total.plies,
+        elapsed / 1e9, elapsed > 0 ? total.plies * 1e3 / elapsed : 0.0, threads);
+    wprintf(L"%" PRIu64 " white wins, %" PRIu64 " draws, %" PRIu64 " black wins, %" PRIu64 " unknown, %" PRIu64 " truncated\n",
+        total.results[resultWhiteWins], total.results[resultDraw], total.results[resultBlackWins], total.results[resultUnknown], total.truncated);
+    close_game_store(store);
+    return 0;
+}
+
+/** Copy the value of tag name from the PGN text of a game into value, or "?" when missing. */
+void pgn_tag_value(char* game, size_t length, char* name, char* value, size_t valueSize) {
+    char pattern[PGN_MAX_TOKEN];
+    snprintf(pattern, sizeof(pattern), "[%s \"", name);
+    size_t patternLength = strlen(pattern);
+    strcpy(value, "?");
+    for (size_t i = 0; i + patternLength < length; ++i) {
+        if (game[i] == '[' && strncmp(game + i, pattern, patternLength) == 0) {
+            size_t n = 0;
+            for (size_t j = i + patternLength; j < length && game[j] != '"' && n + 1 < valueSize; ++j) {
+                value[n++] = game[j];
+            }
+            value[n] = 0;
+            return;
+        }
+        if (game[i] != '[' && game[i] != '\n' && (i == 0 || game[i-1] == '\n')) {
+            return; // tags are over
+        }
+    }
+}
+
+/**
+ * Handle the games command of play(): list the games of the database reaching the current position,
+ * or with an argument, export them all to that file.
+ */
+void print_position_games(positionIndex* index, uint64_t hash, char* exportPath) {
+    size_t maxGames = exportPath == NULL ? 10 : index->header->gameCount;
+    uint32_t* games = (uint32_t*)malloc((maxGames + 1) * sizeof(uint32_t));
+    STATS_ALLOC((maxGames + 1) * sizeof(uint32_t));
+    int fd = open(index->databasePath, O_RDONLY);
+    struct stat st;
+    if (games == NULL || fd < 0 || fstat(fd, &st) != 0) {
+        wprintf(L"Game database %s is not available.\n", index->databasePath);
+        free(games);
+        return;
+    }
+    char* database = st.st_size > 0 ? (char*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+    close(fd);
+    size_t count = position_index_query(index, hash, games, maxGames);
+    size_t shown = count < maxGames ? count : maxGames;
+    if (database == MAP_FAILED || database == NULL) {
+        shown = 0;
+    }
+    if (exportPath != NULL) {
+        FILE* out = fopen(exportPath, "w");
+        if (out == NULL) {
+            wprintf(L"Failed to open %s for writing.\n", exportPath);
+        } else {
+            for (size_t i = 0; i < shown; ++i) {
+                size_t length;
+                char* text = position_index_game_text(index, database, st.st_size, games[i], &length);
+                fwrite(text, 1, length, out);
+                fputs("\n\n", out);
+            }
+            fclose(out);
+            wprintf(L"Exported %zu games to %s.\n", shown, exportPath);
+        }
+    } else {
+        wprintf(L"%zu games reached this position.\n", count);
+        for (size_t i = 0; i < shown; ++i) {
+            size_t length;
+            char* text = position_index_game_text(index, database, st.st_size, games[i], &length);
+            char white[64], black[64], result[16], date[16];
+            pgn_tag_value(text, length, "White", white, sizeof(white));
+            pgn_tag_value(text, length, "Black", black, sizeof(black));
+            pgn_tag_value(text, length, "Result", result, sizeof(result));
+            pgn_tag_value(text, length, "Date", date, sizeof(date));
+            wprintf(L"  #%u %s - %s %s (%s)\n", games[i], white, black, result, date);
+        }
+    }
+    if (database != NULL && database != MAP_FAILED) {
+        munmap(database, st.st_size);
+    }
+    free(games);
+}
+
+/** Free node t and the nodes below it created by the same line. */
+void free_line_nodes(parser* p, moveTree* t, sourceLine* line) {
+    moveTree* c = t->firstChoice;
+    while (c != NULL) {
+        moveTree* next = c->nextChoice;
+        if (c->line == line) {
+            free_line_nodes(p, c, line);
+        }
+        c = next;
+    }
+    p->allocator.release(p->allocator.context, t->move);
+    p->allocator.release(p->allocator.context, t);
+}
+
+/** Remove t from the choices of its parent. */
+void unlink_move(moveTree* t) {
+    moveTree** link = &t->previousMove->firstChoice;
+    while (*link != NULL && *link != t) {
+        link = &(*link)->nextChoice;
+    }
+    if (*link == t) {
+        *link = t->nextChoice;
+    }
+    t->nextChoice = NULL;
+}
+
+/** Add t to the choices of parent after those created by lines before its own, as a full parse would. */
+void insert_move_in_line_order(moveTree* parent, moveTree* t) {
+    moveTree** link = &parent->firstChoice;
+    while (*link != NULL && (*link)->line != NULL && (*link)->line->order <= t->line->order) {
+        link = &(*link)->nextChoice;
+    }
+    t->previousMove = parent;
+    t->nextChoice = *link;
+    *link = t;
+}
+
+/** Give lines [first, last) orders between their neighbours, renumbering all lines when there is no room left. */
+void order_source_lines(parser* p, int first, int last) {
+    uint64_t low = first > 0 ? p->lines[first-1]->order : 0;
+    uint64_t high = last < p->lineCount ? p->lines[last]->order : low + ((uint64_t)(last - first + 1) << SOURCE_LINE_ORDER_BITS);
+    uint64_t step = (high - low) / (last - first + 1);
+    if (step == 0) {
+        for (int i = 0; i < p->lineCount; ++i) {
+            p->lines[i]->order = (uint64_t)i << SOURCE_LINE_ORDER_BITS;
+        }
+        return;
+    }
+    for (int i = first; i < last; ++i) {
+        p->lines[i]->order = low + step * (i - first + 1);
+    }
+}
+
+bool read_file_contents(char* path, char** content, size_t* length) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    *content = (char*)malloc(st.st_size + 1);
+    STATS_ALLOC(st.st_size + 1);
+    if (*content == NULL) {
+        fprintf(stderr, "Failed to allocate memory for %s.\n", path);
+        exit(1);
+    }
+    *length = 0;
+    ssize_t n;
+    while (*length < (size_t)st.st_size && (n = read(fd, *content + *length, st.st_size - *length)) > 0) {
+        *length += n;
+    }
+    (*content)[*length] = 0;
+    close(fd);
+    return true;
+}
+
+/** Parse a whole repertoire held in memory, tracking lines. The parser is returned even on error. */
+parser* parse_repertoire_text(char* content, size_t length, parseResult* res) {
+    chesslineMemoryInput input = {content, length, 0};
+    parser* p = new_parser(chessline_memory_reader(&input), NULL);
+    if (p == NULL || !parser_track_lines(p)) {
+        fprintf(stderr, "Failed to allocate memory for parser.\n");
+        exit(1);
+    }
+    *res = parse(p);
+    p->reader.context = NULL;
+    return p;
+}
+
+/**
+ * A repertoire file watched with inotify. Its tree is kept in sync with the file by re-parsing
+ * only the lines around an edit, see reload_repertoire.
+ */
+typedef struct {
+    char* path;
+    char name[NAME_MAX + 1]; // of the file in the watched directory
+    int inotifyFd;
+    parser* parser;
+    gameState initial; // position at the root, play() changes the parser's copy
+    char* content; // text the tree was parsed from
+    size_t length;
+    int reparsedLines; // by the last reload
+} repertoireWatch;
+
+/** Parse the repertoire at path and start watching it, returning NULL after printing the error when it fails. */
+repertoireWatch* open_repertoire_watch(char* path) {
+    repertoireWatch* w = (repertoireWatch*)malloc(sizeof(repertoireWatch));
+    STATS_ALLOC(sizeof(repertoireWatch));
+    if (w == NULL) {
+        fprintf(stderr, "Failed to allocate memory for repertoire watch.\n");
+        exit(1);
+    }
+    w->path = path;
+    if (!read_file_contents(path, &w->content, &w->length)) {
+        fprintf(stderr, "Failed to open %s for reading. Make sure file exists and you have permissiont to read it.", path);
+        exit(1);
+    }
+    parseResult res;
+    w->parser = parse_repertoire_text(w->content, w->length, &res);
+    if (res.hasError) {
+        fprintf(stderr, "%s", res.errorMessage);
+        return NULL;
+    }
+    w->initial = *w->parser->initGameState;
+    w->reparsedLines = 0;
+
+    // editors often replace the file, so watch its directory
+    char directory[PATH_MAX];
+    char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(directory, ".");
+        snprintf(w->name, sizeof(w->name), "%s", path);
+    } else {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(slash - path) + (slash == path), path);
+        snprintf(w->name, sizeof(w->name), "%s", slash + 1);
+    }
+    w->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->inotifyFd < 0 || inotify_add_watch(w->inotifyFd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Failed to watch %s for changes.\n", directory);
+        exit(1);
+    }
+    return w;
+}
+
+void close_repertoire_watch(repertoireWatch* w) {
+    close(w->inotifyFd);
+    free_parser(w->parser);
+    free(w->content);
+    free(w);
+}
+
+/** Drain pending inotify events, returning true if one concerns the repertoire file. */
+bool repertoire_file_changed(repertoireWatch* w) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t n;
+    while ((n = read(w->inotifyFd, events, sizeof(events))) > 0) {
+        for (char* e = events; e < events + n; e += sizeof(struct inotify_event) + ((struct inotify_event*)e)->len) {
+            struct inotify_event* event = (struct inotify_event*)e;
+            changed |= event->len > 0 && strcmp(event->name, w->name) == 0;
+        }
+    }
+    return changed;
+}
+
+size_t count_newlines(char* text, size_t length) {
+    size_t count = 0;
+    char* end = text + length;
+    while ((text = (char*)memchr(text, '\n', end - text)) != NULL) {
+        count++;
+        text++;
+    }
+    return count;
+}
+
+/** Replace the tree with a full parse of text, used when an edit touches the tags. */
+bool reparse_repertoire(repertoireWatch* w, char* text, size_t length) {
+    parseResult res;
+    parser* p = parse_repertoire_text(text, length, &res);
+    if (res.hasError) {
+        wprintf(L"Repertoire not reloaded, %s\n", res.errorMessage);
+        free_parser(p);
+        free(text);
+        return false;
+    }
+    free_parser(w->parser);
+    free(w->content);
+    w->parser = p;
+    w->initial = *p->initGameState;
+    w->content = text;
+    w->length = length;
+    w->reparsedLines = p->lineCount;
+    wprintf(L"Repertoire reloaded: %d lines parsed.\n", p->lineCount);
+    return true;
+}
+
+/** Whether two moves of the tree read the same, whatever their probabilities and annotations. */
+bool same_notation(move* a, move* b) {
+    return moves_equal(a, b) && a->promoteTo == b->promoteTo && a->isShortCastling == b->isShortCastling && a->isLongCastling == b->isLongCastling;
+}
+
+/**
+ * Whether tip, reached by re-parsing lines, stands for the same moves from the root as old, the tip a line of the
+ * previous parse started from. The nodes of old up to where both paths meet must be among those created by lines
+ * [first, last), about to be replaced by the nodes of tip: otherwise a full parse would not reach the same tree.
+ */
+bool same_line_tip(parser* p, moveTree* old, moveTree* tip, int first, int last) {
+    if (first == last) {
+        return old == tip;
+    }
+    uint64_t low = p->lines[first]->order, high = p->lines[last-1]->order;
+    while (old != tip) {
+        if (old->isRoot || tip->isRoot || old->line == NULL || old->line->order < low || old->line->order > high
+            || old->halfMoveNo != tip->halfMoveNo || !same_notation(old->move, tip->move)) {
+            return false;
+        }
+        old = old->previousMove;
+        tip = tip->previousMove;
+    }
+    return true;
+}
+
+/** Replace tip by its new node when it is one of the old nodes of chain, as paired by reload_repertoire. */
+bool replace_line_tip(moveTree** tip, moveTree** chain, int chainLength) {
+    int k = chainLength > 0 ? chain[0]->halfMoveNo - (*tip)->halfMoveNo : -1;
+    if (k < 0 || k >= chainLength || chain[2*k] != *tip) {
+        return false;
+    }
+    *tip = chain[2*k+1];
+    return true;
+}
+
+/** Index of line among the tracked lines from low on, found by its order. */
+int find_source_line(parser* p, sourceLine* line, int low) {
+    int high = p->lineCount - 1;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (p->lines[middle]->order < line->order) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Bring the tree in line with the file after an edit. Only the lines between the first and last changed
+ * bytes are parsed, plus the following lines until one starts from the same parser state and the same moves
+ * as it did before: from there on the old parse is still valid, once the lines that follow are moved from the
+ * old nodes of those moves onto the new ones. New nodes are linked into the tree only once every line parsed,
+ * so that on a parse error the tree is left as it was.
+ * Returns true when the tree changed, old nodes of the re-parsed lines are then freed.
+ */
+bool reload_repertoire(repertoireWatch* w) {
+    char* text;
+    size_t length;
+    if (!read_file_contents(w->path, &text, &length)) {
+        return false; // in the middle of a replace, the next event will tell
+    }
+    uint64_t start = stats_now_ns();
+    parser* p = w->parser;
+    char* old = w->content;
+    size_t oldLength = w->length;
+    size_t limit = oldLength < length ? oldLength : length;
+    size_t prefix = 0, suffix = 0;
+    while (prefix + 64 <= limit && memcmp(old + prefix, text + prefix, 64) == 0) {
+        prefix += 64;
+    }
+    while (prefix < limit && old[prefix] == text[prefix]) {
+        prefix++;
+    }
+    if (prefix == oldLength && prefix == length) {
+        free(text);
+        return false;
+    }
+    while (suffix < limit - prefix && old[oldLength - 1 - suffix] == text[length - 1 - suffix]) {
+        suffix++;
+    }
+
+    // changed lines: from the line holding the first changed byte to the first line of the common suffix
+    size_t lineStart = prefix;
+    while (lineStart > 0 && old[lineStart-1] != '\n') {
+        lineStart--;
+    }
+    size_t oldEnd = oldLength - suffix, newEnd = length - suffix;
+    if ((oldEnd > 0 && old[oldEnd-1] != '\n') || (newEnd > 0 && text[newEnd-1] != '\n')) {
+        char* newline = (char*)memchr(old + oldEnd, '\n', suffix);
+        size_t skip = newline == NULL ? suffix : (size_t)(newline - (old + oldEnd)) + 1;
+        oldEnd += skip;
+        newEnd += skip;
+    }
+    int first = count_newlines(old, lineStart);
+    int oldLast = oldEnd == oldLength ? p->lineCount : first + (int)count_newlines(old + lineStart, oldEnd - lineStart);
+    int stateBefore = first < p->lineCount ? p->lines[first]->stateBefore : p->state;
+    if (stateBefore < 10) {
+        return reparse_repertoire(w, text, length);
+    }
+
+    moveTree* savedTip = p->moveTreeTip;
+    int savedState = p->state, savedLine = p->line, savedRootHalfMoveNo = p->moveTreeRoot->halfMoveNo;
+    p->state = stateBefore;
+    p->moveTreeTip = first < p->lineCount ? p->lines[first]->tipBefore : p->moveTreeTip;
+    p->line = first + 1;
+    p->deferLinks = true;
+    int addedCount = 0, addedCapacity = 16;
+    sourceLine** added = (sourceLine**)malloc(addedCapacity * sizeof(sourceLine*));
+    STATS_ALLOC(addedCapacity * sizeof(sourceLine*));
+    if (added == NULL) {
+        fprintf(stderr, "Failed to allocate memory for source lines.\n");
+        exit(1);
+    }
+    parseResult res = make_parse_parser_result(p);
+    size_t offset = lineStart;
+    int oldNext = oldLast; // old line matching the new line at offset, once past the edit
+    bool converged = false;
+    while (offset < length) {
+        if (offset >= newEnd) {
+            if (oldNext < p->lineCount && p->lines[oldNext]->stateBefore == p->state && p->state != 12 && same_line_tip(p, p->lines[oldNext]->tipBefore, p->moveTreeTip, first, oldNext)) {
+                converged = true;
+                break;
+            }
+            oldNext++;
+        }
+        char* newline = (char*)memchr(text + offset, '\n', length - offset);
+        size_t lineLength = newline == NULL ? length - offset : (size_t)(newline - (text + offset)) + 1;
+        if (lineLength > 255) {
+            res = make_parse_error(p, "Lines must be less than 255 characters.");
+            break;
+        }
+        char buffer[BUFFER_SIZE];
+        memcpy(buffer, text + offset, lineLength);
+        buffer[lineLength] = 0;
+        if (addedCount == addedCapacity) {
+            addedCapacity *= 2;
+            added = (sourceLine**)realloc(added, addedCapacity * sizeof(sourceLine*));
+            if (added == NULL) {
+                fprintf(stderr, "Failed to allocate memory for source lines.\n");
+                exit(1);
+            }
+        }
+        added[addedCount] = new_source_line(p);
+        if (added[addedCount] == NULL) {
+            fprintf(stderr, "Failed to allocate memory for source lines.\n");
+            exit(1);
+        }
+        res = parse_line(p, buffer, added[addedCount++]);
+        if (res.hasError) {
+            break;
+        }
+        p->line++;
+        offset += lineLength;
+    }
+    if (!res.hasError && !converged && p->state != 10) {
+        res = make_parse_error(p, "Unexpected end of file.");
+    }
+    p->deferLinks = false;
+
+    if (res.hasError) {
+        // new nodes are only linked to new nodes of the same line
+        for (int i = 0; i < addedCount; ++i) {
+            for (int j = 0; j < added[i]->rootCount; ++j) {
+                free_line_nodes(p, added[i]->roots[j], added[i]);
+            }
+            free_source_line(p, added[i]);
+        }
+        free(added);
+        p->moveTreeTip = savedTip;
+        p->state = savedState;
+        p->line = savedLine;
+        p->moveTreeRoot->halfMoveNo = savedRootHalfMoveNo;
+        wprintf(L"Repertoire not reloaded, %s\n", res.errorMessage);
+        free(text);
+        return false;
+    }
+
+    // the lines kept may go on from old nodes of the tip the parse converged on, or start from them: pair
+    // these nodes with the new ones by half move number, and move the kept lines over
+    int replacedEnd = converged ? oldNext : p->lineCount;
+    int chainLength = 0, movedCount = 0, movedCapacity = 0;
+    moveTree** chain = NULL;
+    moveTree** moved = NULL;
+    if (converged) {
+        moveTree* oldTip = p->lines[oldNext]->tipBefore;
+        for (moveTree *a = oldTip, *b = p->moveTreeTip; a != b; a = a->previousMove, b = b->previousMove) {
+            chainLength++;
+        }
+        chain = (moveTree**)malloc((2 * chainLength + 1) * sizeof(moveTree*));
+        STATS_ALLOC((2 * chainLength + 1) * sizeof(moveTree*));
+        if (chain == NULL) {
+            fprintf(stderr, "Failed to allocate memory for source lines.\n");
+            exit(1);
+        }
+        uint64_t keptOrder = p->lines[oldNext]->order;
+        moveTree* a = oldTip;
+        moveTree* b = p->moveTreeTip;
+        for (int i = 0; i < chainLength; ++i, a = a->previousMove, b = b->previousMove) {
+            chain[2*i] = a;
+            chain[2*i+1] = b;
+            for (moveTree* c = a->firstChoice; c != NULL; c = c->nextChoice) {
+                if (c->line != NULL && c->line->order >= keptOrder) {
+                    if (movedCount == movedCapacity) {
+                        movedCapacity = movedCapacity ? 2 * movedCapacity : 16;
+                        moved = (moveTree**)realloc(moved, 2 * movedCapacity * sizeof(moveTree*));
+                        if (moved == NULL) {
+                            fprintf(stderr, "Failed to allocate memory for source lines.\n");
+                            exit(1);
+                        }
+                    }
+                    moved[2*movedCount] = c;
+                    moved[2*movedCount+1] = b;
+                    movedCount++;
+                }
+            }
+        }
+        // lines start on an old node until one adds a move, or after ending on a move number, which leaves the
+        // tip on a node the next move is added to: the lines before each moved node, up to one that does not
+        int i = oldNext;
+        while (i < p->lineCount && replace_line_tip(&p->lines[i]->tipBefore, chain, chainLength) && p->lines[i]->rootCount == 0) {
+            i++;
+        }
+        replace_line_tip(&savedTip, chain, chainLength);
+        for (int j = 0; j < movedCount; ++j) {
+            for (i = find_source_line(p, moved[2*j]->line, oldNext); i >= oldNext && replace_line_tip(&p->lines[i]->tipBefore, chain, chainLength); --i) {
+            }
+            unlink_move(moved[2*j]);
+        }
+    }
+
+    // unlink the old nodes of re-parsed lines before freeing any, parents may be among them
+    for (int i = first; i < replacedEnd; ++i) {
+        for (int j = 0; j < p->lines[i]->rootCount; ++j) {
+            unlink_move(p->lines[i]->roots[j]);
+        }
+    }
+    for (int i = first; i < replacedEnd; ++i) {
+        for (int j = 0; j < p->lines[i]->rootCount; ++j) {
+            free_line_nodes(p, p->lines[i]->roots[j], p->lines[i]);
+        }
+        free_source_line(p, p->lines[i]);
+    }
+    int delta = addedCount - (replacedEnd - first);
+    if (!reserve_source_lines(p, delta > 0 ? delta : 0)) {
+        fprintf(stderr, "Failed to allocate memory for source lines.\n");
+        exit(1);
+    }
+    memmove(p->lines + first + addedCount, p->lines + replacedEnd, (p->lineCount - replacedEnd) * sizeof(sourceLine*));
+    memcpy(p->lines + first, added, addedCount * sizeof(sourceLine*));
+    p->lineCount += delta;
+    order_source_lines(p, first, first + addedCount);
+    for (int i = 0; i < addedCount; ++i) {
+        for (int j = 0; j < added[i]->rootCount; ++j) {
+            insert_move_in_line_order(added[i]->roots[j]->previousMove, added[i]->roots[j]);
+        }
+    }
+    for (int i = 0; i < movedCount; ++i) {
+        insert_move_in_line_order(moved[2*i+1], moved[2*i]);
+    }
+    free(moved);
+    free(chain);
+    free(added);
+    if (converged) {
+        p->moveTreeTip = savedTip;
+        p->state = savedState;
+    }
+    p->line = p->lineCount + 1;
+    free(w->content);
+    w->content = text;
+    w->length = length;
+    w->reparsedLines = addedCount;
+    wprintf(L"Repertoire reloaded: %d lines parsed in %" PRIu64 " us.\n", addedCount, (stats_now_ns() - start) / 1000);
+    return true;
+}
+
+typedef enum {inputLine, inputEnd, inputRepertoireChanged} inputEvent;
+
+/** Read a line of user input into buffer, or with a watch, return as soon as the repertoire file changes. */
+inputEvent read_input(char* buffer, repertoireWatch* watch) {
+    while (watch != NULL) {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {watch->inotifyFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if ((fds[1].revents & POLLIN) && repertoire_file_changed(watch)) {
+            return inputRepertoireChanged;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            break;
+        }
+    }
+    return fgets(buffer, BUFFER_SIZE, stdin) == NULL ? inputEnd : inputLine;
+}
+
+/**
+ * Find where a session at tip continues after a reload: the node reached by the same moves, or the deepest
+ * node on the way with the trainee to move. tip must not have been freed yet, so moves are copied first
+ * by the caller through path.
+ */
+moveTree* resume_line(moveTree* root, move* path, int length, uint64_t* random) {
+    moveTree* t = root;
+    int depth = 0;
+    while (depth < length) {
+        moveTree* next = tree_apply_move(t, &path[depth]);
+        if (next == NULL) {
+            break;
+        }
+        t = next;
+        depth++;
+    }
+    if ((length - depth) % 2 != 0) {
+        t = t->isRoot ? choose_move(t, random) : t->previousMove;
+    }
+    return t;
+}
+
+void play(moveTree* tree, gameState* game, bool blindMode, progressStore* progress, positionIndex* games, repertoireWatch* watch, tablebase* tablebase, uint64_t* random) {
+    char* buffer = (char*)malloc(BUFFER_SIZE*sizeof(char));
+    STATS_ALLOC(BUFFER_SIZE*sizeof(char));
+    if (buffer == NULL) {
+        fprintf(stderr, "failed to allocate memory for input buffer.");
+        exit(1);
+    }
+
+    if (watch != NULL) {
+        // poll() must see every line that has not been read yet
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+
+    //print_board(theBoard.board);
+    print_greeting(random);
+    // setvbuf(stdin, NULL, _IOLBF, -1);
+    moveTree* moveTreeTip = tree;
+    moveTree* moveTreeRoot = tree;
+    bool viewAsWhite = moveTreeRoot->move->side == black;
+    // with a progress store, replies follow whole lines drawn by the progress at their positions
+    playerSide trainee = tree->move->side == white ? black : white;
+    lineSampler lines;
+    moveTree* target = NULL;
+    if (progress != NULL) {
+        schedule_lines(&lines, tree, game, progress, trainee);
+    }
+    if (!blindMode) {
+        wprintf(L"\n");
+        print_board(game->board, viewAsWhite);
+    }
+    bool resumed = false;
+    while (moveTreeTip != NULL) {
+        // printf("currentMove:\n");
+        if (!moveTreeTip->isRoot) {
+            apply_repertoire_move(game->board, moveTreeTip->move);
+            print_algebraic_notation(moveTreeTip->move);
+            wprintf(L"\n");
+            if (!blindMode) {
+                print_board(game->board, viewAsWhite);
+            }
+        }
+        if (moveTreeTip->firstChoice == NULL) {
+            break;
+        }
+        // printf("\n");
+        uint64_t positionHash = board_hash(game->board, moveTreeTip->move->side == white ? black : white);
+        while (true) {
+            wprintf(L"> ");
+            inputEvent input = read_input(buffer, watch);
+            if (input == inputRepertoireChanged) {
+                move path[moveTreeTip->halfMoveNo + 1];
+                int length = 0;
+                for (moveTree* t = moveTreeTip; !t->isRoot; t = t->previousMove) {
+                    path[length++] = *t->move;
+                }
+                for (int i = 0; i < length / 2; ++i) {
+                    move swap = path[i];
+                    path[i] = path[length - 1 - i];
+                    path[length - 1 - i] = swap;
+                }
+                wprintf(L"\n");
+                if (!reload_repertoire(watch)) {
+                    continue;
+                }
+                if (progress != NULL) {
+                    free_line_sampler(&lines);
+                    schedule_lines(&lines, watch->parser->moveTreeRoot, &watch->initial, progress, trainee);
+                    target = NULL;
+                }
+                // set up the board before the move of the node the line resumes from
+                moveTreeTip = resume_line(watch->parser->moveTreeRoot, path, length, random);
+                memcpy(game->board, watch->initial.board, sizeof(game->board));
+                if (moveTreeTip != NULL && !moveTreeTip->isRoot) {
+                    moveTree* line[moveTreeTip->halfMoveNo + 1];
+                    int depth = 0;
+                    for (moveTree* t = moveTreeTip->previousMove; !t->isRoot; t = t->previousMove) {
+                        line[depth++] = t;
+                    }
+                    while (depth > 0) {
+                        apply_repertoire_move(game->board, line[--depth]->move);
+                    }
+                }
+                resumed = true;
+                break;
+            }
+            if (input == inputEnd || strcmp(buffer, "exit\n") == 0) {
+                if (input == inputEnd) {
+                    wprintf(L"ctl-d\n");
+                }
+                print_goodbye(random);
+                if (progress != NULL) {
+                    close_progress_store(progress);
+                }
+                exit(0);
+            }
+
+            buffer[strcspn(buffer, "\n")] = 0;
+
+            if (games != NULL && strncmp(buffer, "games", 5) == 0 && (buffer[5] == 0 || buffer[5] == ' ')) {
+                char* exportPath = buffer[5] == ' ' ? buffer + 6 : NULL;
+                print_position_games(games, positionHash, exportPath);
+                continue;
+            }
+
+            move m;
+            init_move(&m);
+            if (parse_algebraic_notation2(&m, buffer) == NULL) {
+                //fprintf(stderr, "Failed to parse: %s\n", res.errorMessage);
+                print_do_not_understand(random);
+                continue;
+            }
+
+            // printf("got move:\n");
+            // print_algebraic_notation(res.moveTreeRoot);
+            moveTree* goToMove = tree_apply_move(moveTreeTip, &m);
+            tablebaseResult outcome;
+            if (goToMove == NULL && tablebase != NULL && (goToMove = tablebase_equivalent_move(tablebase, game, moveTreeTip, &m, &outcome)) != NULL) {
+                wprintf(L"%s keeps the %s as well, the repertoire goes on with ", buffer, tablebaseResultNames[outcome]);
+                print_algebraic_notation(goToMove->move);
+                wprintf(L"\n");
+            }
+            if (progress != NULL) {
+                progress_record_answer(progress, positionHash, goToMove != NULL);
+            }
+            if (goToMove == NULL) {
+                wprintf(L"wrong move! try again:\n");
+            } else {
+                moveTreeTip = goToMove;
+                apply_repertoire_move(game->board, moveTreeTip->move);
+                if (!blindMode) {
+                    print_board(game->board, viewAsWhite);
+                }
+                break;
+            }
+        }
+        if (resumed) {
+            resumed = false;
+            continue;
+        }
+        moveTreeTip = progress != NULL ? line_sampler_step(&lines, moveTreeTip, &target, random) : choose_move(moveTreeTip, random);
+    }
+    wprintf(L"Line played correctly. Good job!\n");
+    if (progress != NULL) {
+        free_line_sampler(&lines);
+    }
+    free(buffer);
+}
+
+#define SUCCINCT_TREE_MAGIC 0x64656b6361706c63ULL // "clpacked"
+#define SUCCINCT_TREE_VERSION 1
+#define SUCCINCT_ZERO_SAMPLE 64 // zeros per select directory entry
+#define SUCCINCT_WEIGHT_SAMPLE 64 // nodes per weight offset
+
+/**
+ * Layout of a packed repertoire, the succinct encoding of a move tree, in memory and on disk alike:
+ * header, then sections aligned to 8 bytes at the offsets of the header.
+ * Nodes are numbered in breadth-first order from the root, 0. The LOUDS bits hold, for each node in turn,
+ * one 1 per child and a 0. Moves hold for each node but the root the index of its move among the legal moves
+ * of the parent position, in the order of generate_legal_moves, and weights its probability as a varint.
+ */
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t gameStateSize;
+    uint64_t nodeCount;
+    uint64_t bitCount;
+    uint64_t weightsLength;
+    uint64_t bitsOffset;
+    uint64_t zerosOffset; // position of every SUCCINCT_ZERO_SAMPLE-th zero, uint32_t, so at most 2^31 nodes
+    uint64_t movesOffset;
+    uint64_t weightsOffset;
+    uint64_t weightOffsetsOffset; // offset in weights of every SUCCINCT_WEIGHT_SAMPLE-th node from node 1, uint32_t
+    uint64_t size;
+    gameState initial; // position at the root
+} succinctTreeHeader;
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    bool mapped;
+    succinctTreeHeader* header;
+    const uint64_t* bits;
+    const uint32_t* zeros;
+    const uint8_t* moves;
+    const uint8_t* weights;
+    const uint32_t* weightOffsets;
+} succinctTree;
+
+/**
+ * Number of set bits of x up to and including each byte, in that byte. Counted with shifts and a multiply,
+ * as without -mpopcnt __builtin_popcountll is a library call.
+ */
+uint64_t byte_prefix_bit_counts(uint64_t x) {
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return x * 0x0101010101010101ULL;
+}
+
+/** Position of zero number k, counting from 0. */
+uint64_t succinct_select0(succinctTree* tree, uint64_t k) {
+    uint64_t position = tree->zeros[k / SUCCINCT_ZERO_SAMPLE];
+    uint64_t word = position / 64;
+    // zeros of the word from the sampled one on, and how many more to skip
+    uint64_t zeros = ~tree->bits[word] & (~0ULL << (position % 64));
+    uint64_t skip = k % SUCCINCT_ZERO_SAMPLE;
+    uint64_t counts = byte_prefix_bit_counts(zeros);
+    while ((counts >> 56) <= skip) {
+        skip -= counts >> 56;
+        zeros = ~tree->bits[++word];
+        counts = byte_prefix_bit_counts(zeros);
+    }
+    int shift = 0;
+    while (((counts >> shift) & 0xff) <= skip) {
+        shift += 8;
+    }
+    skip -= shift > 0 ? (counts >> (shift - 8)) & 0xff : 0;
+    zeros >>= shift;
+    while (skip-- > 0) {
+        zeros &= zeros - 1;
+    }
+    return word * 64 + shift + __builtin_ctzll(zeros);
+}
+
+/**
+ * First child of node, and their number. Children of a node are numbered consecutively. The ones before the
+ * children of node are those of the nodes before it, so the first child follows from the select alone.
+ */
+int succinct_children(succinctTree* tree, uint64_t node, uint64_t* first) {
+    uint64_t start = node == 0 ? 0 : succinct_select0(tree, node - 1) + 1;
+    *first = start - node + 1;
+    uint64_t position = start;
+    while (true) {
+        int offset = position % 64;
+        uint64_t zeros = ~tree->bits[position / 64] >> offset;
+        if (zeros != 0) {
+            position += __builtin_ctzll(zeros);
+            break;
+        }
+        position += 64 - offset;
+    }
+    return (int)(position - start);
+}
+
+/** Child of node reached by the legal move of the given index, 0 when not in the repertoire. */
+uint64_t succinct_find_child(succinctTree* tree, uint64_t node, int moveIndex) {
+    uint64_t first;
+    int count = succinct_children(tree, node, &first);
+    for (int i = 0; i < count; ++i) {
+        if (tree->moves[first - 1 + i] == moveIndex) {
+            return first + i;
+        }
+    }
+    return 0;
+}
+
+/** Decide which child of node to play, according to their probability weight, like choose_move. 0 when none. */
+uint64_t succinct_choose(succinctTree* tree, uint64_t node, uint64_t* random) {
+    uint64_t first;
+    int count = succinct_children(tree, node, &first);
+    if (count == 0) {
+        return 0;
+    }
+    const uint8_t* p = tree->weights + tree->weightOffsets[(first - 1) / SUCCINCT_WEIGHT_SAMPLE];
+    for (uint64_t skip = (first - 1) % SUCCINCT_WEIGHT_SAMPLE; skip > 0; --skip) {
+        while (*p++ & 0x80);
+    }
+    const uint8_t* weights = p;
+    double totalProbabilityWeight = 0;
+    for (int i = 0; i < count; ++i) {
+        totalProbabilityWeight += read_varint(&p);
+    }
+    double targetWeight = random_probability(random) * totalProbabilityWeight;
+    double currentWeight = 0;
+    p = weights;
+    for (int i = 0; i < count; ++i) {
+        currentWeight += read_varint(&p);
+        if (currentWeight > targetWeight) {
+            return first + i;
+        }
+    }
+    return 0;
+}
+
+/** Fully specified move of node, which must not be the root, from the position of its parent. */
+move succinct_node_move(succinctTree* tree, gameState* parent, uint64_t node) {
+    move moves[MAX_LEGAL_MOVES];
+    generate_legal_moves(parent, moves);
+    return moves[tree->moves[node - 1]];
+}
+
+/** Point the sections of tree into data, checking that they lie within size. */
+bool attach_succinct_tree(succinctTree* tree, uint8_t* data, size_t size) {
+    succinctTreeHeader* h = (succinctTreeHeader*)data;
+    if (size < sizeof(succinctTreeHeader) || h->magic != SUCCINCT_TREE_MAGIC || h->version != SUCCINCT_TREE_VERSION ||
+        h->gameStateSize != sizeof(gameState) || h->size != size || h->nodeCount == 0 ||
+        h->bitsOffset + (h->bitCount + 63) / 64 * 8 > size || h->movesOffset + h->nodeCount - 1 > size ||
+        h->zerosOffset + (h->nodeCount + SUCCINCT_ZERO_SAMPLE - 1) / SUCCINCT_ZERO_SAMPLE * sizeof(uint32_t) > size ||
+        h->weightsOffset + h->weightsLength > size || h->weightOffsetsOffset > size) {
+        return false;
+    }
+    tree->data = data;
+    tree->size = size;
+    tree->header = h;
+    tree->bits = (const uint64_t*)(data + h->bitsOffset);
+    tree->zeros = (const uint32_t*)(data + h->zerosOffset);
+    tree->moves = data + h->movesOffset;
+    tree->weights = data + h->weightsOffset;
+    tree->weightOffsets = (const uint32_t*)(data + h->weightOffsetsOffset);
+    return true;
+}
+
+/** Per node state gathered in pre-order while encoding, before reordering breadth-first. */
+typedef struct {
+    uint32_t* depths;
+    uint8_t* moveIndexes;
+    uint32_t* weights;
+    uint32_t* childCounts;
+    uint64_t count;
+    uint64_t capacity;
+    uint16_t (*legal)[MAX_LEGAL_MOVES]; // packed legal moves of the position at each depth of the walk
+    int legalCapacity;
+    bool illegal;
+} succinctEncoder;
+
+walkAction add_succinct_node(treeWalk* walk, moveTree* t) {
+    succinctEncoder* e = (succinctEncoder*)walk->context;
+    int depth = walk->depth;
+    if (!walk->legal) {
+        e->illegal = true;
+        return walkStop;
+    }
+    if (e->count == e->capacity) {
+        e->capacity = e->capacity ? 2 * e->capacity : 1024;
+        e->depths = (uint32_t*)realloc(e->depths, e->capacity * sizeof(uint32_t));
+        e->moveIndexes = (uint8_t*)realloc(e->moveIndexes, e->capacity);
+        e->weights = (uint32_t*)realloc(e->weights, e->capacity * sizeof(uint32_t));
+        e->childCounts = (uint32_t*)realloc(e->childCounts, e->capacity * sizeof(uint32_t));
+        STATS_ALLOC(e->capacity / 2 * (3 * sizeof(uint32_t) + 1));
+        if (e->depths == NULL || e->moveIndexes == NULL || e->weights == NULL || e->childCounts == NULL) {
+            fprintf(stderr, "Failed to allocate memory for packed repertoire.\n");
+            exit(1);
+        }
+    }
+    uint64_t i = e->count++;
+    e->depths[i] = depth;
+    e->weights[i] = t->probability > 0 ? t->probability : 0;
+    e->moveIndexes[i] = 0;
+    if (depth > 0) {
+        uint16_t code = pack_move(&walk->resolved);
+        while (e->legal[depth-1][e->moveIndexes[i]] != code) {
+            e->moveIndexes[i]++;
+        }
+    }
+    e->childCounts[i] = 0;
+    for (moveTree* c = t->firstChoice; c != NULL; c = c->nextChoice) {
+        e->childCounts[i]++;
+    }
+    if (e->childCounts[i] > 0) {
+        if (depth == e->legalCapacity) {
+            e->legalCapacity = e->legalCapacity ? 2 * e->legalCapacity : 64;
+            e->legal = (uint16_t(*)[MAX_LEGAL_MOVES])realloc(e->legal, e->legalCapacity * sizeof(*e->legal));
+            if (e->legal == NULL) {
+                fprintf(stderr, "Failed to allocate memory for packed repertoire.\n");
+                exit(1);
+            }
+        }
+        move moves[MAX_LEGAL_MOVES];
+        int n = generate_legal_moves(&walk->game, moves);
+        for (int m = 0; m < n; ++m) {
+            e->legal[depth][m] = pack_move(&moves[m]);
+        }
+    }
+    return walkContinue;
+}
+
+/**
+ * Encode the move tree below root, starting from position initial, into a packed repertoire.
+ * Returns false when a move of the tree is illegal.
+ */
+bool build_succinct_tree(moveTree* root, gameState* initial, succinctTree* tree) {
+    succinctEncoder e;
+    memset(&e, 0, sizeof(e));
+    treeWalk walk;
+    init_tree_walk(&walk, initial, add_succinct_node, NULL, &e, &defaultAllocator);
+    walk_tree(&walk, root);
+    if (walk.outOfMemory) {
+        fprintf(stderr, "Failed to allocate memory for packed repertoire.\n");
+        exit(1);
+    }
+    free_tree_walk(&walk);
+    free(e.legal);
+    if (e.illegal) {
+        free(e.depths);
+        free(e.moveIndexes);
+        free(e.weights);
+        free(e.childCounts);
+        return false;
+    }
+
+    // breadth-first order is pre-order stably sorted by depth: nodes of a level are in path order in both
+    uint64_t n = e.count;
+    uint32_t maxDepth = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        maxDepth = e.depths[i] > maxDepth ? e.depths[i] : maxDepth;
+    }
+    uint64_t* levelStarts = (uint64_t*)calloc(maxDepth + 2, sizeof(uint64_t));
+    uint64_t* order = (uint64_t*)malloc(n * sizeof(uint64_t));
+    STATS_ALLOC((maxDepth + 2 + n) * sizeof(uint64_t));
+    if (levelStarts == NULL || order == NULL) {
+        fprintf(stderr, "Failed to allocate memory for packed repertoire.\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+        levelStarts[e.depths[i] + 1]++;
+    }
+    for (uint32_t d = 1; d <= maxDepth + 1; ++d) {
+        levelStarts[d] += levelStarts[d-1];
+    }
+    uint64_t weightsLength = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        order[levelStarts[e.depths[i]]++] = i;
+        if (i > 0) {
+            uint8_t varint[10];
+            weightsLength += write_varint(varint, e.weights[i]);
+        }
+    }
+    free(levelStarts);
+
+    uint64_t bitCount = 2 * n - 1; // n - 1 ones, one per node but the root, and n zeros
+    uint64_t words = (bitCount + 63) / 64;
+    uint64_t samples = (n + SUCCINCT_ZERO_SAMPLE - 1) / SUCCINCT_ZERO_SAMPLE;
+    uint64_t weightSamples = (n - 1 + SUCCINCT_WEIGHT_SAMPLE - 1) / SUCCINCT_WEIGHT_SAMPLE + 1;
+    succinctTreeHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = SUCCINCT_TREE_MAGIC;
+    h.version = SUCCINCT_TREE_VERSION;
+    h.gameStateSize = sizeof(gameState);
+    h.nodeCount = n;
+    h.bitCount = bitCount;
+    h.weightsLength = weightsLength;
+    h.bitsOffset = align8(sizeof(succinctTreeHeader));
+    h.zerosOffset = h.bitsOffset + words * sizeof(uint64_t);
+    h.movesOffset = align8(h.zerosOffset + samples * sizeof(uint32_t));
+    h.weightsOffset = h.movesOffset + n - 1;
+    h.weightOffsetsOffset = align8(h.weightsOffset + weightsLength);
+    h.size = h.weightOffsetsOffset + weightSamples * sizeof(uint32_t);
+    h.initial = *initial;
+    uint8_t* data = (uint8_t*)calloc(h.size, 1);
+    STATS_ALLOC(h.size);
+    if (data == NULL) {
+        fprintf(stderr, "Failed to allocate memory for packed repertoire.\n");
+        exit(1);
+    }
+    memcpy(data, &h, sizeof(h));
+    uint64_t* bits = (uint64_t*)(data + h.bitsOffset);
+    uint32_t* zeros = (uint32_t*)(data + h.zerosOffset);
+    uint8_t* moves = data + h.movesOffset;
+    uint8_t* weights = data + h.weightsOffset;
+    uint32_t* weightOffsets = (uint32_t*)(data + h.weightOffsetsOffset);
+    uint64_t position = 0, weightOffset = 0;
+    for (uint64_t id = 0; id < n; ++id) {
+        uint64_t i = order[id];
+        for (uint32_t c = 0; c < e.childCounts[i]; ++c, ++position) {
+            bits[position / 64] |= 1ULL << (position % 64);
+        }
+        if (id % SUCCINCT_ZERO_SAMPLE == 0) {
+            zeros[id / SUCCINCT_ZERO_SAMPLE] = position;
+        }
+        position++;
+        if (id > 0) {
+            moves[id - 1] = e.moveIndexes[i];
+            if ((id - 1) % SUCCINCT_WEIGHT_SAMPLE == 0) {
+                weightOffsets[(id - 1) / SUCCINCT_WEIGHT_SAMPLE] = weightOffset;
+            }
+            weightOffset += write_varint(weights + weightOffset, e.weights[i]);
+        }
+    }
+    free(order);
+    free(e.depths);
+    free(e.moveIndexes);
+    free(e.weights);
+    free(e.childCounts);
+    tree->mapped = false;
+    return attach_succinct_tree(tree, data, h.size);
+}
+
+/** Map a packed repertoire file written by `chessline pack`. */
+succinctTree* open_succinct_tree(char* path) {
+    succinctTree* tree = (succinctTree*)malloc(sizeof(succinctTree));
+    STATS_ALLOC(sizeof(succinctTree));
+    if (tree == NULL) {
+        fprintf(stderr, "Failed to allocate memory for packed repertoire.\n");
+        exit(1);
+    }
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open packed repertoire %s.\n", path);
+        exit(1);
+    }
+    uint8_t* data = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    tree->mapped = true;
+    if (data == MAP_FAILED || !attach_succinct_tree(tree, data, st.st_size)) {
+        fprintf(stderr, "Invalid packed repertoire %s.\n", path);
+        exit(1);
+    }
+    return tree;
+}
+
+void free_succinct_tree(succinctTree* tree) {
+    if (tree->mapped) {
+        munmap(tree->data, tree->size);
+    } else {
+        free(tree->data);
+    }
+}
+
+/** Whether the file at path is a packed repertoire rather than repertoire text. */
+bool is_succinct_tree_file(FILE* fp) {
+    uint64_t magic = 0;
+    bool packed = fread(&magic, sizeof(magic), 1, fp) == 1 && magic == SUCCINCT_TREE_MAGIC;
+    rewind(fp);
+    return packed;
+}
+
+/** Entry point of `chessline pack`, writing the packed encoding of a repertoire for drilling with less memory. */
+int pack_main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: $ chessline pack REPERTOIRE PACKED\n");
+        return 1;
+    }
+    FILE* fp = fopen(argv[1], "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for reading.\n", argv[1]);
+        return 1;
+    }
+    parser* p = new_file_parser(fp);
+    parseResult res = parse(p);
+    fclose(fp);
+    if (res.hasError) {
+        fprintf(stderr, "%s", res.errorMessage);
+        return 1;
+    }
+    succinctTree tree;
+    if (!build_succinct_tree(p->moveTreeRoot, p->initGameState, &tree)) {
+        fprintf(stderr, "%s has illegal moves, see chessline check.\n", argv[1]);
+        return 1;
+    }
+    FILE* out = fopen(argv[2], "wb");
+    if (out == NULL || fwrite(tree.data, 1, tree.size, out) != tree.size || fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s.\n", argv[2]);
+        return 1;
+    }
+    wprintf(L"%" PRIu64 " nodes packed in %zu bytes, %.2f bytes per node.\n", tree.header->nodeCount, tree.size, (double)tree.size / tree.header->nodeCount);
+    free_succinct_tree(&tree);
+    free_parser(p);
+    return 0;
+}
+
+/**
+ * Drill a packed repertoire like play(), from node start. game holds the position before the move of start,
+ * or at the root.
+ */
+void play_succinct(succinctTree* tree, uint64_t start, gameState* game, bool blindMode, progressStore* progress, positionIndex* games, uint64_t* random) {
+    char* buffer = (char*)malloc(BUFFER_SIZE*sizeof(char));
+    STATS_ALLOC(BUFFER_SIZE*sizeof(char));
+    if (buffer == NULL) {
+        fprintf(stderr, "failed to allocate memory for input buffer.");
+        exit(1);
+    }
+
+    print_greeting(random);
+    uint64_t node = start;
+    bool viewAsWhite = (game->sidePlaying == white) == (start == 0);
+    if (!blindMode) {
+        wprintf(L"\n");
+        print_board(game->board, viewAsWhite);
+    }
+    moveUndo u;
+    while (true) {
+        if (node != 0) {
+            move m = succinct_node_move(tree, game, node);
+            move san = algebraic_notation_move(game, &m);
+            game_make_move(game, &m, &u);
+            print_algebraic_notation(&san);
+            wprintf(L"\n");
+            if (!blindMode) {
+                print_board(game->board, viewAsWhite);
+            }
+        }
+        uint64_t first;
+        if (succinct_children(tree, node, &first) == 0) {
+            break;
+        }
+        uint64_t positionHash = board_hash(game->board, game->sidePlaying);
+        while (true) {
+            wprintf(L"> ");
+            if (fgets(buffer, BUFFER_SIZE, stdin) == NULL || strcmp(buffer, "exit\n") == 0) {
+                if (feof(stdin)) {
+                    wprintf(L"ctl-d\n");
+                }
+                print_goodbye(random);
+                if (progress != NULL) {
+                    close_progress_store(progress);
+                }
+                exit(0);
+            }
+
+            buffer[strcspn(buffer, "\n")] = 0;
+
+            if (games != NULL && strncmp(buffer, "games", 5) == 0 && (buffer[5] == 0 || buffer[5] == ' ')) {
+                char* exportPath = buffer[5] == ' ' ? buffer + 6 : NULL;
+                print_position_games(games, positionHash, exportPath);
+                continue;
+            }
+
+            move m;
+            init_move(&m);
+            if (parse_algebraic_notation2(&m, buffer) == NULL) {
+                print_do_not_understand(random);
+                continue;
+            }
+            move legal[MAX_LEGAL_MOVES], resolved;
+            uint64_t child = 0;
+            if (game_resolve_move(game, &m, &resolved)) {
+                int n = generate_legal_moves(game, legal);
+                for (int i = 0; i < n; ++i) {
+                    if (pack_move(&legal[i]) == pack_move(&resolved)) {
+                        child = succinct_find_child(tree, node, i);
+                        break;
+                    }
+                }
+            }
+            if (progress != NULL) {
+                progress_record_answer(progress, positionHash, child != 0);
+            }
+            if (child == 0) {
+                wprintf(L"wrong move! try again:\n");
+            } else {
+                node = child;
+                game_make_move(game, &resolved, &u);
+                if (!blindMode) {
+                    print_board(game->board, viewAsWhite);
+                }
+                break;
+            }
+        }
+        node = succinct_choose(tree, node, random);
+        if (node == 0) {
+            break;
+        }
+    }
+    wprintf(L"Line played correctly. Good job!\n");
+    free(buffer);
+}
+
+typedef struct {
+    int nodes;
+    int depth; // maximum plies of a line
+    int branching; // maximum number of alternatives per move
+    double transpositionRate; // fraction of new variations that transpose into an existing line
+    uint64_t seed;
+} generatorOptions;
+
+generatorOptions init_generator_options() {
+    generatorOptions options;
+    options.nodes = 1000;
+    options.depth = 24;
+    options.branching = 3;
+    options.transpositionRate = 0.05;
+    options.seed = 1;
+    return options;
+}
+
+typedef struct {
+    generatorOptions options;
+    uint64_t random;
+    moveTree* root;
+    moveTree** nodes;
+    int nodeCount;
+    int nodeCapacity;
+} repertoireGenerator;
+
+int generator_random_below(repertoireGenerator* g, int n) {
+    return (int)(splitmix64(&g->random) % (uint64_t)n);
+}
+
+/** Set up game with the position reached at node t of a tree starting from initial. */
+void replay_tree_path(gameState* game, gameState* initial, moveTree* t) {
+    moveTree* path[t->halfMoveNo + 1];
+    int length = 0;
+    for (moveTree* c = t; !c->isRoot; c = c->previousMove) {
+        path[length++] = c;
+    }
+    *game = *initial;
+    moveUndo u;
+    move resolved;
+    while (length > 0) {
+        game_resolve_move(game, path[--length]->move, &resolved);
+        game_make_move(game, &resolved, &u);
+    }
+}
+
+/** Set up game with the position reached at node t. */
+void generator_replay(gameState* game, moveTree* t) {
+    gameState* initial = new_game();
+    replay_tree_path(game, initial, t);
+    free(initial);
+}
+
+/** Append the fully specified legal move m after parent, and make it on game. */
+moveTree* generator_add_move(repertoireGenerator* g, moveTree* parent, gameState* game, move* m) {
+    moveTree* t = new_move_tree();
+    free(t->move);
+    t->move = new_move();
+    *t->move = algebraic_notation_move(game, m);
+    t->fullMoveNo = parent->move->side == white ? parent->fullMoveNo : parent->fullMoveNo + 1;
+    t->halfMoveNo = parent->halfMoveNo + 1;
+    append_move(parent, t);
+    if (g->nodeCount == g->nodeCapacity) {
+        g->nodeCapacity *= 2;
+        g->nodes = (moveTree**)realloc(g->nodes, g->nodeCapacity * sizeof(moveTree*));
+        if (g->nodes == NULL) {
+            fprintf(stderr, "Failed to allocate memory for generated nodes.\n");
+            exit(1);
+        }
+    }
+    g->nodes[g->nodeCount++] = t;
+    moveUndo u;
+    game_make_move(game, m, &u);
+    return t;
+}
+
+/** Extend the line ending at t with random legal moves up to the maximum depth. */
+void generator_playout(repertoireGenerator* g, moveTree* t, gameState* game) {
+    move moves[MAX_LEGAL_MOVES];
+    while (t->halfMoveNo < g->options.depth && g->nodeCount < g->options.nodes) {
+        int n = generate_legal_moves(game, moves);
+        if (n == 0) {
+            return;
+        }
+        t = generator_add_move(g, t, game, &moves[generator_random_below(g, n)]);
+    }
+}
+
+bool generator_has_choice(moveTree* t, move* m) {
+    for (moveTree* c = t->firstChoice; c != NULL; c = c->nextChoice) {
+        if (algebraic_move_matches(c->move, m)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Add a variation after t playing the first three moves of its main line in a different order
+ * (third, second, first), when that is legal and reaches the same position.
+ */
+bool generator_transpose(repertoireGenerator* g, moveTree* t, gameState* game) {
+    moveTree* c1 = t->firstChoice;
+    if (c1 == NULL || c1->firstChoice == NULL || c1->firstChoice->firstChoice == NULL || g->nodeCount + 3 > g->options.nodes) {
+        return false;
+    }
+    moveTree* line[3] = {c1, c1->firstChoice, c1->firstChoice->firstChoice};
+    move full[3], resolved;
+    moveUndo u[3];
+    gameState scratch = *game;
+    for (int i = 0; i < 3; ++i) {
+        game_resolve_move(&scratch, line[i]->move, &full[i]);
+        game_make_move(&scratch, &full[i], &u[i]);
+    }
+    gameState target = scratch;
+    scratch = *game;
+    for (int i = 2; i >= 0; --i) {
+        if (!game_resolve_move(&scratch, &full[i], &resolved)) {
+            return false;
+        }
+        game_make_move(&scratch, &resolved, &u[i]);
+    }
+    if (memcmp(scratch.board, target.board, sizeof(target.board)) != 0 ||
+        scratch.castlingAvailability != target.castlingAvailability ||
+        scratch.enPassantTarget.file != target.enPassantTarget.file ||
+        generator_has_choice(t, &full[2])) {
+        return false;
+    }
+    for (int i = 2; i >= 0; --i) {
+        t = generator_add_move(g, t, game, &full[i]);
+    }
+    generator_playout(g, t, game);
+    return true;
+}
+
+/**
+ * Generate a random repertoire tree of legal lines from the initial position.
+ * Lines are random playouts, new variations branch off random existing moves.
+ */
+moveTree* generate_repertoire(generatorOptions options) {
+    repertoireGenerator g;
+    g.options = options;
+    g.random = options.seed;
+    g.nodeCapacity = 1024;
+    g.nodeCount = 0;
+    g.nodes = (moveTree**)malloc(g.nodeCapacity * sizeof(moveTree*));
+    if (g.nodes == NULL) {
+        fprintf(stderr, "Failed to allocate memory for generated nodes.\n");
+        exit(1);
+    }
+    g.root = new_move_tree();
+    g.root->isRoot = true;
+    gameState game;
+    generator_replay(&game, g.root);
+    generator_playout(&g, g.root, &game);
+
+    move moves[MAX_LEGAL_MOVES];
+    int failures = 0;
+    while (g.nodeCount < options.nodes && failures < 1000) {
+        int i = generator_random_below(&g, g.nodeCount + 1);
+        moveTree* t = i == g.nodeCount ? g.root : g.nodes[i];
+        int choices = 0;
+        for (moveTree* c = t->firstChoice; c != NULL; c = c->nextChoice) {
+            choices++;
+        }
+        if (t->halfMoveNo >= options.depth || choices >= options.branching) {
+            failures++;
+            continue;
+        }
+        generator_replay(&game, t);
+        if ((double)splitmix64(&g.random) / (double)UINT64_MAX < options.transpositionRate && generator_transpose(&g, t, &game)) {
+            failures = 0;
+            continue;
+        }
+        int n = generate_legal_moves(&game, moves);
+        int candidate = n > 0 ? generator_random_below(&g, n) : 0;
+        int tries = 0;
+        while (tries < n && generator_has_choice(t, &moves[candidate])) {
+            candidate = (candidate + 1) % n;
+            tries++;
+        }
+        if (tries == n) {
+            failures++;
+            continue;
+        }
+        failures = 0;
+        moveTree* added = generator_add_move(&g, t, &game, &moves[candidate]);
+        generator_playout(&g, added, &game);
+    }
+    free(g.nodes);
+    return g.root;
+}
+
+void export_move_number(FILE* out, moveTree* t, int* column) {
+    if (t->move->side == white) {
+        *column += fprintf(out, "%d. ", t->fullMoveNo);
+    } else {
+        *column += fprintf(out, "%d... ", t->fullMoveNo);
+    }
+}
+
+int export_indent(FILE* out, int depth) {
+    int width = depth * 4 < 32 ? depth * 4 : 32;
+    fprintf(out, "%*s", width, "");
+    return width;
+}
+
+/** Weights given to the alternatives at a branch of an exported tree. */
+typedef struct {
+    int weights[MAX_LEGAL_MOVES];
+    int next; // alternative to export next
+} exportBranch;
+
+typedef struct {
+    FILE* out;
+    uint64_t random;
+    int column;
+    exportBranch root; // the first moves
+    exportBranch* branches; // for the branches on the current path, the root excluded
+    int branchCount;
+    int branchCapacity;
+} treeExport;
+
+bool export_is_branch(moveTree* t) {
+    return !t->isRoot && t->firstChoice != NULL && t->firstChoice->nextChoice != NULL;
+}
+
+/** Split 100% randomly between the alternatives after t. */
+void export_split_branch(treeExport* e, moveTree* t, exportBranch* b) {
+    int choices = 0, total = 0;
+    for (moveTree* c = t->firstChoice; c != NULL; c = c->nextChoice) {
+        b->weights[choices] = 1 + splitmix64(&e->random) % 100;
+        total += b->weights[choices++];
+    }
+    int assigned = 0;
+    for (int i = 0; i < choices; ++i) {
+        b->weights[i] = i == choices-1 ? 100 - assigned : b->weights[i] * 100 / total;
+        b->weights[i] = b->weights[i] > 0 ? b->weights[i] : 1;
+        assigned += b->weights[i];
+    }
+    b->next = 0;
+}
+
+/**
+ * Write t in the input file format: one line per variation, indented by nesting depth,
+ * with the move number and probability of each alternative.
+ */
+walkAction export_node(treeWalk* walk, moveTree* t) {
+    treeExport* e = (treeExport*)walk->context;
+    FILE* out = e->out;
+    char san[16];
+    if (t->isRoot) {
+        export_split_branch(e, t, &e->root);
+        return walkContinue;
+    }
+    moveTree* parent = t->previousMove;
+    if (parent->isRoot || export_is_branch(parent)) {
+        // first move of a variation
+        exportBranch* b = parent->isRoot ? &e->root : &e->branches[e->branchCount-1];
+        int probability = parent->firstChoice->nextChoice == NULL ? 0 : b->weights[b->next++];
+        e->column = export_indent(out, e->branchCount);
+        export_move_number(out, t, &e->column);
+        if (probability > 0) {
+            e->column += fprintf(out, "%d%% ", probability);
+        }
+    } else if (e->column > 200) {
+        // keep lines well within the parser's line length limit
+        fprintf(out, "\n");
+        e->column = export_indent(out, e->branchCount);
+        export_move_number(out, t, &e->column);
+    } else if (t->move->side == white) {
+        export_move_number(out, t, &e->column);
+    }
+    format_algebraic_notation(t->move, san);
+    e->column += fprintf(out, "%s ", san);
+    if (t->firstChoice == NULL || t->firstChoice->nextChoice != NULL) {
+        fprintf(out, "\n");
+    }
+    if (export_is_branch(t)) {
+        if (e->branchCount == e->branchCapacity) {
+            e->branchCapacity = e->branchCapacity ? 2 * e->branchCapacity : 16;
+            e->branches = (exportBranch*)realloc(e->branches, e->branchCapacity * sizeof(exportBranch));
+            if (e->branches == NULL) {
+                fprintf(stderr, "Failed to allocate memory for export.\n");
+                exit(1);
+            }
+        }
+        export_split_branch(e, t, &e->branches[e->branchCount++]);
+    }
+    return walkContinue;
+}
+
+void export_leave_node(treeWalk* walk, moveTree* t) {
+    if (export_is_branch(t)) {
+        ((treeExport*)walk->context)->branchCount--;
+    }
+}
+
+/** Write a move tree starting from the initial position so that parse() reads it back. */
+void export_tree(FILE* out, moveTree* root, uint64_t seed) {
+    treeExport e;
+    e.out = out;
+    e.random = seed;
+    e.column = 0;
+    e.branches = NULL;
+    e.branchCount = e.branchCapacity = 0;
+    treeWalk walk;
+    init_tree_walk(&walk, NULL, export_node, export_leave_node, &e, &defaultAllocator);
+    walk_tree(&walk, root);
+    free_tree_walk(&walk);
+    free(e.branches);
+}
+
+/** Entry point of `chessline generate`, writing a random repertoire to standard output. */
+int generate_main(int argc, char* argv[]) {
+    generatorOptions options = init_generator_options();
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--nodes=", 8) == 0) {
+            options.nodes = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--depth=", 8) == 0) {
+            options.depth = atoi(argv[i] + 8);
+        } else if (strncmp(argv[i], "--branching=", 12) == 0) {
+            options.branching = atoi(argv[i] + 12);
+        } else if (strncmp(argv[i], "--transpositions=", 17) == 0) {
+            options.transpositionRate = atof(argv[i] + 17);
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            options.seed = strtoull(argv[i] + 7, NULL, 10);
+        } else {
+            fprintf(stderr, "Invalid option %s.\nUsage: $ chessline generate [--nodes=N] [--depth=PLIES] [--branching=N] [--transpositions=RATE] [--seed=N]\n", argv[i]);
+            return 1;
+        }
+    }
+    if (options.branching < 1 || options.depth < 1) {
+        fprintf(stderr, "Depth and branching must be positive.\n");
+        return 1;
+    }
+    moveTree* root = generate_repertoire(options);
+    export_tree(stdout, root, options.seed);
+    free_move_tree(root);
+    return 0;
+}
+
+typedef struct {
+    moveTree** items;
+    int count;
+    int capacity;
+} nodeList;
+
+void node_list_push(nodeList* list, moveTree* t) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->items = (moveTree**)realloc(list->items, list->capacity * sizeof(moveTree*));
+        if (list->items == NULL) {
+            fprintf(stderr, "Failed to allocate memory for node list.\n");
+            exit(1);
+        }
+    }
+    list->items[list->count++] = t;
+}
+
+/** Apply every move of the tree below t to a copy of the board, returning the number of moves applied. */
+uint64_t bench_apply_tree(moveTree* t, sidedPiece board[8][8], nodeList* branches) {
+    uint64_t applied = 0;
+    if (t->firstChoice != NULL) {
+        node_list_push(branches, t);
+    }
+    for (moveTree* c = t->firstChoice; c != NULL; c = c->nextChoice) {
+        sidedPiece next[8][8];
+        memcpy(next, board, sizeof(next));
+        board_apply_move(next, c->move);
+        applied += 1 + bench_apply_tree(c, next, branches);
+    }
+    return applied;
+}
+
+void print_bench_result(int size, char* name, uint64_t operations, uint64_t elapsedNs) {
+    double nsPerOperation = operations ? (double)elapsedNs / operations : 0;
+    wprintf(L"%10d  %-22s %12" PRIu64 " %12.1f %12.3f\n", size, name, operations, nsPerOperation, nsPerOperation > 0 ? 1000.0 / nsPerOperation : 0.0);
+}
+
+/** Run all benchmarks on a generated repertoire of the given number of nodes. */
+void bench_repertoire(int size) {
+    uint64_t seed = 1;
+    uint64_t* random = &seed;
+    char path[] = "/tmp/chessline-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        fprintf(stderr, "Failed to create temporary repertoire file.\n");
+        exit(1);
+    }
+    generatorOptions generator = init_generator_options();
+    generator.nodes = size;
+    uint64_t start = stats_now_ns();
+    moveTree* generated = generate_repertoire(generator);
+    export_tree(out, generated, generator.seed);
+    fclose(out);
+    free_move_tree(generated);
+    print_bench_result(size, "generate", size, stats_now_ns() - start);
+
+    // rendering goes to /dev/null, the results keep going to the real standard output
+    int savedStdout = dup(STDOUT_FILENO);
+    int devNull = open("/dev/null", O_WRONLY);
+
+    // end to end: everything play() does before showing the first prompt
+    start = stats_now_ns();
+    FILE* fp = fopen(path, "r");
+    parser* p = new_file_parser(fp);
+    parseResult res = parse(p);
+    if (res.hasError) {
+        fprintf(stderr, "%s\n", res.errorMessage);
+        exit(1);
+    }
+    fflush(stdout);
+    dup2(devNull, STDOUT_FILENO);
+    print_greeting(random);
+    print_board(p->initGameState->board, true);
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    print_bench_result(size, "parse to first prompt", 1, stats_now_ns() - start);
+    fclose(fp);
+
+    // lexer over the whole file, one line at a time like parse()
+    fp = fopen(path, "r");
+    char buffer[BUFFER_SIZE];
+    char** lines = NULL;
+    int lineCount = 0, lineCapacity = 0;
+    while (fgets(buffer, BUFFER_SIZE, fp) != NULL) {
+        if (lineCount == lineCapacity) {
+            lineCapacity = lineCapacity ? lineCapacity * 2 : 1024;
+            lines = (char**)realloc(lines, lineCapacity * sizeof(char*));
+            if (lines == NULL) {
+                fprintf(stderr, "Failed to allocate memory for benchmark lines.\n");
+                exit(1);
+            }
+        }
+        lines[lineCount] = strdup(buffer);
+        if (lines[lineCount++] == NULL) {
+            fprintf(stderr, "Failed to allocate memory for benchmark lines.\n");
+            exit(1);
+        }
+    }
+    fclose(fp);
+    char** symbols = NULL;
+    int symbolCount = 0, symbolCapacity = 0;
+    uint64_t tokens = 0;
+    start = stats_now_ns();
+    for (int i = 0; i < lineCount; ++i) {
+        char* lexerPtr;
+        lexResult token = next_token(lines[i], &lexerPtr);
+        while (!token.eol && !token.hasError) {
+            tokens++;
+            token = next_token(NULL, &lexerPtr);
+        }
+    }
+    print_bench_result(size, "lexer (tokens)", tokens, stats_now_ns() - start);
+    for (int i = 0; i < lineCount; ++i) {
+        char* lexerPtr;
+        lexResult token = next_token(lines[i], &lexerPtr);
+        while (!token.eol && !token.hasError) {
+            if (token.tokenType == symbolToken) {
+                if (symbolCount == symbolCapacity) {
+                    symbolCapacity = symbolCapacity ? symbolCapacity * 2 : 1024;
+                    symbols = (char**)realloc(symbols, symbolCapacity * sizeof(char*));
+                    if (symbols == NULL) {
+                        fprintf(stderr, "Failed to allocate memory for benchmark symbols.\n");
+                        exit(1);
+                    }
+                }
+                symbols[symbolCount] = strdup(token.token);
+                if (symbols[symbolCount++] == NULL) {
+                    fprintf(stderr, "Failed to allocate memory for benchmark symbols.\n");
+                    exit(1);
+                }
+            }
+            token = next_token(NULL, &lexerPtr);
+        }
+        free(lines[i]);
+    }
+    free(lines);
+
+    // bulk token scanning of the whole file with every classifier the CPU supports
+    fp = fopen(path, "r");
+    fseek(fp, 0, SEEK_END);
+    size_t textLength = ftell(fp);
+    rewind(fp);
+    char* text = (char*)malloc(textLength + 1);
+    tokenMasks* masks = (tokenMasks*)malloc(((textLength + 63) / 64 + 1) * sizeof(tokenMasks));
+    if (text == NULL || masks == NULL || fread(text, 1, textLength, fp) != textLength) {
+        fprintf(stderr, "Failed to read generated repertoire.\n");
+        exit(1);
+    }
+    fclose(fp);
+    char* classifierNames[] = {"token scan scalar (B)", "token scan sse2 (B)", "token scan avx2 (B)"};
+    classifyBlockFunction classifiers[] = {classify_block_scalar, NULL, NULL};
+#if defined(__x86_64__)
+    classifiers[1] = classify_block_sse2;
+    classifiers[2] = __builtin_cpu_supports("avx2") ? classify_block_avx2 : NULL;
+#endif
+    classifyBlockFunction selected = classify_block;
+    for (int i = 0; i < 3; ++i) {
+        if (classifiers[i] == NULL) {
+            continue;
+        }
+        classify_block = classifiers[i];
+        tokenScanState state = {false, false, false, false, false};
+        tokenIterator it;
+        size_t offset, length;
+        bool numeric;
+        uint64_t scanned = 0;
+        start = stats_now_ns();
+        scan_tokens(text, textLength, masks, &state);
+        init_token_iterator(&it, text, textLength, masks);
+        while (next_scanned_token(&it, &offset, &length, &numeric)) {
+            scanned++;
+        }
+        print_bench_result(size, classifierNames[i], textLength, stats_now_ns() - start);
+    }
+    // every classifier against the bytewise scanner, on the repertoire and on PGN-like noise where strings,
+    // comments and brackets overlap
+    size_t noiseLength = 1 << 16;
+    char* noise = (char*)malloc(noiseLength);
+    if (noise == NULL) {
+        fprintf(stderr, "Failed to allocate memory for token scan check.\n");
+        exit(1);
+    }
+    uint64_t noiseSeed = 1;
+    for (size_t i = 0; i < noiseLength; ++i) {
+        noise[i] = "e4Nf3. 1-0%\n\";{}[]()"[splitmix64(&noiseSeed) % 20];
+    }
+    for (int i = 0; i < 3; ++i) {
+        classify_block = classifiers[i];
+        if (classifiers[i] != NULL && (!scan_tokens_agree(text, textLength, &noiseSeed) || !scan_tokens_agree(noise, noiseLength, &noiseSeed))) {
+            fprintf(stderr, "%s disagrees with the bytewise token scanner.\n", classifierNames[i]);
+            exit(1);
+        }
+    }
+    free(noise);
+    classify_block = selected;
+    free(masks);
+    free(text);
+
+    // algebraic notation parser
+    move m;
+    uint64_t parsed = 0;
+    start = stats_now_ns();
+    for (int i = 0; i < symbolCount; ++i) {
+        init_move(&m);
+        parsed += parse_algebraic_notation2(&m, symbols[i]) != NULL;
+    }
+    print_bench_result(size, "SAN parser", symbolCount, stats_now_ns() - start);
+    sanMove code;
+    uint64_t parsedPacked = 0;
+    start = stats_now_ns();
+    for (int i = 0; i < symbolCount; ++i) {
+        parsedPacked += parse_san(symbols[i], &code);
+    }
+    print_bench_result(size, "SAN parser (packed)", symbolCount, stats_now_ns() - start);
+    if (parsedPacked != parsed) {
+        fprintf(stderr, "SAN parsers disagree: %llu and %llu moves\n", (unsigned long long)parsed, (unsigned long long)parsedPacked);
+    }
+    for (int i = 0; i < symbolCount; ++i) {
+        free(symbols[i]);
+    }
+    free(symbols);
+
+    // move application over every line of the tree
+    nodeList branches = {NULL, 0, 0};
+    sidedPiece board[8][8];
+    memcpy(board, p->initGameState->board, sizeof(board));
+    start = stats_now_ns();
+    uint64_t applied = bench_apply_tree(p->moveTreeRoot, board, &branches);
+    print_bench_result(size, "move application", applied, stats_now_ns() - start);
+
+    // child lookup of the last alternative, the slowest to find
+    uint64_t found = 0;
+    start = stats_now_ns();
+    for (int i = 0; i < branches.count; ++i) {
+        moveTree* last = branches.items[i]->firstChoice;
+        while (last->nextChoice != NULL) {
+            last = last->nextChoice;
+        }
+        found += tree_apply_move(branches.items[i], last->move) != NULL;
+    }
+    print_bench_result(size, "child lookup", branches.count, stats_now_ns() - start);
+
+    start = stats_now_ns();
+    for (int i = 0; i < branches.count; ++i) {
+        choose_move(branches.items[i], random);
+    }
+    print_bench_result(size, "sampling", branches.count, stats_now_ns() - start);
+
+    // the same lookups and sampling over the packed encoding, at every node with children
+    succinctTree packed;
+    start = stats_now_ns();
+    build_succinct_tree(p->moveTreeRoot, p->initGameState, &packed);
+    print_bench_result(size, "succinct encoding", packed.header->nodeCount, stats_now_ns() - start);
+    wprintf(L"%10d  %-22s %12zu %12.2f bytes/node\n", size, "succinct size (B)", packed.size, (double)packed.size / packed.header->nodeCount);
+    uint64_t internal = 0;
+    start = stats_now_ns();
+    for (uint64_t node = 0; node < packed.header->nodeCount; ++node) {
+        uint64_t first;
+        int count = succinct_children(&packed, node, &first);
+        if (count > 0) {
+            found += succinct_find_child(&packed, node, packed.moves[first + count - 2]) != 0;
+            internal++;
+        }
+    }
+    print_bench_result(size, "succinct child lookup", internal, stats_now_ns() - start);
+    start = stats_now_ns();
+    for (uint64_t node = 0; node < packed.header->nodeCount; ++node) {
+        succinct_choose(&packed, node, random);
+    }
+    print_bench_result(size, "succinct sampling", packed.header->nodeCount, stats_now_ns() - start);
+    free_succinct_tree(&packed);
+
+    // position at every node with children, replayed from the root or from the nearest checkpoint
+    gameState game;
+    moveUndo u;
+    start = stats_now_ns();
+    for (int i = 0; i < branches.count; ++i) {
+        moveTree* path[branches.items[i]->halfMoveNo + 1];
+        int length = 0;
+        for (moveTree* t = branches.items[i]; !t->isRoot; t = t->previousMove) {
+            path[length++] = t;
+        }
+        game = *p->initGameState;
+        while (length > 0) {
+            move resolved;
+            game_resolve_move(&game, path[--length]->move, &resolved);
+            game_make_move(&game, &resolved, &u);
+        }
+    }
+    print_bench_result(size, "replay from root", branches.count, stats_now_ns() - start);
+    for (int interval = 1; interval <= 16; interval *= 4) {
+        positionCheckpoints checkpoints;
+        char name[32];
+        start = stats_now_ns();
+        build_position_checkpoints(p->moveTreeRoot, p->initGameState, interval, INT_MAX, 1, &checkpoints, &defaultAllocator);
+        uint64_t elapsed = stats_now_ns() - start;
+        snprintf(name, sizeof(name), "checkpoints k=%d (B)", interval);
+        size_t bytes = checkpoints.count * (sizeof(moveTree*) + sizeof(packedGameState)) + (checkpoints.levelCount + 1) * sizeof(uint64_t);
+        wprintf(L"%10d  %-22s %12zu %12.2f bytes/node\n", size, name, bytes, (double)bytes / size);
+        snprintf(name, sizeof(name), "checkpoint build k=%d", interval);
+        print_bench_result(size, name, size, elapsed);
+        start = stats_now_ns();
+        for (int i = 0; i < branches.count; ++i) {
+            checkpoint_position(&checkpoints, branches.items[i], &game);
+        }
+        snprintf(name, sizeof(name), "checkpoint jump k=%d", interval);
+        print_bench_result(size, name, branches.count, stats_now_ns() - start);
+        free_position_checkpoints(&checkpoints);
+    }
+
+    // whole-line sampling, with the weights changing between draws as in a scheduled drill
+    lineSampler sampler;
+    start = stats_now_ns();
+    if (!build_line_sampler(p->moveTreeRoot, number_leaves(p->moveTreeRoot), &defaultAllocator, &sampler)) {
+        fprintf(stderr, "Failed to allocate memory for line weights.\n");
+        exit(1);
+    }
+    print_bench_result(size, "line sampler build", size, stats_now_ns() - start);
+    uint64_t drawSeed = 1;
+    int draws = 1000000;
+    moveTree* leaf = NULL;
+    start = stats_now_ns();
+    for (int i = 0; i < draws; ++i) {
+        leaf = line_sampler_draw(&sampler, p->moveTreeRoot, &drawSeed);
+    }
+    print_bench_result(size, "line draw", draws, stats_now_ns() - start);
+    start = stats_now_ns();
+    for (int i = 0; i < draws; ++i) {
+        line_sampler_scale(&sampler, sampler.leaves[(leaf->firstLeaf + (uint32_t)i * 7919) % sampler.count], i % 2 == 0 ? LINE_FACTOR_ERROR : LINE_FACTOR_SUCCESS);
+    }
+    print_bench_result(size, "line reweight", draws, stats_now_ns() - start);
+
+    // lines of the repertoire as games of a store, only the encoding of their resolved moves timed
+    char storePath[] = "/tmp/chessline-bench-store-XXXXXX";
+    int storeFd = mkstemp(storePath);
+    if (storeFd < 0) {
+        fprintf(stderr, "Failed to create temporary game store.\n");
+        exit(1);
+    }
+    close(storeFd);
+    gameStoreWriter* writer = open_game_store_writer(storePath);
+    uint64_t games = sampler.count < 100000 ? sampler.count : 100000;
+    uint64_t encodeNs = 0;
+    for (uint64_t i = 0; i < games; ++i) {
+        moveTree* line = sampler.leaves[i];
+        moveTree* path[line->halfMoveNo + 1];
+        move moves[line->halfMoveNo + 1];
+        int length = 0;
+        for (moveTree* t = line; !t->isRoot; t = t->previousMove) {
+            path[length++] = t;
+        }
+        game = *p->initGameState;
+        for (int j = 0; j < length; ++j) {
+            game_resolve_move(&game, path[length - 1 - j]->move, &moves[j]);
+            game_make_move(&game, &moves[j], &u);
+        }
+        start = stats_now_ns();
+        add_stored_game(writer, p->initGameState, moves, length, resultUnknown, false);
+        encodeNs += stats_now_ns() - start;
+    }
+    gameStoreHeader storeHeader;
+    if (!close_game_store_writer(writer, &storeHeader)) {
+        fprintf(stderr, "Failed to write temporary game store.\n");
+        exit(1);
+    }
+    print_bench_result(size, "game store encode", storeHeader.plyCount, encodeNs);
+    gameStore* store = open_game_store(storePath);
+    gameStoreCursor cursor;
+    uint16_t storedCode;
+    uint64_t plies = 0;
+    start = stats_now_ns();
+    for (uint64_t i = 0; i < store->header->gameCount; ++i) {
+        open_stored_game(store, i, &cursor);
+        while (next_stored_move(&cursor, &storedCode)) {
+            plies++;
+        }
+    }
+    print_bench_result(size, "game store decode", plies, stats_now_ns() - start);
+    close_game_store(store);
+    unlink(storePath);
+    free_line_sampler(&sampler);
+
+    int renders = branches.count < 10000 ? branches.count : 10000;
+    fflush(stdout);
+    dup2(devNull, STDOUT_FILENO);
+    start = stats_now_ns();
+    for (int i = 0; i < renders; ++i) {
+        print_board(board, i % 2 == 0);
+    }
+    fflush(stdout);
+    uint64_t elapsed = stats_now_ns() - start;
+    dup2(savedStdout, STDOUT_FILENO);
+    print_bench_result(size, "rendering", renders, elapsed);
+    for (int format = diagramSvg; format <= diagramPpm; ++format) {
+        diagramTemplates templates;
+        build_diagram_templates(&templates, format, 45);
+        char* diagram = (char*)malloc(templates.bufferSize);
+        STATS_ALLOC(templates.bufferSize);
+        if (diagram == NULL) {
+            fprintf(stderr, "Failed to allocate memory for diagrams.\n");
+            exit(1);
+        }
+        start = stats_now_ns();
+        for (int i = 0; i < renders; ++i) {
+            render_diagram(&templates, board, i % 2 == 0, i % 64, -1, diagram);
+        }
+        print_bench_result(size, format == diagramSvg ? "diagram svg" : "diagram ppm", renders, stats_now_ns() - start);
+        free(diagram);
+        free_diagram_templates(&templates);
+    }
+
+    // editing the probability of a move, towards the start, in the middle and towards the end of the file,
+    // must only re-parse the line of the move
+    repertoireWatch* watch = open_repertoire_watch(path);
+    if (watch == NULL) {
+        exit(1);
+    }
+    uint64_t reloadNs = 0;
+    int reloads = 0;
+    for (int i = 0; i < 3; ++i) {
+        size_t offset = watch->length * (2 * i + 1) / 6;
+        char* percent = NULL;
+        for (char* c = watch->content + offset; percent == NULL && (c = (char*)memchr(c, '%', watch->content + watch->length - c)) != NULL; ++c) {
+            percent = c - watch->content >= 3 && c[-3] == ' ' && c[-2] >= '1' && c[-2] <= '9' && c[-1] >= '0' && c[-1] <= '9' ? c : NULL;
+        }
+        if (percent == NULL) {
+            continue;
+        }
+        int line = 1 + count_newlines(watch->content, percent - watch->content);
+        char* text = strndup(watch->content, watch->length);
+        text[percent - 1 - watch->content] = percent[-1] == '1' ? '2' : '1';
+        FILE* edited = fopen(path, "w");
+        if (text == NULL || edited == NULL || fwrite(text, 1, watch->length, edited) != watch->length || fclose(edited) != 0) {
+            fprintf(stderr, "Failed to edit temporary repertoire file.\n");
+            exit(1);
+        }
+        free(text);
+        fflush(stdout);
+        dup2(devNull, STDOUT_FILENO);
+        start = stats_now_ns();
+        bool reloaded = reload_repertoire(watch);
+        reloadNs += stats_now_ns() - start;
+        fflush(stdout);
+        dup2(savedStdout, STDOUT_FILENO);
+        if (!reloaded || watch->reparsedLines != 1) {
+            fprintf(stderr, "Editing line %d re-parsed %d lines instead of 1.\n", line, reloaded ? watch->reparsedLines : 0);
+            exit(1);
+        }
+        reloads++;
+    }
+    print_bench_result(size, "reload one line", reloads, reloadNs);
+    close_repertoire_watch(watch);
+
+    close(devNull);
+    close(savedStdout);
+    free(branches.items);
+    free_parser(p);
+    unlink(path);
+}
+
+/** Entry point of `chessline bench`, benchmarking on generated repertoires of 1K, 100K and 10M nodes by default. */
+int bench_main(int argc, char* argv[]) {
+    char* sizes = "1000,100000,10000000";
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--sizes=", 8) == 0) {
+            sizes = argv[i] + 8;
+        } else {
+            fprintf(stderr, "Invalid option %s.\nUsage: $ chessline bench [--sizes=N,N,...]\n", argv[i]);
+            return 1;
+        }
+    }
+    wprintf(L"%10s  %-22s %12s %12s %12s\n", "nodes", "benchmark", "operations", "ns/op", "Mops/s");
+    for (char* size = sizes; size != NULL && *size != 0; size = strchr(size, ',') ? strchr(size, ',') + 1 : NULL) {
+        bench_repertoire(atoi(size));
+    }
+    return 0;
+}
+
+/** Write the moves leading to node t, with move numbers, into buffer. */
+void format_tree_line(moveTree* t, char* buffer, size_t size) {
+    moveTree* path[t->halfMoveNo + 1];
+    int length = 0;
+    for (moveTree* c = t; !c->isRoot; c = c->previousMove) {
+        path[length++] = c;
+    }
+    size_t n = 0;
+    buffer[0] = 0;
+    for (int i = length - 1; i >= 0 && n + 24 < size; --i) {
+        move* m = path[i]->move;
+        if (m->side == white) {
+            n += sprintf(buffer + n, "%d. ", path[i]->fullMoveNo);
+        } else if (i == length - 1) {
+            n += sprintf(buffer + n, "%d... ", path[i]->fullMoveNo);
+        }
+        format_algebraic_notation(m, buffer + n);
+        n += strlen(buffer + n);
+        buffer[n++] = ' ';
+        buffer[n] = 0;
+    }
+    if (n > 0) {
+        buffer[n-1] = 0;
+    }
+}
+
+/** Repertoire position where the opponent is to move, with the replies seen in the database. */
+typedef struct {
+    uint64_t hash;
+    moveTree* node; // first node of the tree reaching the position
+    double pathProbability; // probability of reaching node, from database reply frequencies
+    uint64_t total; // database games replying at this position
+    uint64_t covered; // of which with a reply the tree handles
+} coveragePosition;
+
+/**
+ * Count of a (position, reply) pair, keyed by position slot << 16 | packed move. The promotion bits of a packed
+ * move hold pawn when it promotes to nothing, so they are never 0 and key 0 marks a free slot.
+ */
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+} coverageReply;
+
+typedef struct {
+    coverageReply* slots;
+    size_t capacity;
+    size_t size;
+} coverageReplyTable;
+
+typedef struct {
+    coveragePosition* slots; // open addressing by hash, node NULL when free
+    size_t capacity;
+    size_t size;
+    gameState initial;
+    playerSide opponent;
+    int maxPlies;
+} coverageTree;
+
+typedef struct {
+    coverageTree* tree;
+    char* databasePath;
+    gameStore* store; // when not NULL, games are decoded from it instead of read from the database
+    size_t start; // byte offsets in the database, or game numbers in the store
+    size_t end;
+    coverageReplyTable replies;
+    uint64_t games;
+} coverageWorker;
+
+void init_coverage_replies(coverageReplyTable* table, size_t capacity) {
+    table->capacity = capacity;
+    table->size = 0;
+    table->slots = (coverageReply*)calloc(capacity, sizeof(coverageReply));
+    STATS_ALLOC(capacity * sizeof(coverageReply));
+    if (table->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for coverage counters.\n");
+        exit(1);
+    }
+}
+
+coverageReply* coverage_reply_slot(coverageReplyTable* table, uint64_t key) {
+    size_t i = (key * 0x9e3779b97f4a7c15ULL) >> 20 & (table->capacity - 1);
+    while (table->slots[i].key != 0 && table->slots[i].key != key) {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return &table->slots[i];
+}
+
+void add_coverage_reply(coverageReplyTable* table, uint64_t key, uint64_t count) {
+    if ((table->size + 1) * 10 > table->capacity * 7) {
+        coverageReplyTable grown;
+        init_coverage_replies(&grown, table->capacity * 2);
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (table->slots[i].key != 0) {
+                *coverage_reply_slot(&grown, table->slots[i].key) = table->slots[i];
+            }
+        }
+        grown.size = table->size;
+        free(table->slots);
+        *table = grown;
+    }
+    coverageReply* r = coverage_reply_slot(table, key);
+    if (r->key == 0) {
+        r->key = key;
+        table->size++;
+    }
+    r->count += count;
+}
+
+coveragePosition* find_coverage_position(coverageTree* c, uint64_t hash) {
+    size_t i = hash & (c->capacity - 1);
+    while (c->slots[i].node != NULL && c->slots[i].hash != hash) {
+        i = (i + 1) & (c->capacity - 1);
+    }
+    return &c->slots[i];
+}
+
+void init_coverage_positions(coverageTree* c, size_t capacity) {
+    c->capacity = capacity;
+    c->size = 0;
+    c->slots = (coveragePosition*)calloc(capacity, sizeof(coveragePosition));
+    STATS_ALLOC(capacity * sizeof(coveragePosition));
+    if (c->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for coverage positions.\n");
+        exit(1);
+    }
+}
+
+void grow_coverage_positions(coverageTree* c) {
+    coveragePosition* slots = c->slots;
+    size_t capacity = c->capacity, size = c->size;
+    init_coverage_positions(c, capacity * 2);
+    for (size_t i = 0; i < capacity; ++i) {
+        if (slots[i].node != NULL) {
+            *find_coverage_position(c, slots[i].hash) = slots[i];
+        }
+    }
+    c->size = size;
+    free(slots);
+}
+
+/** Collect the positions of the tree where the opponent is to move. */
+walkAction collect_coverage_position(treeWalk* walk, moveTree* t) {
+    coverageTree* c = (coverageTree*)walk->context;
+    gameState* game = &walk->game;
+    if (!walk->legal) {
+        return walkSkipChildren;
+    }
+    if (t->halfMoveNo > c->maxPlies) {
+        c->maxPlies = t->halfMoveNo;
+    }
+    if (game->sidePlaying == c->opponent && t->firstChoice != NULL) {
+        if ((c->size + 1) * 2 > c->capacity) {
+            grow_coverage_positions(c);
+        }
+        uint64_t hash = board_hash(game->board, game->sidePlaying);
+        coveragePosition* p = find_coverage_position(c, hash);
+        if (p->node == NULL) {
+            p->hash = hash;
+            p->node = t;
+            c->size++;
+        }
+    }
+    return walkContinue;
+}
+
+/** Count the reply played at position when it is a repertoire position where the opponent is to move. */
+void count_coverage_reply(coverageWorker* w, gameState* position, uint16_t reply) {
+    coverageTree* c = w->tree;
+    if (position->sidePlaying == c->opponent) {
+        coveragePosition* p = find_coverage_position(c, board_hash(position->board, position->sidePlaying));
+        if (p->node != NULL) {
+            add_coverage_reply(&w->replies, (uint64_t)(p - c->slots) << 16 | reply, 1);
+        }
+    }
+}
+
+/** Replay the games in a byte range of the database, or in a range of the store, counting replies at repertoire positions. */
+void* coverage_worker(void* arg) {
+    coverageWorker* w = (coverageWorker*)arg;
+    coverageTree* c = w->tree;
+    if (w->store != NULL) {
+        init_coverage_replies(&w->replies, 1 << 12);
+        gameStoreCursor cursor;
+        uint16_t code;
+        for (size_t i = w->start; i < w->end; ++i) {
+            w->games++;
+            open_stored_game(w->store, i, &cursor);
+            for (int ply = 0; ply < c->maxPlies && next_stored_move(&cursor, &code); ++ply) {
+                count_coverage_reply(w, &cursor.game, code);
+            }
+        }
+        return NULL;
+    }
+    pgnReader* reader = open_pgn_reader(w->databasePath);
+    pgn_reader_seek(reader, w->start, w->end);
+    reader->maxPlies = c->maxPlies;
+    pgnGame* game = new_pgn_game();
+    gameState position;
+    init_coverage_replies(&w->replies, 1 << 12);
+    while (next_pgn_game(reader, game, &position)) {
+        w->games++;
+        gameState replay = game->start;
+        moveUndo u;
+        int plies = game->moveCount < c->maxPlies ? game->moveCount : c->maxPlies;
+        for (int i = 0; i < plies; ++i) {
+            count_coverage_reply(w, &replay, pack_move(&game->moves[i]));
+            game_make_move(&replay, &game->moves[i], &u);
+        }
+    }
+    free_pgn_game(game);
+    close_pgn_reader(reader);
+    return NULL;
+}
+
+typedef struct {
+    coverageTree* tree;
+    coverageReplyTable* replies;
+    double* probabilities; // of reaching the node at each depth of the current path
+    coveragePosition** positions; // opponent position at each depth of the current path, NULL if none
+    int capacity;
+} coveragePaths;
+
+/** Propagate the probability of reaching each node, given database reply frequencies at opponent positions. */
+walkAction coverage_path_probability(treeWalk* walk, moveTree* t) {
+    coveragePaths* paths = (coveragePaths*)walk->context;
+    coverageTree* c = paths->tree;
+    gameState* game = &walk->game;
+    int depth = walk->depth;
+    if (!walk->legal) {
+        return walkSkipChildren;
+    }
+    if (depth == paths->capacity) {
+        paths->capacity *= 2;
+        paths->probabilities = (double*)realloc(paths->probabilities, paths->capacity * sizeof(double));
+        paths->positions = (coveragePosition**)realloc(paths->positions, paths->capacity * sizeof(coveragePosition*));
+        if (paths->probabilities == NULL || paths->positions == NULL) {
+            fprintf(stderr, "Failed to allocate memory for coverage.\n");
+            exit(1);
+        }
+    }
+    double probability = 1;
+    if (depth > 0) {
+        coveragePosition* p = paths->positions[depth-1];
+        probability = paths->probabilities[depth-1];
+        if (p != NULL) {
+            coverageReply* r = coverage_reply_slot(paths->replies, (uint64_t)(p - c->slots) << 16 | pack_move(&walk->resolved));
+            probability = p->total > 0 ? probability * r->count / p->total : 0;
+        }
+    }
+    coveragePosition* p = NULL;
+    if (game->sidePlaying == c->opponent && t->firstChoice != NULL) {
+        p = find_coverage_position(c, board_hash(game->board, game->sidePlaying));
+        if (p->node == t) {
+            p->pathProbability = probability;
+        }
+    }
+    paths->probabilities[depth] = probability;
+    paths->positions[depth] = p;
+    return walkContinue;
+}
+
+typedef struct {
+    coveragePosition* position;
+    uint16_t reply;
+    uint64_t count;
+    double pathProbability;
+} uncoveredReply;
+
+int compare_uncovered_by_count(const void* a, const void* b) {
+    const uncoveredReply* x = (const uncoveredReply*)a;
+    const uncoveredReply* y = (const uncoveredReply*)b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+int compare_uncovered_by_probability(const void* a, const void* b) {
+    const uncoveredReply* x = (const uncoveredReply*)a;
+    const uncoveredReply* y = (const uncoveredReply*)b;
+    return x->pathProbability < y->pathProbability ? 1 : x->pathProbability > y->pathProbability ? -1 : 0;
+}
+
+int compare_positions_by_uncovered(const void* a, const void* b) {
+    const coveragePosition* x = *(coveragePosition* const*)a;
+    const coveragePosition* y = *(coveragePosition* const*)b;
+    uint64_t ux = x->total - x->covered, uy = y->total - y->covered;
+    return ux < uy ? 1 : ux > uy ? -1 : 0;
+}
+
+void print_uncovered_reply(coverageTree* c, uncoveredReply* r) {
+    char line[BUFFER_SIZE * 4];
+    char reply[16] = "?";
+    gameState game;
+    move moves[MAX_LEGAL_MOVES];
+    replay_tree_path(&game, &c->initial, r->position->node);
+    int n = generate_legal_moves(&game, moves);
+    for (int i = 0; i < n; ++i) {
+        if (pack_move(&moves[i]) == r->reply) {
+            move san = algebraic_notation_move(&game, &moves[i]);
+            format_algebraic_notation(&san, reply);
+        }
+    }
+    format_tree_line(r->position->node, line, sizeof(line));
+    wprintf(L"  %8" PRIu64 " %6.1f%% %9.5f%%  %s | %s\n", r->count, 100.0 * r->count / r->position->total,
+        100.0 * r->pathProbability, line[0] ? line : "(start)", reply);
+}
+
+/**
+ * Entry point of `chessline coverage`: replay every game of a PGN database against the repertoire, in parallel,
+ * and report which opponent replies the repertoire handles.
+ */
+int coverage_main(int argc, char* argv[]) {
+    char* paths[2] = {NULL, NULL};
+    int pathCount = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int top = 20;
+    int side = -1;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--top=", 6) == 0) {
+            top = atoi(argv[i] + 6);
+        } else if (strcmp(argv[i], "--white") == 0) {
+            side = white;
+        } else if (strcmp(argv[i], "--black") == 0) {
+            side = black;
+        } else if (argv[i][0] != '-' && pathCount < 2) {
+            paths[pathCount++] = argv[i];
+        } else {
+            pathCount = 0;
+            break;
+        }
+    }
+    if (pathCount != 2 || threads < 1) {
+        fprintf(stderr, "Usage: $ chessline coverage REPERTOIRE DATABASE.pgn|STORE [--white|--black] [--threads=T] [--top=N]\n");
+        return 1;
+    }
+    FILE* fp = fopen(paths[0], "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for reading.\n", paths[0]);
+        return 1;
+    }
+    parser* p = new_file_parser(fp);
+    parseResult res = parse(p);
+    if (res.hasError) {
+        fprintf(stderr, "%s", res.errorMessage);
+        return 1;
+    }
+    fclose(fp);
+
+    // by default the trainee plays the side to move at the root, as in play()
+    coverageTree c;
+    c.initial = *p->initGameState;
+    c.opponent = side == -1 ? (c.initial.sidePlaying == white ? black : white) : (side == white ? black : white);
+    c.maxPlies = 0;
+    init_coverage_positions(&c, 1 << 10);
+    treeWalk walk;
+    init_tree_walk(&walk, &c.initial, collect_coverage_position, NULL, &c, &defaultAllocator);
+    walk_tree(&walk, p->moveTreeRoot);
+    free_tree_walk(&walk);
+
+    struct stat st;
+    if (stat(paths[1], &st) != 0) {
+        fprintf(stderr, "Failed to open %s for reading.\n", paths[1]);
+        return 1;
+    }
+    // a game store is split between threads by games, a database by bytes
+    gameStore* store = is_game_store_file(paths[1]) ? open_game_store(paths[1]) : NULL;
+    size_t size = store != NULL ? store->header->gameCount : (size_t)st.st_size;
+    uint64_t start = stats_now_ns();
+    coverageWorker workers[threads];
+    pthread_t ids[threads];
+    for (int i = 0; i < threads; ++i) {
+        workers[i].tree = &c;
+        workers[i].databasePath = paths[1];
+        workers[i].store = store;
+        workers[i].start = size * i / threads;
+        workers[i].end = size * (i + 1) / threads;
+        workers[i].games = 0;
+        if (pthread_create(&ids[i], NULL, coverage_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start coverage thread.\n");
+            exit(1);
+        }
+    }
+    coverageReplyTable replies;
+    init_coverage_replies(&replies, 1 << 12);
+    uint64_t games = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        games += workers[i].games;
+        for (size_t j = 0; j < workers[i].replies.capacity; ++j) {
+            coverageReply* r = &workers[i].replies.slots[j];
+            if (r->key != 0) {
+                add_coverage_reply(&replies, r->key, r->count);
+            }
+        }
+        free(workers[i].replies.slots);
+    }
+    uint64_t elapsed = stats_now_ns() - start;
+    if (store != NULL) {
+        close_game_store(store);
+    }
+
+    // a reply is covered when the node stored for its position has a child with that move
+    size_t uncoveredCount = 0;
+    uncoveredReply* uncovered = (uncoveredReply*)malloc((replies.size + 1) * sizeof(uncoveredReply));
+    STATS_ALLOC((replies.size + 1) * sizeof(uncoveredReply));
+    if (uncovered == NULL) {
+        fprintf(stderr, "Failed to allocate memory for coverage report.\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < replies.capacity; ++i) {
+        coverageReply* r = &replies.slots[i];
+        if (r->key == 0) {
+            continue;
+        }
+        coveragePosition* position = &c.slots[r->key >> 16];
+        uint16_t reply = r->key & 0xffff;
+        bool covered = false;
+        gameState game;
+        replay_tree_path(&game, &c.initial, position->node);
+        move resolved;
+        for (moveTree* child = position->node->firstChoice; child != NULL && !covered; child = child->nextChoice) {
+            covered = game_resolve_move(&game, child->move, &resolved) && pack_move(&resolved) == reply;
+        }
+        position->total += r->count;
+        if (covered) {
+            position->covered += r->count;
+        } else {
+            uncovered[uncoveredCount].position = position;
+            uncovered[uncoveredCount].reply = reply;
+            uncovered[uncoveredCount++].count = r->count;
+        }
+    }
+    coveragePaths reach;
+    reach.tree = &c;
+    reach.replies = &replies;
+    reach.capacity = 64;
+    reach.probabilities = (double*)malloc(reach.capacity * sizeof(double));
+    reach.positions = (coveragePosition**)malloc(reach.capacity * sizeof(coveragePosition*));
+    if (reach.probabilities == NULL || reach.positions == NULL) {
+        fprintf(stderr, "Failed to allocate memory for coverage.\n");
+        exit(1);
+    }
+    init_tree_walk(&walk, &c.initial, coverage_path_probability, NULL, &reach, &defaultAllocator);
+    walk_tree(&walk, p->moveTreeRoot);
+    free_tree_walk(&walk);
+    free(reach.probabilities);
+    free(reach.positions);
+    for (size_t i = 0; i < uncoveredCount; ++i) {
+        uncoveredReply* r = &uncovered[i];
+        r->pathProbability = r->position->pathProbability * r->count / r->position->total;
+    }
+
+    coveragePosition** reached = (coveragePosition**)malloc((c.size + 1) * sizeof(coveragePosition*));
+    STATS_ALLOC((c.size + 1) * sizeof(coveragePosition*));
+    if (reached == NULL) {
+        fprintf(stderr, "Failed to allocate memory for coverage report.\n");
+        exit(1);
+    }
+    size_t reachedCount = 0;
+    uint64_t total = 0, covered = 0;
+    for (size_t i = 0; i < c.capacity; ++i) {
+        if (c.slots[i].node != NULL && c.slots[i].total > 0) {
+            reached[reachedCount++] = &c.slots[i];
+            total += c.slots[i].total;
+            covered += c.slots[i].covered;
+        }
+    }
+
+    wprintf(L"%" PRIu64 " games, %zu opponent positions in the repertoire, %zu reached (%.2fs, %d threads)\n",
+        games, c.size, reachedCount, elapsed / 1e9, threads);
+    wprintf(L"Replies handled: %.1f%% (%" PRIu64 " of %" PRIu64 ")\n", total > 0 ? 100.0 * covered / total : 100.0, covered, total);
+    qsort(reached, reachedCount, sizeof(coveragePosition*), compare_positions_by_uncovered);
+    wprintf(L"\nLeast covered positions:\n  %8s %7s  line\n", "missed", "handled");
+    for (size_t i = 0; i < reachedCount && i < (size_t)top && reached[i]->covered < reached[i]->total; ++i) {
+        char line[BUFFER_SIZE * 4];
+        format_tree_line(reached[i]->node, line, sizeof(line));
+        wprintf(L"  %8" PRIu64 " %6.1f%%  %s\n", reached[i]->total - reached[i]->covered, 100.0 * reached[i]->covered / reached[i]->total, line[0] ? line : "(start)");
+    }
+    qsort(uncovered, uncoveredCount, sizeof(uncoveredReply), compare_uncovered_by_count);
+    wprintf(L"\nUncovered replies by frequency:\n  %8s %7s %10s  line | reply\n", "games", "share", "path");
+    for (size_t i = 0; i < uncoveredCount && i < (size_t)top; ++i) {
+        print_uncovered_reply(&c, &uncovered[i]);
+    }
+    qsort(uncovered, uncoveredCount, sizeof(uncoveredReply), compare_uncovered_by_probability);
+    wprintf(L"\nUncovered replies by path probability:\n  %8s %7s %10s  line | reply\n", "games", "share", "path");
+    for (size_t i = 0; i < uncoveredCount && i < (size_t)top; ++i) {
+        print_uncovered_reply(&c, &uncovered[i]);
+    }
+    free(reached);
+    free(uncovered);
+    free(replies.slots);
+    free(c.slots);
+    free_parser(p);
+    return 0;
+}
+
+#define UCI_MAX_PLIES 1024
+
+/** A move of the repertoire from a position, see openingBook. */
+typedef struct {
+    uint64_t hash; // of the position the move is played from
+    uint16_t move; // pack_move() of the move
+    int weight;
+    uint32_t order; // of the node in the tree walk
+} bookMove;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t first; // index in the moves of the book
+    uint32_t count; // 0 for an empty slot
+} bookPosition;
+
+/**
+ * Moves of a repertoire by position hash, so that any move order reaching a position of the tree finds its
+ * moves with a single lookup. Transposed nodes contribute the moves not already given by the first one.
+ */
+typedef struct {
+    bookPosition* slots;
+    size_t mask;
+    bookMove* moves;
+    size_t moveCount;
+    size_t moveCapacity;
+    uint64_t* hashes; // position at each depth of the path being walked, while building
+    int hashCapacity;
+} openingBook;
+
+walkAction add_book_node(treeWalk* walk, moveTree* t) {
+    openingBook* book = (openingBook*)walk->context;
+    if (!walk->legal) {
+        return walkSkipChildren;
+    }
+    if (walk->depth == book->hashCapacity) {
+        book->hashCapacity = book->hashCapacity ? 2 * book->hashCapacity : 64;
+        book->hashes = (uint64_t*)realloc(book->hashes, book->hashCapacity * sizeof(uint64_t));
+        if (book->hashes == NULL) {
+            fprintf(stderr, "Failed to allocate memory for opening book.\n");
+            exit(1);
+        }
+    }
+    book->hashes[walk->depth] = board_hash(walk->game.board, walk->game.sidePlaying);
+    if (walk->depth == 0) {
+        return walkContinue;
+    }
+    if (book->moveCount == book->moveCapacity) {
+        book->moveCapacity = book->moveCapacity ? 2 * book->moveCapacity : 1024;
+        book->moves = (bookMove*)realloc(book->moves, book->moveCapacity * sizeof(bookMove));
+        if (book->moves == NULL) {
+            fprintf(stderr, "Failed to allocate memory for opening book.\n");
+            exit(1);
+        }
+    }
+    bookMove* b = &book->moves[book->moveCount];
+    b->hash = book->hashes[walk->depth-1];
+    b->move = pack_move(&walk->resolved);
+    b->weight = t->probability;
+    b->order = book->moveCount++;
+    return walkContinue;
+}
+
+int compare_book_moves(const void* a, const void* b) {
+    const bookMove* x = (const bookMove*)a;
+    const bookMove* y = (const bookMove*)b;
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/** Build the book of the tree at root, whose position is initial. Illegal moves and their lines are left out. */
+openingBook* build_opening_book(moveTree* root, gameState* initial) {
+    openingBook* book = (openingBook*)calloc(1, sizeof(openingBook));
+    if (book == NULL) {
+        fprintf(stderr, "Failed to allocate memory for opening book.\n");
+        exit(1);
+    }
+    treeWalk walk;
+    init_tree_walk(&walk, initial, add_book_node, NULL, book, &defaultAllocator);
+    if (!walk_tree(&walk, root) && walk.outOfMemory) {
+        fprintf(stderr, "Failed to allocate memory for tree walk.\n");
+        exit(1);
+    }
+    free_tree_walk(&walk);
+    free(book->hashes);
+    book->hashes = NULL;
+
+    // group moves by position in tree order, dropping the moves transposed nodes repeat
+    if (book->moveCount > 0) {
+        qsort(book->moves, book->moveCount, sizeof(bookMove), compare_book_moves);
+    }
+    size_t positions = 0, kept = 0;
+    for (size_t i = 0; i < book->moveCount; ++i) {
+        bool repeated = false;
+        for (size_t j = kept; j-- > 0 && book->moves[j].hash == book->moves[i].hash && !repeated; ) {
+            repeated = book->moves[j].move == book->moves[i].move;
+        }
+        if (!repeated) {
+            positions += kept == 0 || book->moves[kept-1].hash != book->moves[i].hash;
+            book->moves[kept++] = book->moves[i];
+        }
+    }
+    book->moveCount = kept;
+
+    size_t capacity = 16;
+    while (capacity < 2 * positions) {
+        capacity *= 2;
+    }
+    book->mask = capacity - 1;
+    book->slots = (bookPosition*)calloc(capacity, sizeof(bookPosition));
+    STATS_ALLOC(capacity * sizeof(bookPosition));
+    if (book->slots == NULL) {
+        fprintf(stderr, "Failed to allocate memory for opening book.\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < book->moveCount; ) {
+        size_t end = i;
+        while (end < book->moveCount && book->moves[end].hash == book->moves[i].hash) {
+            end++;
+        }
+        size_t slot = book->moves[i].hash & book->mask;
+        while (book->slots[slot].count != 0) {
+            slot = (slot + 1) & book->mask;
+        }
+        book->slots[slot].hash = book->moves[i].hash;
+        book->slots[slot].first = i;
+        book->slots[slot].count = end - i;
+        i = end;
+    }
+    return book;
+}
+
+void free_opening_book(openingBook* book) {
+    free(book->slots);
+    free(book->moves);
+    free(book);
+}
+
+/** The book entry of a position, NULL when out of book. */
+bookPosition* opening_book_lookup(openingBook* book, gameState* game) {
+    uint64_t hash = board_hash(game->board, game->sidePlaying);
+    for (size_t slot = hash & book->mask; book->slots[slot].count != 0; slot = (slot + 1) & book->mask) {
+        if (book->slots[slot].hash == hash) {
+            return &book->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+/** Draw one of the moves of a book position according to their weights. */
+uint16_t opening_book_choose(openingBook* book, bookPosition* position, uint64_t* random) {
+    bookMove* moves = book->moves + position->first;
+    double total = 0;
+    for (uint32_t i = 0; i < position->count; ++i) {
+        total += moves[i].weight;
+    }
+    double target = random_probability(random) * total;
+    for (uint32_t i = 0; i < position->count; ++i) {
+        target -= moves[i].weight;
+        if (target < 0) {
+            return moves[i].move;
+        }
+    }
+    return moves[0].move;
+}
+
+/** Parse a move in UCI coordinate notation such as e2e4 or e7e8q into the encoding of pack_move(). */
+bool parse_uci_move(char* text, uint16_t* code) {
+    if (text[0] < 'a' || text[0] > 'h' || text[1] < '1' || text[1] > '8' || text[2] < 'a' || text[2] > 'h' || text[3] < '1' || text[3] > '8') {
+        return false;
+    }
+    char* promotions = "nbrq";
+    char* promotion = text[4] != 0 ? strchr(promotions, text[4]) : NULL;
+    if (text[4] != 0 && (promotion == NULL || text[5] != 0)) {
+        return false;
+    }
+    *code = ((text[1] - '1') * 8 + text[0] - 'a') << 9 | ((text[3] - '1') * 8 + text[2] - 'a') << 3 |
+        (promotion == NULL ? pawn : knight + (promotion - promotions));
+    return true;
+}
+
+void format_uci_move(uint16_t code, char* buffer) {
+    int from = code >> 9, to = (code >> 3) & 63, promoteTo = code & 7;
+    buffer[0] = 'a' + from % 8;
+    buffer[1] = '1' + from / 8;
+    buffer[2] = 'a' + to % 8;
+    buffer[3] = '1' + to / 8;
+    buffer[4] = promoteTo > pawn ? "nbrq"[promoteTo - knight] : 0;
+    buffer[5] = 0;
+}
+
+/**
+ * Position of a `position` command. The moves of the previous command are not replayed when it only added
+ * moves to them, as GUIs do during a game.
+ */
+typedef struct {
+    char base[BUFFER_SIZE]; // startpos or FEN the moves start from
+    uint16_t moves[UCI_MAX_PLIES];
+    int moveCount;
+    gameState game; // after the moves
+    bool valid;
+} uciPosition;
+
+/** Handle `position (startpos | fen FEN) [moves MOVE...]`, with saveptr past the command name. */
+void uci_set_position(uciPosition* position, char** saveptr) {
+    char base[BUFFER_SIZE] = "";
+    uint16_t moves[UCI_MAX_PLIES];
+    int moveCount = 0;
+    char* token = strtok_r(NULL, " \t\n", saveptr);
+    if (token != NULL && strcmp(token, "fen") == 0) {
+        size_t length = 0;
+        while ((token = strtok_r(NULL, " \t\n", saveptr)) != NULL && strcmp(token, "moves") != 0 && length < sizeof(base)) {
+            length += snprintf(base + length, sizeof(base) - length, length > 0 ? " %s" : "%s", token);
+        }
+    } else if (token != NULL && strcmp(token, "startpos") == 0) {
+        strcpy(base, "startpos");
+        token = strtok_r(NULL, " \t\n", saveptr);
+    }
+    if (base[0] == 0 || (token != NULL && strcmp(token, "moves") != 0)) {
+        wprintf(L"info string invalid position\n");
+        position->valid = false;
+        return;
+    }
+    while ((token = strtok_r(NULL, " \t\n", saveptr)) != NULL) {
+        if (moveCount == UCI_MAX_PLIES || !parse_uci_move(token, &moves[moveCount++])) {
+            wprintf(L"info string invalid move %s\n", token);
+            position->valid = false;
+            return;
+        }
+    }
+
+    // start over unless the previous moves from the same base are a prefix of the new ones
+    int ply = position->moveCount;
+    if (!position->valid || strcmp(base, position->base) != 0 || moveCount < ply ||
+        memcmp(moves, position->moves, ply * sizeof(uint16_t)) != 0) {
+        char fen[BUFFER_SIZE];
+        strcpy(fen, base); // parse_fen() cuts the record into tokens
+        if (strcmp(base, "startpos") == 0) {
+            init_game(&position->game);
+        } else if (!parse_fen(fen, &position->game)) {
+            wprintf(L"info string invalid FEN\n");
+            position->valid = false;
+            return;
+        }
+        strcpy(position->base, base);
+        ply = 0;
+    }
+    move resolved;
+    moveUndo u;
+    position->valid = false;
+    for (; ply < moveCount; ++ply) {
+        if (!game_resolve_packed_move(&position->game, moves[ply], &resolved)) {
+            char text[6];
+            format_uci_move(moves[ply], text);
+            wprintf(L"info string illegal move %s\n", text);
+            return;
+        }
+        game_make_move(&position->game, &resolved, &u);
+        position->moves[ply] = moves[ply];
+    }
+    position->moveCount = moveCount;
+    position->valid = true;
+}
+
+/**
+ * Answer UCI commands on the standard streams with moves of the book, drawn according to their weights.
+ * Positions out of book get the null move 0000.
+ */
+int uci_main(openingBook* book, uint64_t seed) {
+    uciPosition position;
+    position.valid = false;
+    position.moveCount = 0;
+    uint64_t random = seed;
+    char* line = NULL;
+    size_t size = 0;
+    setvbuf(stdin, NULL, _IOLBF, 0);
+    while (getline(&line, &size, stdin) >= 0) {
+        char* saveptr;
+        char* command = strtok_r(line, " \t\n", &saveptr);
+        if (command == NULL) {
+            continue;
+        } else if (strcmp(command, "uci") == 0) {
+            wprintf(L"id name chessline\nid author chessline\n");
+            wprintf(L"option name Seed type spin default 0 min 0 max 2147483647\nuciok\n");
+        } else if (strcmp(command, "isready") == 0) {
+            wprintf(L"readyok\n");
+        } else if (strcmp(command, "ucinewgame") == 0) {
+            position.valid = false;
+        } else if (strcmp(command, "setoption") == 0) {
+            // setoption name Seed value N
+            char* name = strtok_r(NULL, " \t\n", &saveptr);
+            name = name != NULL && strcmp(name, "name") == 0 ? strtok_r(NULL, " \t\n", &saveptr) : NULL;
+            char* value = strtok_r(NULL, " \t\n", &saveptr);
+            value = value != NULL && strcmp(value, "value") == 0 ? strtok_r(NULL, " \t\n", &saveptr) : NULL;
+            if (name != NULL && strcasecmp(name, "Seed") == 0 && value != NULL) {
+                random = atoll(value) != 0 ? (uint64_t)atoll(value) : seed;
+            }
+        } else if (strcmp(command, "position") == 0) {
+            uci_set_position(&position, &saveptr);
+        } else if (strcmp(command, "go") == 0) {
+            bookPosition* entry = position.valid ? opening_book_lookup(book, &position.game) : NULL;
+            if (entry == NULL) {
+                wprintf(L"info string out of book\nbestmove 0000\n");
+            } else {
+                char text[6];
+                format_uci_move(opening_book_choose(book, entry, &random), text);
+                wprintf(L"bestmove %s\n", text);
+            }
+        } else if (strcmp(command, "quit") == 0) {
+            break;
+        }
+        // stop, ponderhit and debug need no answer, moves are given as soon as asked
+        fflush(stdout);
+    }
+    free(line);
+    return 0;
+}
+
+/** Inputs of a drill script, split into sessions by lines holding `new`. */
+typedef struct {
+    char** lines;
+    int lineCount;
+    int* sessionStarts; // first line of each session, followed by lineCount
+    int sessionCount;
+} drillScript;
+
+/** Read a drill script from path, or from the standard input for -. */
+bool read_drill_script(char* path, drillScript* script) {
+    FILE* fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open script %s.\n", path);
+        return false;
+    }
+    int lineCapacity = 64, sessionCapacity = 16;
+    script->lines = (char**)malloc(lineCapacity * sizeof(char*));
+    script->sessionStarts = (int*)malloc(sessionCapacity * sizeof(int));
+    STATS_ALLOC(lineCapacity * sizeof(char*) + sessionCapacity * sizeof(int));
+    if (script->lines == NULL || script->sessionStarts == NULL) {
+        fprintf(stderr, "Failed to allocate memory for script.\n");
+        exit(1);
+    }
+    script->lineCount = 0;
+    script->sessionCount = 0;
+    script->sessionStarts[0] = 0;
+    char buffer[BUFFER_SIZE];
+    while (fgets(buffer, BUFFER_SIZE, fp) != NULL) {
+        buffer[strcspn(buffer, "\r\n")] = 0;
+        if (buffer[0] == 0 || buffer[0] == '#') {
+            continue;
+        }
+        if (script->sessionCount + 2 > sessionCapacity) {
+            sessionCapacity *= 2;
+            script->sessionStarts = (int*)realloc(script->sessionStarts, sessionCapacity * sizeof(int));
+        }
+        if (script->lineCount == lineCapacity) {
+            lineCapacity *= 2;
+            script->lines = (char**)realloc(script->lines, lineCapacity * sizeof(char*));
+        }
+        if (script->lines == NULL || script->sessionStarts == NULL) {
+            fprintf(stderr, "Failed to allocate memory for script.\n");
+            exit(1);
+        }
+        if (strcmp(buffer, "new") == 0) {
+            // an empty session before the first new is not one
+            if (script->lineCount > script->sessionStarts[script->sessionCount]) {
+                script->sessionStarts[++script->sessionCount] = script->lineCount;
+            }
+            continue;
+        }
+        script->lines[script->lineCount++] = strdup(buffer);
+    }
+    if (script->lineCount > script->sessionStarts[script->sessionCount]) {
+        script->sessionCount++;
+    }
+    script->sessionStarts[script->sessionCount] = script->lineCount;
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return true;
+}
+
+void free_drill_script(drillScript* script) {
+    for (int i = 0; i < script->lineCount; ++i) {
+        free(script->lines[i]);
+    }
+    free(script->lines);
+    free(script->sessionStarts);
+}
+
+/** Write s as a JSON string, quotes included. */
+void print_json_string(char* s) {
+    wprintf(L"\"");
+    for (; *s != 0; ++s) {
+        if (*s == '"' || *s == '\\') {
+            wprintf(L"\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            wprintf(L"\\u%04x", *s);
+        } else {
+            wprintf(L"%c", *s);
+        }
+    }
+    wprintf(L"\"");
+}
+
+int compare_latencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Run drill sessions headless from a script, cycling through its sessions, and print one JSON object per line
+ * for each event. Script lines are what the trainee would type: a move, `book` for a move of the repertoire,
+ * `finish` for repertoire moves up to the end of the line, or `exit`. A session ends at the end of the line
+ * or of its script lines. Latency is measured from reading an input to the reply being chosen.
+ * With schedule, replies follow whole lines drawn by their errors across sessions, and by progress if given.
+ */
+int run_drill_script(parser* p, char* scriptPath, int sessions, uint64_t seed, bool computerFirst, bool schedule, progressStore* progress) {
+    drillScript script;
+    if (!read_drill_script(scriptPath, &script)) {
+        return 1;
+    }
+    if (script.sessionCount == 0) {
+        fprintf(stderr, "Script %s has no input.\n", scriptPath);
+        return 1;
+    }
+    sessions = sessions > 0 ? sessions : script.sessionCount;
+    chesslineRepertoire repertoire = {p, number_leaves(p->moveTreeRoot)};
+    chesslineSession* session;
+    if (chessline_session_new(&repertoire, seed, &session) != chesslineOk) {
+        fprintf(stderr, "Failed to allocate memory for session.\n");
+        exit(1);
+    }
+    chesslineScheduler* scheduler = NULL;
+    if (schedule) {
+        if (chessline_scheduler_new(&repertoire, &scheduler) != chesslineOk) {
+            fprintf(stderr, "Failed to allocate memory for line weights.\n");
+            exit(1);
+        }
+        if (progress != NULL) {
+            // the root move is black when white moves first
+            playerSide trainee = (p->moveTreeRoot->move->side == black) != computerFirst ? white : black;
+            weigh_lines_by_progress(&scheduler->lines, p->initGameState, progress, trainee);
+        }
+        chessline_session_schedule(session, scheduler);
+    }
+    size_t latencyCount = 0, latencyCapacity = 1024;
+    uint64_t* latencies = (uint64_t*)malloc(latencyCapacity * sizeof(uint64_t));
+    STATS_ALLOC(latencyCapacity * sizeof(uint64_t));
+    if (latencies == NULL) {
+        fprintf(stderr, "Failed to allocate memory for latencies.\n");
+        exit(1);
+    }
+    uint64_t completed = 0, wrongTotal = 0, invalidTotal = 0;
+    char san[16];
+    for (int s = 0; s < sessions; ++s) {
+        chessline_session_reset(session);
+        int line = script.sessionStarts[s % script.sessionCount];
+        int end = script.sessionStarts[s % script.sessionCount + 1];
+        int ply = 0, wrong = 0, invalid = 0;
+        bool finishing = false;
+        char* result = "incomplete";
+        wprintf(L"{\"event\":\"session\",\"session\":%d}\n", s);
+        if (computerFirst && chessline_session_reply(session, san, sizeof(san)) == chesslineOk) {
+            wprintf(L"{\"event\":\"reply\",\"session\":%d,\"ply\":%d,\"move\":\"%s\"}\n", s, ++ply, san);
+        }
+        while (true) {
+            if (chessline_session_finished(session)) {
+                result = "complete";
+                break;
+            }
+            if (!finishing && line == end) {
+                break;
+            }
+            char* input = finishing ? "finish" : script.lines[line++];
+            if (strcmp(input, "exit") == 0) {
+                result = "exit";
+                break;
+            }
+            finishing |= strcmp(input, "finish") == 0;
+            uint64_t start = stats_now_ns();
+            uint64_t positionHash = chessline_session_position(session);
+            chesslineStatus status;
+            char played[16];
+            if (finishing || strcmp(input, "book") == 0) {
+                status = chessline_session_reply(session, played, sizeof(played));
+            } else {
+                status = chessline_session_play(session, input);
+                snprintf(played, sizeof(played), "%s", input);
+            }
+            if (progress != NULL && status != chesslineInvalidMove) {
+                progress_record_answer(progress, positionHash, status == chesslineOk);
+            }
+            chesslineStatus replyStatus = chesslineEndOfLine;
+            if (status == chesslineOk && !chessline_session_finished(session)) {
+                replyStatus = chessline_session_reply(session, san, sizeof(san));
+            }
+            uint64_t latency = stats_now_ns() - start;
+            if (latencyCount == latencyCapacity) {
+                latencyCapacity *= 2;
+                latencies = (uint64_t*)realloc(latencies, latencyCapacity * sizeof(uint64_t));
+                if (latencies == NULL) {
+                    fprintf(stderr, "Failed to allocate memory for latencies.\n");
+                    exit(1);
+                }
+            }
+            latencies[latencyCount++] = latency;
+
+            wprintf(L"{\"event\":\"move\",\"session\":%d,\"ply\":%d,\"input\":", s, ply + 1);
+            print_json_string(played);
+            wprintf(L",\"result\":\"%s\",\"latency_ns\":%" PRIu64 "}\n", status == chesslineOk ? "correct" : status == chesslineWrongMove ? "wrong" : "invalid", latency);
+            if (status == chesslineOk) {
+                ply++;
+                if (replyStatus == chesslineOk) {
+                    wprintf(L"{\"event\":\"reply\",\"session\":%d,\"ply\":%d,\"move\":\"%s\"}\n", s, ++ply, san);
+                }
+            } else if (status == chesslineWrongMove) {
+                wrong++;
+            } else {
+                invalid++;
+            }
+        }
+        completed += strcmp(result, "complete") == 0;
+        wrongTotal += wrong;
+        invalidTotal += invalid;
+        wprintf(L"{\"event\":\"end\",\"session\":%d,\"result\":\"%s\",\"plies\":%d,\"wrong\":%d,\"invalid\":%d}\n", s, result, ply, wrong, invalid);
+    }
+
+    if (latencyCount > 0) {
+        qsort(latencies, latencyCount, sizeof(uint64_t), compare_latencies);
+    }
+    double percentiles[] = {50, 90, 99, 99.9};
+    char* names[] = {"p50", "p90", "p99", "p999"};
+    wprintf(L"{\"event\":\"summary\",\"sessions\":%d,\"complete\":%" PRIu64 ",\"moves\":%zu,\"wrong\":%" PRIu64 ",\"invalid\":%" PRIu64 ",\"latency_ns\":{",
+        sessions, completed, latencyCount, wrongTotal, invalidTotal);
+    for (int i = 0; i < 4; ++i) {
+        size_t rank = latencyCount > 0 ? (size_t)ceil(percentiles[i] / 100 * latencyCount) - 1 : 0;
+        wprintf(L"\"%s\":%" PRIu64 ",", names[i], latencyCount > 0 ? latencies[rank] : 0);
+    }
+    wprintf(L"\"max\":%" PRIu64 "}}\n", latencyCount > 0 ? latencies[latencyCount - 1] : 0);
+    free(latencies);
+    chessline_session_free(session);
+    chessline_scheduler_free(scheduler);
+    free_drill_script(&script);
+    return 0;
+}
+
+typedef struct {
+    char* inputPath;
+    bool asBlack;
+    bool asWhite;
+    bool blindMode;
+    char* progressPath;
+    char* gamesPath;
+    bool printStats;
+    bool watch;
+    bool uci;
+    char* scriptPath; // headless drill from a script, - for the standard input
+    int sessions;
+    bool schedule; // replies of script sessions follow lines weighted by errors
+    uint64_t seed;
+    char* tablebasePath; // Syzygy tables accepting moves that keep the outcome of endgames
+} options;
+
+options init_options() {
     options options;
     options.inputPath = "";
     options.asBlack = false;
     options.asWhite = false;
     options.blindMode = false;
+    options.progressPath = NULL;
+    options.gamesPath = NULL;
+    options.watch = false;
+    options.uci = false;
+    options.scriptPath = NULL;
+    options.sessions = 0;
+    options.schedule = false;
+    options.seed = 1;
+    options.tablebasePath = NULL;
+    options.printStats = false;
     return options;
 }
 
@@ -1070,6 +8565,26 @@ options parse_options(int argc, char* argv[]) {
             options.asWhite = true;
         } else if (strcmp(argv[i], "--blind") == 0) {
             options.blindMode = true;
+        } else if (strncmp(argv[i], "--progress=", 11) == 0) {
+            options.progressPath = argv[i] + 11;
+        } else if (strncmp(argv[i], "--games=", 8) == 0) {
+            options.gamesPath = argv[i] + 8;
+        } else if (strcmp(argv[i], "--stats=json") == 0) {
+            options.printStats = true;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            options.watch = true;
+        } else if (strcmp(argv[i], "--uci") == 0) {
+            options.uci = true;
+        } else if (strncmp(argv[i], "--script=", 9) == 0) {
+            options.scriptPath = argv[i] + 9;
+        } else if (strncmp(argv[i], "--sessions=", 11) == 0) {
+            options.sessions = atoi(argv[i] + 11);
+        } else if (strcmp(argv[i], "--schedule") == 0) {
+            options.schedule = true;
+        } else if (strncmp(argv[i], "--syzygy=", 9) == 0) {
+            options.tablebasePath = argv[i] + 9;
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            options.seed = strtoull(argv[i] + 7, NULL, 10);
         } else if (strlen(options.inputPath) == 0) {
             options.inputPath = argv[i];
         } else if (argv[i][0] == '-') {
@@ -1081,9 +8596,611 @@ options parse_options(int argc, char* argv[]) {
     return options;
 }
 
+#define SEE_MAX_EXCHANGES 32
+int seeValues[] = {0, 100, 300, 300, 500, 900, 20000}; // centipawns by pieceEnum
+
+/**
+ * Static exchange evaluation of the captures on square by side and back: the material side wins, both sides
+ * capturing with their least valuable attacker and free to stop, sliders behind a capturing piece joining in.
+ * Negative when the first capture already loses material, 0 when side does not attack square.
+ */
+int see_square(bitboards* b, int square, playerSide side) {
+    int gain[SEE_MAX_EXCHANGES];
+    int depth = 0;
+    int victim = b->squares[square];
+    uint64_t occupied = b->sides[white] | b->sides[black];
+    uint64_t attackers = attackers_to(b, square, occupied);
+    playerSide s = side;
+    while (depth < SEE_MAX_EXCHANGES) {
+        uint64_t own = attackers & b->sides[s];
+        if (own == 0) {
+            break;
+        }
+        int piece = pawn;
+        while ((own & b->pieces[piece]) == 0) {
+            piece++;
+        }
+        // what the capturing side is up if the exchange stops after this capture
+        gain[depth] = seeValues[victim] - (depth > 0 ? gain[depth - 1] : 0);
+        depth++;
+        victim = piece;
+        uint64_t from = own & b->pieces[piece];
+        occupied ^= from & -from;
+        // only sliders on the line through the capturing piece can be uncovered
+        if (piece == pawn || piece == bishop || piece == queen) {
+            attackers |= bishop_attacks(square, occupied) & (b->pieces[bishop] | b->pieces[queen]);
+        }
+        if (piece == rook || piece == queen) {
+            attackers |= rook_attacks(square, occupied) & (b->pieces[rook] | b->pieces[queen]);
+        }
+        attackers &= occupied;
+        s = s == white ? black : white;
+    }
+    if (depth == 0) {
+        return 0;
+    }
+    while (--depth > 0) {
+        gain[depth - 1] = -(-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]);
+    }
+    return gain[0];
+}
+
+/**
+ * Move of the repertoire flagged by `check --syzygy` or `scan`. With tablebases, the outcomes for the side making
+ * the move before and after it; otherwise the material it wins in centipawns, negative when it loses some, and
+ * the most the opponent can then win by capturing another piece.
+ */
+typedef struct {
+    moveTree* node;
+    int before;
+    int after;
+} checkFinding;
+
+/** Per thread results of `chessline check` and `chessline scan`. */
+typedef struct {
+    uint64_t nodes;
+    uint64_t leaves;
+    int maxPlies;
+    moveTree** illegal;
+    size_t illegalCount;
+    size_t illegalCapacity;
+    int splitDepth; // when positive, nodes this many plies below the start of the walk are left to other walks
+    tablebase* tablebase; // NULL unless moves are checked against endgame tablebases
+    bool scan; // whether moves are checked for material they lose or leave hanging
+    int threshold; // least material in centipawns a scanned move must lose or leave hanging to be recorded
+    int side; // side whose moves are checked against tablebases or scanned, -1 for both
+    checkFinding* findings;
+    size_t findingCount;
+    size_t findingCapacity;
+} treeCheck;
+
+void add_illegal_move(treeCheck* check, moveTree* t) {
+    if (check->illegalCount == check->illegalCapacity) {
+        check->illegalCapacity = check->illegalCapacity ? 2 * check->illegalCapacity : 16;
+        check->illegal = (moveTree**)realloc(check->illegal, check->illegalCapacity * sizeof(moveTree*));
+        if (check->illegal == NULL) {
+            fprintf(stderr, "Failed to allocate memory for check.\n");
+            exit(1);
+        }
+    }
+    check->illegal[check->illegalCount++] = t;
+}
+
+void add_check_finding(treeCheck* check, moveTree* t, int before, int after) {
+    if (check->findingCount == check->findingCapacity) {
+        check->findingCapacity = check->findingCapacity ? 2 * check->findingCapacity : 16;
+        check->findings = (checkFinding*)realloc(check->findings, check->findingCapacity * sizeof(checkFinding));
+        if (check->findings == NULL) {
+            fprintf(stderr, "Failed to allocate memory for check.\n");
+            exit(1);
+        }
+    }
+    checkFinding finding = {t, before, after};
+    check->findings[check->findingCount++] = finding;
+}
+
+/** Record the move of t, just made on the board of walk, when it gives away the tablebase outcome. */
+void check_tablebase_move(treeWalk* walk, treeCheck* check, moveTree* t) {
+    tablebaseResult after = probe_tablebase(check->tablebase, &walk->game);
+    if (after == tablebaseUnknown) {
+        return;
+    }
+    treeWalkFrame* f = &walk->stack[walk->depth];
+    game_unmake_move(&walk->game, &f->undo);
+    tablebaseResult before = probe_tablebase(check->tablebase, &walk->game);
+    game_make_move(&walk->game, &walk->resolved, &f->undo);
+    if (before == tablebaseUnknown || tablebaseWin - after >= before) {
+        return;
+    }
+    add_check_finding(check, t, before, tablebaseWin - after);
+}
+
+/**
+ * Record the move of t, just made on the board of walk, when the opponent then wins material: by exchanges on the
+ * destination square, or by capturing another piece. Moves giving check only answer for the destination square.
+ */
+void scan_move(treeWalk* walk, treeCheck* check, moveTree* t) {
+    if (t->move->isCheckmate) {
+        return;
+    }
+    treeWalkFrame* f = &walk->stack[walk->depth];
+    bitboards b;
+    init_bitboards(&b, walk->game.board);
+    playerSide opponent = walk->game.sidePlaying;
+    playerSide mover = opponent == white ? black : white;
+    int destination = f->undo.toRank * 8 + f->undo.toFile;
+    int won = f->undo.captured != empty ? seeValues[f->undo.captured < 0 ? -f->undo.captured : f->undo.captured] : 0;
+    if (b.squares[destination] != king) {
+        int recaptured = see_square(&b, destination, opponent);
+        won -= recaptured > 0 ? recaptured : 0;
+    }
+    int hanging = 0;
+    uint64_t occupied = b.sides[white] | b.sides[black];
+    uint64_t opponentKing = b.sides[opponent] & b.pieces[king];
+    if (opponentKing == 0 || (attackers_to(&b, __builtin_ctzll(opponentKing), occupied) & b.sides[mover]) == 0) {
+        uint64_t attacked = attacked_by(&b, opponent) & b.sides[mover] & ~b.pieces[king] & ~(1ULL << destination);
+        for (; attacked != 0; attacked &= attacked - 1) {
+            int lost = see_square(&b, __builtin_ctzll(attacked), opponent);
+            hanging = lost > hanging ? lost : hanging;
+        }
+    }
+    if (-won >= check->threshold || hanging >= check->threshold) {
+        add_check_finding(check, t, won, hanging);
+    }
+}
+
+walkAction check_tree_node(treeWalk* walk, moveTree* t) {
+    treeCheck* check = (treeCheck*)walk->context;
+    check->nodes++;
+    if (!walk->legal) {
+        // moves below an illegal one cannot be replayed
+        add_illegal_move(check, t);
+        return walkSkipChildren;
+    }
+    if (!t->isRoot && (check->side < 0 || t->move->side == (playerSide)check->side)) {
+        if (check->tablebase != NULL) {
+            check_tablebase_move(walk, check, t);
+        }
+        if (check->scan) {
+            scan_move(walk, check, t);
+        }
+    }
+    if (t->firstChoice == NULL) {
+        check->leaves++;
+    }
+    if (t->halfMoveNo > check->maxPlies) {
+        check->maxPlies = t->halfMoveNo;
+    }
+    return check->splitDepth > 0 && walk->depth + 1 >= check->splitDepth ? walkSkipChildren : walkContinue;
+}
+
+/**
+ * Find the shallowest level of the tree below root with at least minCount nodes, or its deepest level.
+ * Returns the nodes of the level, to be freed, with their number in count and their depth in plies below root.
+ */
+moveTree** find_tree_level(moveTree* root, int minCount, int* count, int* depth) {
+    moveTree** level = (moveTree**)malloc(sizeof(moveTree*));
+    STATS_ALLOC(sizeof(moveTree*));
+    int levelCount = 1;
+    *depth = 0;
+    if (level != NULL) {
+        level[0] = root;
+    }
+    while (level != NULL && (levelCount < minCount || *depth == 0)) {
+        int nextCount = 0;
+        for (int i = 0; i < levelCount; ++i) {
+            for (moveTree* c = level[i]->firstChoice; c != NULL; c = c->nextChoice) {
+                nextCount++;
+            }
+        }
+        if (nextCount == 0) {
+            break;
+        }
+        moveTree** next = (moveTree**)malloc(nextCount * sizeof(moveTree*));
+        STATS_ALLOC(nextCount * sizeof(moveTree*));
+        if (next != NULL) {
+            nextCount = 0;
+            for (int i = 0; i < levelCount; ++i) {
+                for (moveTree* c = level[i]->firstChoice; c != NULL; c = c->nextChoice) {
+                    next[nextCount++] = c;
+                }
+            }
+        }
+        free(level);
+        level = next;
+        levelCount = nextCount;
+        ++*depth;
+    }
+    if (level == NULL) {
+        fprintf(stderr, "Failed to allocate memory for tree level.\n");
+        exit(1);
+    }
+    *count = levelCount;
+    return level;
+}
+
+int compare_tree_nodes_by_order(const void* a, const void* b) {
+    moveTree* x = *(moveTree**)a;
+    moveTree* y = *(moveTree**)b;
+    return x->halfMoveNo != y->halfMoveNo ? x->halfMoveNo - y->halfMoveNo : (x < y ? -1 : x > y);
+}
+
+int compare_check_findings(const void* a, const void* b) {
+    return compare_tree_nodes_by_order(&((checkFinding*)a)->node, &((checkFinding*)b)->node);
+}
+
+/** Walk the whole tree of p with one check per thread, each check counting and recording the nodes it walked. */
+void walk_check_parallel(parser* p, treeCheck* checks, int threads) {
+    treeWalk walks[threads];
+    for (int i = 0; i < threads; ++i) {
+        init_tree_walk(&walks[i], p->initGameState, check_tree_node, NULL, &checks[i], &defaultAllocator);
+    }
+    // split the tree where there are enough subtrees to keep all threads busy, often deeper than the first moves
+    // of a repertoire: moves above are checked on this thread, and walks below start from position checkpoints
+    int splitCount, splitDepth;
+    moveTree** split = find_tree_level(p->moveTreeRoot, 8 * threads, &splitCount, &splitDepth);
+    if (splitDepth <= 1) {
+        walk_subtrees_parallel(p->moveTreeRoot, walks, threads);
+    } else {
+        checks[0].splitDepth = splitDepth - 1;
+        for (moveTree* c = p->moveTreeRoot->firstChoice; c != NULL; c = c->nextChoice) {
+            walk_tree(&walks[0], c);
+        }
+        checks[0].splitDepth = 0;
+        positionCheckpoints checkpoints;
+        if (!build_position_checkpoints(p->moveTreeRoot, p->initGameState, splitDepth - 1, splitDepth - 1, threads, &checkpoints, &defaultAllocator)) {
+            fprintf(stderr, "Failed to allocate memory for position checkpoints.\n");
+            exit(1);
+        }
+        walk_nodes_parallel(split, splitCount, &checkpoints, walks, threads);
+        free_position_checkpoints(&checkpoints);
+    }
+    free(split);
+    for (int i = 0; i < threads; ++i) {
+        free_tree_walk(&walks[i]);
+    }
+}
+
+/**
+ * Entry point of `chessline check`, replaying every move of a repertoire and reporting those that are illegal,
+ * and of `chessline scan`, reporting as well the moves that lose material or leave it hanging.
+ */
+int check_main(int argc, char* argv[]) {
+    bool scan = strcmp(argv[0], "scan") == 0;
+    char* path = NULL;
+    char* tablebasePath = NULL;
+    int side = -1;
+    int threshold = seeValues[pawn];
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (scan && strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = atoi(argv[i] + 12);
+        } else if (!scan && strncmp(argv[i], "--syzygy=", 9) == 0) {
+            tablebasePath = argv[i] + 9;
+        } else if (strcmp(argv[i], "--white") == 0 || strcmp(argv[i], "--black") == 0) {
+            side = argv[i][2] == 'w' ? white : black;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL || threads < 1 || threshold < 1) {
+        if (scan) {
+            fprintf(stderr, "Usage: $ chessline scan REPERTOIRE [--threads=T] [--threshold=CENTIPAWNS] [--white|--black]\n");
+        } else {
+            fprintf(stderr, "Usage: $ chessline check REPERTOIRE [--threads=T] [--syzygy=PATH [--white|--black]]\n");
+        }
+        return 1;
+    }
+    tablebase* tablebase = NULL;
+    if (tablebasePath != NULL && (tablebase = open_tablebase(tablebasePath)) == NULL) {
+        return 1;
+    }
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for reading.\n", path);
+        return 1;
+    }
+    parser* p = new_file_parser(fp);
+    parseResult res = parse(p);
+    if (res.hasError) {
+        fprintf(stderr, "%s", res.errorMessage);
+        return 1;
+    }
+    fclose(fp);
+
+    uint64_t start = stats_now_ns();
+    treeCheck checks[threads];
+    for (int i = 0; i < threads; ++i) {
+        memset(&checks[i], 0, sizeof(treeCheck));
+        checks[i].tablebase = tablebase;
+        checks[i].scan = scan;
+        checks[i].threshold = threshold;
+        checks[i].side = side;
+    }
+    walk_check_parallel(p, checks, threads);
+    treeCheck total;
+    memset(&total, 0, sizeof(treeCheck));
+    for (int i = 0; i < threads; ++i) {
+        total.nodes += checks[i].nodes;
+        total.leaves += checks[i].leaves;
+        total.maxPlies = checks[i].maxPlies > total.maxPlies ? checks[i].maxPlies : total.maxPlies;
+        for (size_t j = 0; j < checks[i].illegalCount; ++j) {
+            add_illegal_move(&total, checks[i].illegal[j]);
+        }
+        free(checks[i].illegal);
+        for (size_t j = 0; j < checks[i].findingCount; ++j) {
+            add_check_finding(&total, checks[i].findings[j].node, checks[i].findings[j].before, checks[i].findings[j].after);
+        }
+        free(checks[i].findings);
+    }
+    uint64_t elapsed = stats_now_ns() - start;
+
+    // report in a stable order whatever the number of threads
+    if (total.illegalCount > 0) {
+        qsort(total.illegal, total.illegalCount, sizeof(moveTree*), compare_tree_nodes_by_order);
+    }
+    char line[BUFFER_SIZE];
+    for (size_t i = 0; i < total.illegalCount; ++i) {
+        format_tree_line(total.illegal[i], line, sizeof(line));
+        wprintf(L"Illegal move: %s\n", line);
+    }
+    if (total.findingCount > 0) {
+        qsort(total.findings, total.findingCount, sizeof(checkFinding), compare_check_findings);
+    }
+    for (size_t i = 0; i < total.findingCount; ++i) {
+        checkFinding* finding = &total.findings[i];
+        format_tree_line(finding->node, line, sizeof(line));
+        if (tablebase != NULL) {
+            wprintf(L"Gives away a tablebase %s for a %s: %s\n", tablebaseResultNames[finding->before], tablebaseResultNames[finding->after], line);
+        } else if (-finding->before >= threshold) {
+            wprintf(L"Loses %.2f: %s\n", -finding->before / 100.0, line);
+        } else {
+            wprintf(L"Leaves %.2f hanging: %s\n", finding->after / 100.0, line);
+        }
+    }
+    wprintf(L"%" PRIu64 " moves, %" PRIu64 " lines, %d plies deep, %zu illegal (%.2fs, %d threads)\n",
+        total.nodes, total.leaves, total.maxPlies, total.illegalCount, elapsed / 1e9, threads);
+    if (tablebase != NULL) {
+        wprintf(L"%zu moves give away a tablebase outcome\n", total.findingCount);
+        close_tablebase(tablebase);
+    }
+    if (scan) {
+        wprintf(L"%zu moves lose material or leave it hanging (%.2fM moves/s)\n", total.findingCount, elapsed > 0 ? total.nodes * 1e3 / elapsed : 0.0);
+    }
+    free(total.illegal);
+    free(total.findings);
+    free_parser(p);
+    return total.illegalCount > 0 || total.findingCount > 0;
+}
+
+/** Position exported by `chessline diagrams`, with the squares of the move leading to it, -1 at the start. */
+typedef struct {
+    moveTree* node;
+    sidedPiece board[8][8];
+    int from;
+    int to;
+} diagramPosition;
+
+typedef struct {
+    diagramPosition* items;
+    size_t count;
+    size_t capacity;
+} diagramPositions;
+
+/** Collect the positions where the repertoire has more than one move, skipping lines below illegal moves. */
+walkAction collect_diagram_position(treeWalk* walk, moveTree* t) {
+    if (!walk->legal) {
+        return walkSkipChildren;
+    }
+    if (t->firstChoice == NULL || t->firstChoice->nextChoice == NULL) {
+        return walkContinue;
+    }
+    diagramPositions* positions = (diagramPositions*)walk->context;
+    if (positions->count == positions->capacity) {
+        positions->capacity = positions->capacity ? 2 * positions->capacity : 256;
+        positions->items = (diagramPosition*)realloc(positions->items, positions->capacity * sizeof(diagramPosition));
+        STATS_ALLOC(positions->capacity / 2 * sizeof(diagramPosition));
+        if (positions->items == NULL) {
+            fprintf(stderr, "Failed to allocate memory for diagrams.\n");
+            exit(1);
+        }
+    }
+    diagramPosition* position = &positions->items[positions->count++];
+    position->node = t;
+    memcpy(position->board, walk->game.board, sizeof(position->board));
+    position->from = -1;
+    position->to = -1;
+    treeWalkFrame* f = &walk->stack[walk->depth];
+    if (f->moved) {
+        position->from = f->undo.fromRank * 8 + f->undo.fromFile;
+        position->to = f->undo.toRank * 8 + f->undo.toFile;
+    }
+    return walkContinue;
+}
+
+/** Range of diagrams rendered and written by one thread, into a buffer reused for each of them. */
+typedef struct {
+    diagramTemplates* templates;
+    diagramPosition* positions;
+    size_t first;
+    size_t last;
+    char* directory;
+    bool aswhite;
+    uint64_t bytes;
+    size_t failed;
+} diagramWorker;
+
+void* diagram_worker(void* arg) {
+    diagramWorker* w = (diagramWorker*)arg;
+    char* buffer = (char*)malloc(w->templates->bufferSize);
+    STATS_ALLOC(w->templates->bufferSize);
+    if (buffer == NULL) {
+        fprintf(stderr, "Failed to allocate memory for diagrams.\n");
+        exit(1);
+    }
+    char path[PATH_MAX];
+    char* extension = w->templates->format == diagramPpm ? "ppm" : "svg";
+    for (size_t i = w->first; i < w->last; ++i) {
+        diagramPosition* position = &w->positions[i];
+        size_t length = render_diagram(w->templates, position->board, w->aswhite, position->from, position->to, buffer);
+        snprintf(path, sizeof(path), "%s/%06zu.%s", w->directory, i + 1, extension);
+        FILE* fp = fopen(path, "wb");
+        bool written = fp != NULL && fwrite(buffer, 1, length, fp) == length;
+        if (fp != NULL && fclose(fp) != 0) {
+            written = false;
+        }
+        if (!written) {
+            w->failed++;
+            continue;
+        }
+        w->bytes += length;
+    }
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Entry point of `chessline diagrams`, writing a diagram of every position where the repertoire branches into
+ * a directory, numbered in the order of the repertoire, with an index of the line leading to each.
+ */
+int diagrams_main(int argc, char* argv[]) {
+    char* paths[2] = {NULL, NULL};
+    int pathCount = 0;
+    diagramFormat format = diagramSvg;
+    int squareSize = 45;
+    bool aswhite = true;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threads = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--format=svg") == 0 || strcmp(argv[i], "--format=ppm") == 0) {
+            format = argv[i][9] == 'p' ? diagramPpm : diagramSvg;
+        } else if (strncmp(argv[i], "--size=", 7) == 0) {
+            squareSize = atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--white") == 0 || strcmp(argv[i], "--black") == 0) {
+            aswhite = argv[i][2] == 'w';
+        } else if (argv[i][0] != '-' && pathCount < 2) {
+            paths[pathCount++] = argv[i];
+        } else {
+            pathCount = 0;
+            break;
+        }
+    }
+    if (pathCount != 2 || threads < 1 || squareSize < 1 || squareSize > 1024) {
+        fprintf(stderr, "Usage: $ chessline diagrams REPERTOIRE DIRECTORY [--format=svg|ppm] [--size=PIXELS] [--threads=T] [--white|--black]\n");
+        return 1;
+    }
+    char* directory = paths[1];
+    struct stat st;
+    if (stat(directory, &st) != 0 ? mkdir(directory, 0777) != 0 : !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Failed to create directory %s.\n", directory);
+        return 1;
+    }
+    FILE* fp = fopen(paths[0], "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to open %s for reading.\n", paths[0]);
+        return 1;
+    }
+    parser* p = new_file_parser(fp);
+    parseResult res = parse(p);
+    if (res.hasError) {
+        fprintf(stderr, "%s", res.errorMessage);
+        return 1;
+    }
+    fclose(fp);
+
+    uint64_t start = stats_now_ns();
+    diagramPositions positions = {NULL, 0, 0};
+    treeWalk walk;
+    init_tree_walk(&walk, p->initGameState, collect_diagram_position, NULL, &positions, &defaultAllocator);
+    if (!walk_tree(&walk, p->moveTreeRoot)) {
+        fprintf(stderr, "Failed to allocate memory for tree walk.\n");
+        exit(1);
+    }
+    free_tree_walk(&walk);
+
+    // the index is written while the threads render, from the positions they only read
+    diagramTemplates templates;
+    build_diagram_templates(&templates, format, squareSize);
+    diagramWorker workers[threads];
+    pthread_t ids[threads];
+    for (int i = 0; i < threads; ++i) {
+        memset(&workers[i], 0, sizeof(diagramWorker));
+        workers[i].templates = &templates;
+        workers[i].positions = positions.items;
+        workers[i].first = positions.count * i / threads;
+        workers[i].last = positions.count * (i + 1) / threads;
+        workers[i].directory = directory;
+        workers[i].aswhite = aswhite;
+        if (pthread_create(&ids[i], NULL, diagram_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start diagram thread.\n");
+            exit(1);
+        }
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/index.txt", directory);
+    FILE* index = fopen(path, "w");
+    bool indexed = index != NULL;
+    char line[BUFFER_SIZE];
+    for (size_t i = 0; indexed && i < positions.count; ++i) {
+        format_tree_line(positions.items[i].node, line, sizeof(line));
+        indexed = fprintf(index, "%06zu.%s %s\n", i + 1, format == diagramPpm ? "ppm" : "svg", line) > 0;
+    }
+    if (index != NULL && fclose(index) != 0) {
+        indexed = false;
+    }
+    uint64_t bytes = 0;
+    size_t failed = 0;
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(ids[i], NULL);
+        bytes += workers[i].bytes;
+        failed += workers[i].failed;
+    }
+    uint64_t elapsed = stats_now_ns() - start;
+
+    if (!indexed) {
+        fprintf(stderr, "Failed to write %s.\n", path);
+    }
+    if (failed > 0) {
+        fprintf(stderr, "Failed to write %zu diagrams into %s.\n", failed, directory);
+    }
+    wprintf(L"%zu diagrams, %.1f MB written to %s (%.2fs, %.0f diagrams/s, %d threads)\n", positions.count - failed, bytes / 1e6,
+        directory, elapsed / 1e9, elapsed > 0 ? (positions.count - failed) * 1e9 / elapsed : 0.0, threads);
+    free_diagram_templates(&templates);
+    free(positions.items);
+    free_parser(p);
+    return indexed && failed == 0 ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
     setlocale(LC_ALL, ""); // required for unicode to display properly
-    srand(time(0));
+    chessline_init();
+    init_attack_tables();
+
+    if (argc >= 2 && strcmp(argv[1], "generate") == 0) {
+        return generate_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        return bench_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "index") == 0) {
+        return index_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "coverage") == 0) {
+        return coverage_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "check") == 0) {
+        return check_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "store") == 0) {
+        return store_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "diagrams") == 0) {
+        return diagrams_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "scan") == 0) {
+        return check_main(argc - 1, argv + 1);
+    } else if (argc >= 2 && strcmp(argv[1], "pack") == 0) {
+        return pack_main(argc - 1, argv + 1);
+    }
 
     if (argc < 2) {
         fprintf(stderr, "No variants input file specified.\nUsage: $ %s INPUT_FILE\n", argv[0]);
@@ -1098,17 +9215,107 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    parser* p = new_parser(fp);
-    parseResult res = parse(p);
-    if (res.hasError) {
-        fprintf(stderr, "%s", res.errorMessage);
-        return 1;
+    if (options.printStats) {
+#ifdef CHESSLINE_STATS
+        atexit(print_stats_json);
+#else
+        fprintf(stderr, "Statistics are not available, compile with -DCHESSLINE_STATS.\n");
+#endif
+    }
+
+    uint64_t random = time(0);
+    progressStore* progress = NULL;
+    if (options.progressPath != NULL) {
+        progress = open_progress_store(options.progressPath);
+    }
+    positionIndex* games = NULL;
+    if (options.gamesPath != NULL) {
+        games = open_position_index(options.gamesPath);
+    }
+
+    if (is_succinct_tree_file(fp)) {
+        fclose(fp);
+        if (options.watch || options.uci || options.scriptPath != NULL) {
+            fprintf(stderr, "--watch, --uci and --script need the repertoire text, not a packed repertoire.\n");
+            return 1;
+        }
+        succinctTree* tree = open_succinct_tree(options.inputPath);
+        gameState game = tree->header->initial;
+        uint64_t start = 0;
+        if ((options.asWhite && game.sidePlaying != white) || (options.asBlack && game.sidePlaying != black)) {
+            start = succinct_choose(tree, 0, &random);
+        }
+        play_succinct(tree, start, &game, options.blindMode, progress, games, &random);
+        if (progress != NULL) {
+            close_progress_store(progress);
+        }
+        if (games != NULL) {
+            close_position_index(games);
+        }
+        free_succinct_tree(tree);
+        free(tree);
+        return 0;
+    }
+
+    parser* p;
+    repertoireWatch* watch = NULL;
+    if (options.watch && options.scriptPath == NULL) {
+        fclose(fp);
+        watch = open_repertoire_watch(options.inputPath);
+        if (watch == NULL) {
+            return 1;
+        }
+        p = watch->parser;
+    } else {
+        p = new_file_parser(fp);
+        parseResult res = parse(p);
+        if (res.hasError) {
+            fprintf(stderr, "%s", res.errorMessage);
+            return 1;
+        }
     }
+#ifdef CHESSLINE_STATS
+    if (options.printStats) {
+        stats_record_tree(p->moveTreeRoot);
+    }
+#endif
 
-    if (options.asWhite && p->moveTreeRoot->move->side != black || options.asBlack && p->moveTreeRoot->move->side != white) {
+    if (options.uci) {
+        openingBook* book = build_opening_book(p->moveTreeRoot, p->initGameState);
+        int status = uci_main(book, random);
+        free_opening_book(book);
+        free_parser(p);
+        return status;
+    }
+    moveTree* start = p->moveTreeRoot;
+    bool computerFirst = (options.asWhite && start->move->side != black) || (options.asBlack && start->move->side != white);
+    if (options.scriptPath != NULL) {
+        int status = run_drill_script(p, options.scriptPath, options.sessions, options.seed, computerFirst, options.schedule, progress);
+        if (progress != NULL) {
+            close_progress_store(progress);
+        }
+        free_parser(p);
+        return status;
+    }
+    if (computerFirst) {
         // let computer play first move if tree starts from the other side than user selected
-        p->moveTreeRoot = choose_move(p->moveTreeRoot);
+        start = choose_move(start, &random);
+    }
+    tablebase* tablebase = NULL;
+    if (options.tablebasePath != NULL && (tablebase = open_tablebase(options.tablebasePath)) == NULL) {
+        return 1;
+    }
+    play(start, p->initGameState, options.blindMode, progress, games, watch, tablebase, &random);
+    if (tablebase != NULL) {
+        close_tablebase(tablebase);
+    }
+    if (progress != NULL) {
+        close_progress_store(progress);
+    }
+    if (games != NULL) {
+        close_position_index(games);
     }
-    play(p->moveTreeRoot, p->initGameState, options.blindMode);
     free(p);
 }
+
+#endif